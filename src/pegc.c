@@ -2,6 +2,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <locale.h>
+
+/**
+   If true, pegc_create_parser_from_file() maps regular files into
+   memory instead of reading them. Requires POSIX mmap().
+*/
+#if !defined(PEGC_USE_MMAP)
+#  if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#    define PEGC_USE_MMAP 1
+#  else
+#    define PEGC_USE_MMAP 0
+#  endif
+#endif
+#if PEGC_USE_MMAP
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <sys/mman.h>
+#endif
+
+/**
+   If true, pegc_parse_parallel() runs its workers on POSIX threads.
+   Otherwise it parses all chunks in the calling thread.
+*/
+#if !defined(PEGC_USE_THREADS)
+#  if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#    define PEGC_USE_THREADS 1
+#  else
+#    define PEGC_USE_THREADS 0
+#  endif
+#endif
+#if PEGC_USE_THREADS
+#  include <pthread.h>
+#endif
 
 #if defined(__cplusplus)
 extern "C" {
@@ -22,6 +56,7 @@ extern "C" {
 #include "pegc.h"
 #include "whclob.h"
 #include "whgc.h"
+#include "vappendf.h"
 
 
 const pegc_cursor pegc_cursor_init = PEGC_CURSOR_INIT;
@@ -94,36 +129,349 @@ typedef struct PegcAction PegcAction;
 static const PegcAction PegcAction_init = PEGCACTION_INIT;
 
 /**
-   Internal type to hold a linked list of queues actions.
+   The kinds of values stored in pegc_number objects.
+*/
+enum pegc_number_kinds
+{
+PegcNumber_None = 0,
+PegcNumber_Long,
+PegcNumber_Double
+};
+
+/**
+   The value converted by the most recent match of one of the native
+   number rules (PegcRule_int_dec and friends), along with the range
+   it was converted from. See pegc_get_number_long().
+*/
+struct pegc_number
+{
+    int kind;
+    pegc_const_iterator begin;
+    pegc_const_iterator end;
+    long lval;
+    double dval;
+};
+typedef struct pegc_number pegc_number;
+#define PEGC_NUMBER_INIT { PegcNumber_None, 0, 0, 0, 0.0 }
+
+/**
+   One entry in a parser's delayed action queue.
 */
 struct pegc_action
 {
-    /**
-       Previous item in the list. Used for destruction traversal.
-    */
-    struct pegc_action * left;
-    /**
-       Next item in the list. Used for action trigger traversal.
-    */
-    struct pegc_action * right;
     /**
        This object's action.
     */
     PegcAction action;
+    /**
+       The number converted from action.match, if any.
+    */
+    pegc_number number;
 };
 typedef struct pegc_action pegc_action;
-#define PEGC_ACTION_INIT {0,0,PEGCACTION_INIT}
+#define PEGC_ACTION_INIT {PEGCACTION_INIT,PEGC_NUMBER_INIT}
 static const pegc_action pegc_action_init = PEGC_ACTION_INIT;
 
+/**
+   A parser's queue of delayed actions: a growable array, in the
+   order the actions were queued. Clearing it keeps the memory for
+   re-use.
+*/
+struct pegc_action_queue
+{
+    pegc_action * list;
+    size_t capacity;
+    size_t count;
+};
+typedef struct pegc_action_queue pegc_action_queue;
+#define PEGC_ACTION_QUEUE_INIT { 0, 0, 0 }
+
 
 
 #define PEGC_STATS_INIT {\
     0, /* gc_count */	\
     0, /* alloced */			\
-    0 /* gc_internals_alloced */	\
+    0, /* gc_internals_alloced */	\
+    0, /* memo_hits */	\
+    0 /* memo_misses */	\
 }
 static const pegc_stats pegc_stats_init = PEGC_STATS_INIT;
 
+/**
+   States for pegc_memo_entry::state.
+*/
+enum pegc_memo_state { PegcMemo_Empty = 0,
+		       PegcMemo_Failed = 1,
+		       PegcMemo_Matched = 2,
+		       /**
+			  The following are only used by left-recursive
+			  rules (see pegc_r_leftrec()). Growing* mark a
+			  seed which is still being grown, and Stale marks
+			  a result which depended on another rule's seed
+			  and must be recomputed.
+		       */
+		       PegcMemo_GrowingFailed = 3,
+		       PegcMemo_GrowingMatched = 4,
+		       PegcMemo_Stale = 5
+};
+
+/**
+   Value used in pegc_memo_entry::mbegin to mark that no match
+   range was set when the entry was recorded.
+*/
+#define PEGC_MEMO_NOMATCH ((size_t)-1)
+
+/**
+   Identifies a rule for memoization purposes.
+*/
+struct pegc_memo_key
+{
+    PegcRule_mf rule;
+    void const * data;
+    PegcRule const * proxy;
+};
+typedef struct pegc_memo_key pegc_memo_key;
+
+/**
+   One memoized result in a pegc_memo table. Positions are stored as
+   offsets from the start of the input.
+*/
+struct pegc_memo_entry
+{
+    /**
+       The memo key. Copies of a rule share the same rule function,
+       data, and proxy, and therefore the same memo entries. An entry
+       with a null key.rule is unused.
+    */
+    pegc_memo_key key;
+    /**
+       Offset at which the rule was run.
+    */
+    size_t offset;
+    /**
+       Offset of the cursor after the rule ran.
+    */
+    size_t end;
+    /**
+       The match range set by the rule, or PEGC_MEMO_NOMATCH.
+    */
+    size_t mbegin;
+    size_t mend;
+    /**
+       Offset of the farthest byte the rule (or any of its sub-rules)
+       looked at. The rule's result depends only on the input in the
+       range [offset,far] (plus one byte of look-behind), which is
+       what lets pegc_edit_input() keep the entries an edit did not
+       touch.
+    */
+    size_t far;
+    /**
+       One of the pegc_memo_state values.
+    */
+    int state;
+};
+typedef struct pegc_memo_entry pegc_memo_entry;
+
+/**
+   Holds a parser's packrat memoization state. Both tables use open
+   addressing with linear probing and a power-of-two capacity.
+*/
+struct pegc_memo
+{
+    pegc_memo_mode mode;
+    /**
+       Memoized results, keyed on (rule,offset).
+    */
+    pegc_memo_entry * list;
+    size_t capacity;
+    size_t count;
+    /**
+       The set of rules marked via pegc_memoize_rule().
+    */
+    pegc_memo_key * marked;
+    size_t marked_capacity;
+    size_t marked_count;
+    /**
+       Number of left-recursive rules currently growing a seed. While
+       this is non-zero, results are not memoized because they may
+       depend on a seed which is not yet final.
+    */
+    size_t growing;
+    /**
+       The farthest input position looked at by the rules run since
+       the innermost pending pegc_memo_call() started, or 0. See
+       pegc_touch().
+    */
+    pegc_const_iterator far;
+};
+typedef struct pegc_memo pegc_memo;
+#define PEGC_MEMO_INIT { PEGC_MEMO_OFF, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+/**
+   Newline index used by pegc_line_col_at(). It is built lazily, and
+   only as far into the input as has been asked about.
+*/
+struct pegc_lines
+{
+    /**
+       Offsets (from the start of the input) of the newlines found so
+       far, in ascending order.
+    */
+    size_t * list;
+    size_t capacity;
+    size_t count;
+    /** Offset of the first byte which has not been scanned. */
+    size_t scanned;
+};
+typedef struct pegc_lines pegc_lines;
+#define PEGC_LINES_INIT { 0, 0, 0, 0 }
+
+/**
+   What a pegc_errinfo describes. pegc_get_error() turns each kind
+   into text.
+*/
+enum pegc_error_codes {
+PegcError_None = 0,
+/** Text formatted by pegc_set_error_v(), kept in pegc_errinfo::text. */
+PegcError_Format,
+/**
+   Unterminated quoted string. arg[0] is the offset where the string
+   started and arg[1] indexes pegc_quoted_error_details.
+*/
+PegcError_QuotedString,
+/**
+   pegc_set_match() range out of bounds. ptr[] holds the begin and
+   end iterators and arg[0] the movePos flag.
+*/
+PegcError_MatchBounds
+};
+
+/** Size of the buffer pegc_set_error_v() formats into. */
+#define PEGC_ERROR_TEXT_MAX 512
+
+/**
+   Error state of a parser. Setting an error only records it here:
+   nothing is allocated and line/column are not computed. The message
+   is built from these fields the first time pegc_get_error() asks
+   for it, and cached until the error changes.
+*/
+struct pegc_errinfo
+{
+    /** One of pegc_error_codes. PegcError_None means no error. */
+    int code;
+    /** Input offset (from pegc_begin()) the error was set at. */
+    size_t pos;
+    /** Code-specific arguments. */
+    size_t arg[2];
+    /** Code-specific pointer arguments. */
+    void const * ptr[2];
+    /** Bytes used in text, not counting the terminating NUL. */
+    size_t used;
+    /** The pegc_set_error_v() text, possibly truncated. */
+    char text[PEGC_ERROR_TEXT_MAX];
+    /** Rendered message, or 0 if it has not been asked for yet. */
+    char * message;
+    /** Line and column of pos. Valid once message is set. */
+    size_t line;
+    size_t col;
+};
+typedef struct pegc_errinfo pegc_errinfo;
+#define PEGC_ERRINFO_INIT { PegcError_None, 0, {0,0}, {0,0}, 0, {0}, 0, 0, 0 }
+
+/** Kinds of VM stack entries. */
+enum pegc_vm_frame_kinds {
+PegcFrame_Choice,
+PegcFrame_Call,
+PegcFrame_Mark,
+PegcFrame_Count
+};
+
+/**
+   One entry in the VM's backtracking stack.
+*/
+struct pegc_vm_frame
+{
+    int kind;
+    size_t pc;
+    pegc_const_iterator pos;
+    /**
+       The repetition count of a PegcFrame_Count entry, or the size
+       of the delayed action queue when a PegcFrame_Choice entry was
+       pushed (or last updated), so that backtracking can drop the
+       actions queued since then.
+    */
+    size_t count;
+};
+typedef struct pegc_vm_frame pegc_vm_frame;
+
+/**
+   The backtracking stack used by pegc_parse_program(). It is owned by
+   the parser so that its memory can be re-used across parses.
+*/
+struct pegc_vm_stack
+{
+    pegc_vm_frame * list;
+    size_t capacity;
+    /**
+       Number of entries in use. Only updated when the VM calls out
+       to a native rule (which might run another program), so that
+       nested programs push their entries above ours.
+    */
+    size_t count;
+};
+typedef struct pegc_vm_stack pegc_vm_stack;
+#define PEGC_VM_STACK_INIT { 0, 0, 0 }
+
+/**
+   Max number of byte ranges in a pegc_span_set's range list.
+*/
+#define PEGC_SPAN_MAX_RANGES 8
+
+/**
+   A set of bytes matched by a single-byte rule, prepared for fast
+   scanning by pegc_span().
+*/
+struct pegc_span_set
+{
+    /** The rule this set was made for. */
+    pegc_memo_key key;
+    unsigned char bits[32];
+    /**
+       The set (or its complement, if negated is true) as a list of
+       inclusive byte ranges, for use by the SIMD kernels. nranges is
+       0 if there are too many ranges.
+    */
+    unsigned char lo[PEGC_SPAN_MAX_RANGES];
+    unsigned char hi[PEGC_SPAN_MAX_RANGES];
+    int nranges;
+    bool negated;
+    /**
+       True if the set holds every byte but stop, in which case
+       pegc_span() is a memchr() for stop.
+    */
+    bool single;
+    unsigned char stop;
+};
+typedef struct pegc_span_set pegc_span_set;
+
+/**
+   A parser's cache of pegc_span_set objects, keyed by rule
+   contents. Uses open addressing with a power-of-two capacity.
+*/
+struct pegc_span_cache
+{
+    pegc_span_set * list;
+    size_t capacity;
+    size_t count;
+};
+typedef struct pegc_span_cache pegc_span_cache;
+#define PEGC_SPAN_CACHE_INIT { 0, 0, 0 }
+
+/**
+   Default value for pegc_parser::depth_limit.
+*/
+#define PEGC_DEPTH_LIMIT_DEFAULT 10000
+
 /**
    The main parser state type. It is 100% opaque - never rely on any
    internals of this type.
@@ -142,14 +490,19 @@ struct pegc_parser
     */
     pegc_match_listener_data * listeners;
     /**
-       Queued actions are stored here. This item is the right-most
-       action in the list.
+       Queued delayed actions.
     */
-    pegc_action * actions;
+    pegc_action_queue actions;
     /**
        Generic garbage collector.
     */
     whgc_context * gc;
+    /**
+       Memory for rules, rule data, and names, allocated via
+       pegc_alloc(). This is the most recently allocated block, which
+       is the one allocations are taken from.
+    */
+    struct pegc_arena_block * arena;
     /**
        Holds error reporting info.
 
@@ -157,12 +510,111 @@ struct pegc_parser
        all errors added via pegc_set_error_e()
        into one report string.
     */
-    struct errinfo {
-	char * message;
-	size_t line;
-	size_t col;
-    } errinfo;
+    pegc_errinfo errinfo;
     pegc_stats stats;
+    /**
+       Packrat memoization state.
+    */
+    pegc_memo memo;
+    /**
+       Newline index for pegc_line_col_at().
+    */
+    pegc_lines lines;
+    /**
+       The farthest failure of a terminal rule. See pegc_fail_note().
+    */
+    struct
+    {
+	/** One more than the input offset of the failure, or 0. */
+	size_t end;
+	size_t count;
+	bool truncated;
+	PegcRule expected[PEGC_FAILURE_MAX_EXPECTED];
+    } failure;
+    /**
+       Current nesting level of rules run via pegc_rule_call().
+    */
+    size_t depth;
+    /**
+       Max value for depth and for the number of entries in vm.
+       0 means no limit.
+    */
+    size_t depth_limit;
+    /**
+       Backtracking stack for pegc_parse_program().
+    */
+    pegc_vm_stack vm;
+    /**
+       Byte sets for the fast paths of star, plus, and repeat.
+    */
+    pegc_span_cache spans;
+    /**
+       Set by the native number rules.
+    */
+    pegc_number number;
+    /**
+       Input owned by the parser, as set up by
+       pegc_create_parser_from_file(). Freed (or unmapped, if mapped
+       is true) by pegc_destroy_parser().
+    */
+    struct owned_input {
+	void * mem;
+	size_t size;
+	bool mapped;
+    } owned;
+    /**
+       Streaming input state. See pegc_stream_begin().
+    */
+    struct stream_info {
+	/** The rule for one item of the stream. */
+	PegcRule const * item;
+	/** Buffered input. The cursor points into this. */
+	char * buf;
+	size_t capacity;
+	/** Number of bytes in buf. */
+	size_t size;
+	/** Offset in buf of the first byte not yet parsed. */
+	size_t start;
+	/** Stream offset of buf[0], for error reporting. */
+	size_t offset;
+	bool active;
+	/** True once pegc_stream_end() has been called. */
+	bool final;
+	/**
+	   Set when a rule looks at the end of the buffered input,
+	   meaning that its result might change once more input
+	   arrives. See pegc_touch().
+	*/
+	bool starved;
+    } stream;
+    /**
+       The grammar this parser was created for by
+       pegc_create_grammar_parser(), or 0.
+    */
+    pegc_grammar const * grammar;
+    /**
+       Dispatch tables created by pegc_r_or_dispatch() via this
+       parser which might not be built yet. pegc_grammar_freeze()
+       builds them, because they are otherwise built lazily while
+       parsing.
+    */
+    struct pegc_or_dispatch * dispatch;
+};
+
+/**
+   A grammar which can be shared by several parsers. See
+   pegc_create_grammar().
+*/
+struct pegc_grammar
+{
+    /**
+       The parser which owns the grammar's rules.
+    */
+    pegc_parser * builder;
+    /**
+       Set by pegc_grammar_freeze().
+    */
+    bool frozen;
 };
 
 static const pegc_parser
@@ -170,14 +622,42 @@ pegc_parser_init = { 0, /* name */
 		    {0,0,0}, /* cursor */
 		    {0,0,0}, /* match */
 		     0, /* listeners */
-		     0, /* actions */
+		     PEGC_ACTION_QUEUE_INIT, /* actions */
 		     0, /* gc */
-		     {/* errinfo */
-		     0, /* message */
-		     0, /* line */
-		     0 /* col */
+		     0, /* arena */
+		     PEGC_ERRINFO_INIT, /* errinfo */
+		     PEGC_STATS_INIT,
+		     PEGC_MEMO_INIT,
+		     PEGC_LINES_INIT,
+		     {/* failure */
+		     0, /* end */
+		     0, /* count */
+		     false, /* truncated */
+		     {PEGCRULE_INIT} /* expected */
+		     },
+		     0, /* depth */
+		     PEGC_DEPTH_LIMIT_DEFAULT, /* depth_limit */
+		     PEGC_VM_STACK_INIT,
+		     PEGC_SPAN_CACHE_INIT,
+		     PEGC_NUMBER_INIT,
+		     {/* owned */
+		     0, /* mem */
+		     0, /* size */
+		     false /* mapped */
+		     },
+		     {/* stream */
+		     0, /* item */
+		     0, /* buf */
+		     0, /* capacity */
+		     0, /* size */
+		     0, /* start */
+		     0, /* offset */
+		     false, /* active */
+		     false, /* final */
+		     false /* starved */
 		     },
-		     PEGC_STATS_INIT
+		     0, /* grammar */
+		     0 /* dispatch */
 };
 
 void pegc_add_match_listener( pegc_parser * st,
@@ -221,18 +701,6 @@ void pegc_free( void * k )
     free(k);
 }
 
-static void pegc_free_key( void * k )
-{
-    //MARKER; printf("Freeing KEY (void*) @%p\n",k);
-    free(k);
-}
-
-static void pegc_free_value( void * k )
-{
-    //MARKER; printf("Freeing VALUE (void*) @%p\n",k);
-    free(k);
-}
-
 void pegc_gc_test_listener( whgc_event const * ev )
 {
 #if 0
@@ -270,8 +738,11 @@ bool pegc_gc_register( pegc_parser * st,
 
 void * pegc_gc_search( pegc_parser const * st, void const * key )
 {
-    if( !st || !key || !st->gc ) return 0;
-    return whgc_search( st->gc, key );
+    if( !st || !key ) return 0;
+    void * v = st->gc ? whgc_search( st->gc, key ) : 0;
+    /* A frozen grammar's builder is never modified, so this is safe
+       from any number of threads. */
+    return (! v && st->grammar) ? pegc_gc_search( st->grammar->builder, key ) : v;
 }
 
 /**
@@ -286,6 +757,81 @@ bool pegc_gc_add( pegc_parser * st, void * item, void (*dtor)(void*) )
     return pegc_gc_register( st, item, dtor, item, 0 );
 }
 
+/**
+   Used for aligning pegc_alloc() results suitably for any type.
+*/
+union pegc_arena_align
+{
+    long double ld;
+    long long ll;
+    void * p;
+    void (*f)(void);
+};
+
+/**
+   One block of memory in a parser's arena (see pegc_alloc()).
+*/
+struct pegc_arena_block
+{
+    /** The previously allocated block. */
+    struct pegc_arena_block * next;
+    /** Number of usable bytes in mem. */
+    size_t size;
+    /** Number of bytes of mem which are in use. */
+    size_t used;
+    union pegc_arena_align mem[];
+};
+typedef struct pegc_arena_block pegc_arena_block;
+
+/**
+   Default size of a pegc_arena_block's usable memory. Allocations
+   of more than a quarter of this get a block of their own.
+*/
+#define PEGC_ARENA_BLOCK_SIZE (8 * 1024)
+
+void * pegc_alloc( pegc_parser * st, size_t n )
+{
+    if( ! st ) return 0;
+    size_t const a = sizeof(union pegc_arena_align);
+    n = n ? (((n + a - 1) / a) * a) : a;
+    pegc_arena_block * b = st->arena;
+    if( ! b || ((b->size - b->used) < n) )
+    {
+	size_t const sz = (n > (PEGC_ARENA_BLOCK_SIZE / 4)) ? n : PEGC_ARENA_BLOCK_SIZE;
+	pegc_arena_block * nb = (pegc_arena_block *)calloc( 1, sizeof(pegc_arena_block) + sz );
+	if( ! nb ) return 0;
+	st->stats.alloced += sizeof(pegc_arena_block) + sz;
+	nb->size = sz;
+	if( b && (sz == n) )
+	{ /* Keep allocating small objects from the current block. */
+	    nb->next = b->next;
+	    b->next = nb;
+	    nb->used = n;
+	    return nb->mem;
+	}
+	nb->next = b;
+	st->arena = b = nb;
+    }
+    void * p = (char *)b->mem + b->used;
+    b->used += n;
+    return p;
+}
+
+/**
+   Returns a copy of str allocated via pegc_alloc(), and frees str,
+   which must have been allocated by malloc(). Returns 0 if str is 0
+   or on allocation error.
+*/
+static char * pegc_alloc_own_string( pegc_parser * st, char * str )
+{
+    if( ! str ) return 0;
+    size_t const n = strlen( str ) + 1;
+    char * ret = (char *)pegc_alloc( st, n );
+    if( ret ) memcpy( ret, str, n );
+    pegc_free( str );
+    return ret;
+}
+
 /**
    Holds internal data for pegc actions.
 */
@@ -308,6 +854,14 @@ bool pegc_init_cursor( pegc_cursor * it, pegc_const_iterator begin, pegc_const_i
 
 bool pegc_set_input( pegc_parser * st, pegc_const_iterator begin, long length )
 {
+    pegc_clear_memo( st );
+    if( st )
+    {
+	st->number.kind = PegcNumber_None;
+	st->stream.active = false;
+	st->lines.count = st->lines.scanned = 0;
+	st->failure.end = 0;
+    }
     return pegc_set_error_e( st, 0, 0 )
 	&& pegc_init_cursor( &st->cursor, begin,
 			     (length < 0)
@@ -315,6 +869,36 @@ bool pegc_set_input( pegc_parser * st, pegc_const_iterator begin, long length )
 			     : (begin + length) );
 }
 
+bool pegc_reset( pegc_parser * st, pegc_const_iterator begin, long length )
+{
+    if( ! st ) return false;
+    pegc_clear_actions( st );
+    st->match = pegc_cursor_init;
+    st->depth = 0;
+    st->memo.far = 0;
+    return pegc_set_input( st, begin, length );
+}
+
+size_t pegc_parse_many( pegc_parser * st, PegcRule const * r,
+			pegc_const_iterator const * inputs, long const * lengths,
+			size_t count, bool * results )
+{
+    if( ! st || ! r || ! r->rule || (count && ! inputs) ) return 0;
+    size_t ok = 0;
+    size_t i = 0;
+    for( ; i < count; ++i )
+    {
+	bool rc = pegc_reset( st, inputs[i], lengths ? lengths[i] : -1 )
+	    && pegc_parse( st, r );
+	/* The actions refer to this input, so run them now. */
+	if( rc && st->actions.count ) rc = pegc_trigger_actions( st );
+	pegc_clear_actions( st );
+	if( results ) results[i] = rc;
+	if( rc ) ++ok;
+    }
+    return ok;
+}
+
 pegc_parser * pegc_create_parser( char const * inp, long len )
 {
     pegc_parser * p = (pegc_parser*)malloc( sizeof(pegc_parser) );
@@ -325,34 +909,134 @@ pegc_parser * pegc_create_parser( char const * inp, long len )
     return p;
 }
 
-void pegc_clear_actions( pegc_parser * st )
+/**
+   Reads all of fp into a new buffer owned by st (in st->owned).
+   Returns false on read or allocation error.
+*/
+static bool pegc_read_owned_input( pegc_parser * st, FILE * fp )
 {
-    if( ! st || ! st->actions ) return;
-    if( st->actions->right )
+    size_t cap = 0;
+    size_t n = 0;
+    char * buf = 0;
+    while( true )
+    {
+	if( n == cap )
+	{
+	    size_t const newCap = cap ? (cap * 2) : (64 * 1024);
+	    char * x = (newCap > cap) ? (char *)realloc( buf, newCap ) : 0;
+	    if( ! x )
+	    {
+		pegc_free( buf );
+		return false;
+	    }
+	    buf = x;
+	    cap = newCap;
+	}
+	size_t const got = fread( buf + n, 1, cap - n, fp );
+	n += got;
+	if( ! got )
+	{
+	    if( ferror( fp ) )
+	    {
+		pegc_free( buf );
+		return false;
+	    }
+	    break;
+	}
+    }
+    st->owned.mem = buf;
+    st->owned.size = n;
+    st->owned.mapped = false;
+    st->stats.alloced += cap;
+    return true;
+}
+
+pegc_parser * pegc_create_parser_from_file( char const * filename )
+{
+    if( ! filename ) return 0;
+    bool const isStdin = (0 == strcmp( filename, "-" ));
+    FILE * fp = isStdin ? stdin : fopen( filename, "rb" );
+    if( ! fp ) return 0;
+    pegc_parser * st = pegc_create_parser( 0, 0 );
+    bool ok = false;
+#if PEGC_USE_MMAP
+    struct stat sb;
+    if( st && ! isStdin
+	&& (0 == fstat( fileno(fp), &sb ))
+	&& S_ISREG(sb.st_mode)
+	&& (sb.st_size > 0)
+	&& ((unsigned long long)sb.st_size <= (unsigned long long)LONG_MAX) )
     {
-	/* Shouldn't happen. This would be indicative of mismanagement elsewhere. */
-	while( st->actions->right ) st->actions = st->actions->right;
+	size_t const size = (size_t)sb.st_size;
+	void * m = mmap( 0, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0 );
+	if( MAP_FAILED != m )
+	{
+	    /* These are only hints, so their results don't matter. */
+	    posix_madvise( m, size, POSIX_MADV_SEQUENTIAL );
+	    posix_madvise( m, size, POSIX_MADV_WILLNEED );
+	    st->owned.mem = m;
+	    st->owned.size = size;
+	    st->owned.mapped = true;
+	    ok = true;
+	}
     }
-    while( st->actions )
+#endif
+    /* Pipes, devices, empty files, and failed mappings are read
+       into memory instead. */
+    if( st && ! ok ) ok = pegc_read_owned_input( st, fp );
+    if( ! isStdin ) fclose( fp );
+    if( ! ok )
     {
-	pegc_action * p = st->actions->left;
-	//MARKER;printf("Freeing queued action entry @%p\n",st->actions);
-	pegc_free(st->actions);
-	st->stats.alloced -= sizeof(pegc_action);
-	st->actions = p;
+	pegc_destroy_parser( st );
+	return 0;
     }
+    pegc_set_input( st, (pegc_const_iterator)st->owned.mem, (long)st->owned.size );
+    return st;
+}
+
+void pegc_clear_actions( pegc_parser * st )
+{
+    if( st ) st->actions.count = 0;
+}
+
+/**
+   Removes all queued actions which were queued after mark, which
+   must be a value of st->actions.count taken earlier.
+*/
+static void pegc_truncate_actions( pegc_parser * st, size_t mark )
+{
+    if( mark < st->actions.count ) st->actions.count = mark;
 }
 
 bool pegc_destroy_parser( pegc_parser * st )
 {
     if( ! st ) return false;
     pegc_set_error_e( st, 0, 0 );
-    pegc_clear_actions( st );
+    pegc_free( st->actions.list );
+    pegc_free( st->lines.list );
+    pegc_free( st->memo.list );
+    pegc_free( st->memo.marked );
+    pegc_free( st->vm.list );
+    pegc_free( st->spans.list );
+#if PEGC_USE_MMAP
+    if( st->owned.mapped ) munmap( st->owned.mem, st->owned.size );
+    else
+#endif
+    pegc_free( st->owned.mem );
+    pegc_free( st->stream.buf );
     if( st->gc )
     {
         whgc_destroy_context( st->gc );
         st->gc = 0;
     }
+    /* After the gc, because its destructors may look at objects in
+       the arena. */
+    while( st->arena )
+    {
+	pegc_arena_block * next = st->arena->next;
+	pegc_free( st->arena );
+	st->arena = next;
+    }
     pegc_match_listener_data * x = st->listeners;
     while( x )
     {
@@ -366,14 +1050,370 @@ bool pegc_destroy_parser( pegc_parser * st )
 }
 
 
-bool pegc_parse( pegc_parser * st, PegcRule const * r )
+static pegc_memo_key pegc_memo_key_of( PegcRule const * r )
 {
-    return ( !st || !r || !r->rule )
-	? false
-	: r->rule( r, st );
+    pegc_memo_key k;
+    k.rule = r->rule;
+    k.data = r->data;
+    k.proxy = r->proxy;
+    return k;
 }
 
-pegc_const_iterator pegc_latin1(int ch)
+static bool pegc_memo_key_eq( pegc_memo_key const * a, pegc_memo_key const * b )
+{
+    return (a->rule == b->rule) && (a->data == b->data) && (a->proxy == b->proxy);
+}
+
+static size_t pegc_memo_hash( pegc_memo_key const * key, size_t offset )
+{
+    size_t h = ((size_t)key->data >> 3) ^ ((size_t)key->proxy >> 1) ^ (offset * 0x9e3779b1U);
+    h ^= ((size_t)key->rule >> 4);
+    h *= 0x9e3779b1U;
+    h ^= (h >> 15);
+    h *= 0x85ebca6bU;
+    h ^= (h >> 13);
+    return h;
+}
+
+void pegc_clear_memo( pegc_parser * st )
+{
+    if( ! st || ! st->memo.count ) return;
+    memset( st->memo.list, 0, st->memo.capacity * sizeof(pegc_memo_entry) );
+    st->memo.count = 0;
+}
+
+/**
+   Returns the entry for (key,offset) in st's memo table, or 0 if
+   there is none.
+*/
+static pegc_memo_entry * pegc_memo_search( pegc_parser const * st, pegc_memo_key const * key, size_t offset )
+{
+    if( ! st->memo.count ) return 0;
+    size_t const mask = st->memo.capacity - 1;
+    size_t i = pegc_memo_hash( key, offset ) & mask;
+    for( ; st->memo.list[i].key.rule; i = (i + 1) & mask )
+    {
+	pegc_memo_entry * e = &st->memo.list[i];
+	if( (e->offset == offset) && pegc_memo_key_eq( &e->key, key ) ) return e;
+    }
+    return 0;
+}
+
+/**
+   Re-allocates st's memo table to hold newCap (a power of 2) entries
+   and re-inserts all existing entries. Returns false on allocation
+   error, in which case the table is unchanged.
+*/
+static bool pegc_memo_resize( pegc_parser * st, size_t newCap )
+{
+    pegc_memo_entry * li = (pegc_memo_entry *)calloc( newCap, sizeof(pegc_memo_entry) );
+    if( ! li ) return false;
+    size_t const mask = newCap - 1;
+    size_t i = 0;
+    for( ; i < st->memo.capacity; ++i )
+    {
+	pegc_memo_entry const * e = &st->memo.list[i];
+	if( ! e->key.rule ) continue;
+	size_t n = pegc_memo_hash( &e->key, e->offset ) & mask;
+	while( li[n].key.rule ) n = (n + 1) & mask;
+	li[n] = *e;
+    }
+    st->stats.alloced += (newCap - st->memo.capacity) * sizeof(pegc_memo_entry);
+    pegc_free( st->memo.list );
+    st->memo.list = li;
+    st->memo.capacity = newCap;
+    return true;
+}
+
+/**
+   Returns the entry for (key,offset), creating it if needed. New
+   entries have a state of PegcMemo_Empty. Returns 0 on allocation
+   error.
+*/
+static pegc_memo_entry * pegc_memo_insert( pegc_parser * st, pegc_memo_key const * key, size_t offset )
+{
+    pegc_memo_entry * e = pegc_memo_search( st, key, offset );
+    if( e ) return e;
+    if( (st->memo.count + 1) * 2 > st->memo.capacity )
+    {
+	if( ! pegc_memo_resize( st, st->memo.capacity ? (st->memo.capacity * 2) : 256 ) ) return 0;
+    }
+    size_t const mask = st->memo.capacity - 1;
+    size_t i = pegc_memo_hash( key, offset ) & mask;
+    while( st->memo.list[i].key.rule ) i = (i + 1) & mask;
+    e = &st->memo.list[i];
+    e->key = *key;
+    e->offset = offset;
+    e->far = offset;
+    e->state = PegcMemo_Empty;
+    ++st->memo.count;
+    return e;
+}
+
+bool pegc_edit_input( pegc_parser * st, pegc_const_iterator begin, long length,
+		      size_t offset, size_t removed, size_t inserted )
+{
+    if( ! st || ! st->cursor.begin || ! begin ) return false;
+    size_t const oldLen = st->cursor.end - st->cursor.begin;
+    if( (offset > oldLen) || (removed > (oldLen - offset)) ) return false;
+    size_t const newLen = (length < 0) ? pegc_strlen(begin) : (size_t)length;
+    if( newLen != (oldLen - removed + inserted) ) return false;
+    if( st->memo.count )
+    {
+	pegc_memo_entry * li = (pegc_memo_entry *)calloc( st->memo.capacity, sizeof(pegc_memo_entry) );
+	if( ! li )
+	{ /* Fall back to a full re-parse. */
+	    pegc_clear_memo( st );
+	}
+	else
+	{
+	    size_t const mask = st->memo.capacity - 1;
+	    size_t const edEnd = offset + removed;
+	    size_t count = 0;
+	    size_t i = 0;
+	    for( ; i < st->memo.capacity; ++i )
+	    {
+		pegc_memo_entry e = st->memo.list[i];
+		if( ! e.key.rule ) continue;
+		if( (PegcMemo_Matched != e.state) && (PegcMemo_Failed != e.state) ) continue;
+		if( e.offset > edEnd )
+		{ /* Wholly after the edit (even its look-behind byte): move it. */
+		    e.offset = e.offset - removed + inserted;
+		    e.end = e.end - removed + inserted;
+		    e.far = e.far - removed + inserted;
+		    if( (PEGC_MEMO_NOMATCH != e.mbegin) && (e.mbegin < edEnd) )
+		    {
+			e.mbegin = e.mend = PEGC_MEMO_NOMATCH;
+		    }
+		    else if( PEGC_MEMO_NOMATCH != e.mbegin )
+		    {
+			e.mbegin = e.mbegin - removed + inserted;
+			e.mend = e.mend - removed + inserted;
+		    }
+		}
+		else if( e.far < offset )
+		{ /* Wholly before the edit: keep it as-is. */
+		    if( (PEGC_MEMO_NOMATCH != e.mbegin) && (e.mend > offset) )
+		    {
+			e.mbegin = e.mend = PEGC_MEMO_NOMATCH;
+		    }
+		}
+		else continue; /* It looked at the edited range. */
+		size_t n = pegc_memo_hash( &e.key, e.offset ) & mask;
+		while( li[n].key.rule ) n = (n + 1) & mask;
+		li[n] = e;
+		++count;
+	    }
+	    pegc_free( st->memo.list );
+	    st->memo.list = li;
+	    st->memo.count = count;
+	}
+    }
+    st->memo.far = 0;
+    st->number.kind = PegcNumber_None;
+    st->stream.active = false;
+    st->failure.end = 0;
+    /* The newlines before the edit are still where they were. */
+    if( st->lines.scanned > offset )
+    {
+	while( st->lines.count && (st->lines.list[st->lines.count-1] >= offset) ) --st->lines.count;
+	st->lines.scanned = offset;
+    }
+    return pegc_set_error_e( st, 0, 0 )
+	&& pegc_init_cursor( &st->cursor, begin, begin + newLen );
+}
+
+static bool pegc_memo_is_marked( pegc_parser const * st, pegc_memo_key const * key )
+{
+    if( ! st->memo.marked_count ) return false;
+    size_t const mask = st->memo.marked_capacity - 1;
+    size_t i = pegc_memo_hash( key, 0 ) & mask;
+    for( ; st->memo.marked[i].rule; i = (i + 1) & mask )
+    {
+	if( pegc_memo_key_eq( &st->memo.marked[i], key ) ) return true;
+    }
+    return false;
+}
+
+bool pegc_memoize_rule( pegc_parser * st, PegcRule const * r )
+{
+    if( ! st || ! pegc_is_rule_valid(r) ) return false;
+    pegc_memo_key const key = pegc_memo_key_of( r );
+    if( pegc_memo_is_marked( st, &key ) ) return true;
+    if( (st->memo.marked_count + 1) * 2 > st->memo.marked_capacity )
+    {
+	size_t const newCap = st->memo.marked_capacity ? (st->memo.marked_capacity * 2) : 32;
+	pegc_memo_key * li = (pegc_memo_key *)calloc( newCap, sizeof(pegc_memo_key) );
+	if( ! li ) return false;
+	size_t i = 0;
+	for( ; i < st->memo.marked_capacity; ++i )
+	{
+	    pegc_memo_key const * k = &st->memo.marked[i];
+	    if( ! k->rule ) continue;
+	    size_t n = pegc_memo_hash( k, 0 ) & (newCap - 1);
+	    while( li[n].rule ) n = (n + 1) & (newCap - 1);
+	    li[n] = *k;
+	}
+	st->stats.alloced += (newCap - st->memo.marked_capacity) * sizeof(pegc_memo_key);
+	pegc_free( st->memo.marked );
+	st->memo.marked = li;
+	st->memo.marked_capacity = newCap;
+    }
+    size_t const mask = st->memo.marked_capacity - 1;
+    size_t i = pegc_memo_hash( &key, 0 ) & mask;
+    while( st->memo.marked[i].rule ) i = (i + 1) & mask;
+    st->memo.marked[i] = key;
+    ++st->memo.marked_count;
+    return true;
+}
+
+bool pegc_set_memo_mode( pegc_parser * st, pegc_memo_mode mode )
+{
+    if( ! st ) return false;
+    switch( mode )
+    {
+      case PEGC_MEMO_OFF:
+      case PEGC_MEMO_SELECTED:
+      case PEGC_MEMO_ALL:
+	  st->memo.mode = mode;
+	  return true;
+      default:
+	  return false;
+    };
+}
+
+pegc_memo_mode pegc_get_memo_mode( pegc_parser const * st )
+{
+    return st ? st->memo.mode : PEGC_MEMO_OFF;
+}
+
+static bool PegcRule_mf_leftrec( PegcRule const * self, pegc_parser * st );
+static bool PegcRule_mf_ref( PegcRule const * self, pegc_parser * st );
+static void pegc_fail_note( pegc_parser * st, PegcRule const * r, pegc_const_iterator p );
+static void pegc_touch( pegc_parser const * st, pegc_const_iterator p );
+
+/**
+   Ends the tracking of st->memo.far begun by a memoizing rule call
+   which started at orig and saved the outer rule's value as outer:
+   returns the offset of the farthest position the rule looked at
+   and restores st->memo.far as the outer rule sees it. The bytes the
+   rule consumed count as looked at even if the rule did not report
+   them via pegc_touch().
+*/
+static size_t pegc_memo_far_end( pegc_parser * st, pegc_const_iterator orig, pegc_const_iterator outer )
+{
+    pegc_const_iterator far = st->memo.far;
+    if( (st->cursor.pos > orig) && (st->cursor.pos - 1 > far) ) far = st->cursor.pos - 1;
+    if( orig > far ) far = orig;
+    st->memo.far = (outer > far) ? outer : far;
+    return far - st->cursor.begin;
+}
+
+/**
+   The memoizing implementation of pegc_rule_call().
+*/
+static bool pegc_memo_call( PegcRule const * r, pegc_parser * st )
+{
+    pegc_const_iterator const beg = st->cursor.begin;
+    pegc_memo_key const key = pegc_memo_key_of( r );
+    if( ! beg || ! st->cursor.pos || pegc_has_error(st)
+	|| (r->rule == PegcRule_mf_leftrec) /* does its own memoization */
+	|| (r->rule == PegcRule_mf_ref) /* its target is memoized */
+	|| ((PEGC_MEMO_SELECTED == st->memo.mode) && ! pegc_memo_is_marked( st, &key )) )
+    {
+	return r->rule( r, st );
+    }
+    size_t const offset = st->cursor.pos - beg;
+    pegc_memo_entry const * e = pegc_memo_search( st, &key, offset );
+    if( e )
+    {
+	++st->stats.memo_hits;
+	pegc_touch( st, beg + e->far );
+	if( PegcMemo_Matched != e->state ) return false;
+	st->cursor.pos = beg + e->end;
+	if( PEGC_MEMO_NOMATCH != e->mbegin )
+	{
+	    st->match.pos = st->match.begin = beg + e->mbegin;
+	    st->match.end = beg + e->mend;
+	}
+	return true;
+    }
+    ++st->stats.memo_misses;
+    pegc_const_iterator const outer = st->memo.far;
+    size_t const mark = st->actions.count;
+    st->memo.far = 0;
+    bool const rc = r->rule( r, st );
+    size_t const far = pegc_memo_far_end( st, beg + offset, outer );
+    if( pegc_has_error(st) || st->memo.growing ) return rc;
+    /* A hit would not re-queue the rule's actions, which are dropped
+       if an enclosing choice backtracks, so such matches are not
+       recorded. */
+    if( rc && (st->actions.count != mark) ) return rc;
+    /* The table may have been re-allocated by sub-rules, so we cannot
+       hold an entry across the call to r->rule(). */
+    pegc_memo_entry * ne = pegc_memo_insert( st, &key, offset );
+    if( ne )
+    {
+	ne->state = rc ? PegcMemo_Matched : PegcMemo_Failed;
+	ne->end = st->cursor.pos - beg;
+	ne->far = far;
+	if( st->match.begin
+	    && (st->match.begin >= beg) && (st->match.end <= st->cursor.end) )
+	{
+	    ne->mbegin = st->match.begin - beg;
+	    ne->mend = st->match.end - beg;
+	}
+	else
+	{
+	    ne->mbegin = ne->mend = PEGC_MEMO_NOMATCH;
+	}
+    }
+    return rc;
+}
+
+/**
+   Runs r against st. All core rules run their sub-rules through this
+   function, so that parser-wide features (e.g. memoization and the
+   depth limit) apply throughout a grammar. r and st must be valid.
+
+   If r fails, any delayed actions it queued are dropped, so a choice
+   point which backtracks leaves only the actions of the alternative
+   which eventually matched.
+*/
+static bool pegc_rule_call( PegcRule const * r, pegc_parser * st )
+{
+    if( st->depth_limit && (st->depth >= st->depth_limit) )
+    {
+	if( ! pegc_has_error(st) )
+	{
+	    pegc_set_error_e( st, "Parse depth limit (%lu) exceeded at input offset %lu.",
+			      (unsigned long)st->depth_limit,
+			      (unsigned long)(st->cursor.pos - st->cursor.begin) );
+	}
+	return false;
+    }
+    size_t const mark = st->actions.count;
+    ++st->depth;
+    bool const rc = (PEGC_MEMO_OFF == st->memo.mode)
+	? r->rule( r, st )
+	: pegc_memo_call( r, st );
+    --st->depth;
+    if( ! rc )
+    {
+	pegc_truncate_actions( st, mark );
+	pegc_fail_note( st, r, st->cursor.pos );
+    }
+    return rc;
+}
+
+bool pegc_parse( pegc_parser * st, PegcRule const * r )
+{
+    return ( !st || !r || !r->rule )
+	? false
+	: pegc_rule_call( r, st );
+}
+
+pegc_const_iterator pegc_latin1(int ch)
 {
     static char latin1[256 * 2];
     static bool inited = false;
@@ -395,46 +1435,138 @@ pegc_const_iterator pegc_latin1(int ch)
 }
 
 
+/**
+   Details for PegcError_QuotedString, indexed by its arg[1].
+*/
+static char const * const pegc_quoted_error_details[] = {
+"hit EOF while inside a quoted string.",
+"unexpected end of quoted string.",
+"unknown error parsing quoted string."
+};
+
+/**
+   Appends the text of st's error (without the position header) to
+   cb.
+*/
+static void pegc_render_error( pegc_parser const * st, whclob * cb )
+{
+    pegc_errinfo const * e = &st->errinfo;
+    switch( e->code )
+    {
+      case PegcError_QuotedString:
+      {
+	  size_t line2 = 0, col2 = 0;
+	  pegc_line_col_at( st, pegc_begin(st) + e->arg[0], &line2, &col2 );
+	  whclob_appendf(cb, "PegcRule_mf_string_quoted() parse error near line %lu, col %lu: %s"
+			 "\nPossibly started near line %lu, col %lu.",
+			 (unsigned long)e->line, (unsigned long)e->col,
+			 pegc_quoted_error_details[e->arg[1]],
+			 (unsigned long)line2, (unsigned long)col2);
+	  break;
+      }
+      case PegcError_MatchBounds:
+	  whclob_appendf(cb, "pegc_set_match(parser=[%p],begin=[%p],end=[%p],%d) is out of bounds",
+			 st, e->ptr[0], e->ptr[1], (int)e->arg[0]);
+	  break;
+      default:
+	  whclob_append(cb, e->text, (long)e->used);
+	  break;
+    };
+}
+
+/**
+   Returns the message for e to use when the full one cannot be
+   allocated: e's own text if it has any, else a fixed description
+   of its code.
+*/
+static char const * pegc_error_fallback( pegc_errinfo const * e )
+{
+    switch( e->code )
+    {
+      case PegcError_QuotedString:
+	  return pegc_quoted_error_details[e->arg[1]];
+      case PegcError_MatchBounds:
+	  return "pegc_set_match() range is out of bounds.";
+      default:
+	  return e->used ? e->text : "unknown error.";
+    };
+}
+
 char const * pegc_get_error( pegc_parser const * st,
 			     size_t * line,
 			     size_t * col )
 {
-    if( ! st || !st->errinfo.message ) return 0;
-    if( line ) *line = st->errinfo.line;
-    if( col ) *col = st->errinfo.col;
-    return st->errinfo.message;
+    if( ! st || (PegcError_None == st->errinfo.code) ) return 0;
+    /* Building the message is deferred until now, so that parses which
+       fail without anyone asking why do not pay for it. The cache is
+       not a visible change to st. */
+    pegc_errinfo * e = (pegc_errinfo *)&st->errinfo;
+    if( ! e->message )
+    {
+	if( pegc_begin(st) ) pegc_line_col_at( st, pegc_begin(st) + e->pos, &e->line, &e->col );
+	else { e->line = 1; e->col = 0; }
+	whclob * cb = whclob_new();
+	if( cb )
+	{
+	    whclob_appendf(cb,"pegc_set_error_v(): near line %lu, col %lu\n",
+			   (unsigned long)e->line,(unsigned long)e->col);
+	    pegc_render_error( st, cb );
+	    e->message = whclob_take_buffer(cb);
+	    whclob_finalize(cb);
+	}
+    }
+    if( line ) *line = e->line;
+    if( col ) *col = e->col;
+    return e->message ? e->message : pegc_error_fallback( e );
 }
 
-bool pegc_set_error_v( pegc_parser * st, char const * fmt, va_list vargs )
+/**
+   Clears st's error state, then records code as the new error at
+   the current position. Returns st's error info.
+*/
+static pegc_errinfo * pegc_set_error_code( pegc_parser * st, int code )
 {
-    if( ! st ) return false;
-    if( st->errinfo.message )
+    pegc_errinfo * e = &st->errinfo;
+    if( e->message )
     {
-	pegc_free(st->errinfo.message);
+	pegc_free(e->message);
+	e->message = 0;
     }
-    st->errinfo.message = 0;
-    st->errinfo.line = st->errinfo.col = 0;
-    if( ! fmt ) return true;
-    char const * at = fmt;
-    for( ; at && *at; ++at ){};
-    size_t len = at - fmt;
-    if( ! len )
+    e->code = code;
+    e->line = e->col = 0;
+    e->used = 0;
+    e->text[0] = 0;
+    pegc_const_iterator const pos = pegc_pos(st);
+    e->pos = (pos && (pos > pegc_begin(st))) ? (size_t)(pos - pegc_begin(st)) : 0;
+    return e;
+}
+
+/**
+   vappendf_appender which appends to a pegc_errinfo's text,
+   silently truncating what does not fit.
+*/
+static long pegc_error_appender( void * arg, char const * data, long n )
+{
+    pegc_errinfo * e = (pegc_errinfo *)arg;
+    if( n < 0 ) n = (long)strlen(data);
+    size_t const room = (PEGC_ERROR_TEXT_MAX - 1) - e->used;
+    size_t const len = ((size_t)n < room) ? (size_t)n : room;
+    memcpy( e->text + e->used, data, len );
+    e->used += len;
+    e->text[e->used] = 0;
+    return n;
+}
+
+bool pegc_set_error_v( pegc_parser * st, char const * fmt, va_list vargs )
+{
+    if( ! st ) return false;
+    if( ! fmt || ! *fmt )
     {
-	st->errinfo.message = 0;
-	st->errinfo.line = 0;
-	st->errinfo.col = 0;
+	pegc_set_error_code( st, PegcError_None );
 	return true;
     }
-    else
-    {
-	pegc_line_col( st, &(st->errinfo.line), &(st->errinfo.col) );
-	whclob * cb = whclob_new();
-	whclob_appendf(cb,"pegc_set_error_v(): near line %u, col %u\n",st->errinfo.line,st->errinfo.col);
-	whclob_vappendf(cb,fmt,vargs);
-	st->errinfo.message = whclob_take_buffer(cb);
-	whclob_finalize(cb);
-	if( ! st->errinfo.message ) return false;
-    }
+    pegc_errinfo * e = pegc_set_error_code( st, PegcError_Format );
+    vappendf( pegc_error_appender, e, fmt, vargs );
     return true;
 }
 
@@ -457,18 +1589,38 @@ void * pegc_get_client_data( pegc_parser const * st )
     return pegc_gc_search( st, (void const *)pegc_set_client_data );
 }
 
+/**
+   Notes that a rule looked at position p (which may be the end of
+   the input). This feeds st->memo.far, which records how far ahead
+   a memoized result depends on the input (see pegc_edit_input()).
+   If p is at (or past) the end of the input while streaming, the
+   rule's result might change once more input arrives, so
+   pegc_feed() will retry it later.
+
+   st->memo.far and st->stream are bookkeeping, not part of the
+   parser's logical state, so this is allowed to modify them via a
+   const parser.
+*/
+static void pegc_touch( pegc_parser const * st, pegc_const_iterator p )
+{
+    if( ! st ) return;
+    if( p > st->memo.far ) ((pegc_parser *)st)->memo.far = p;
+    if( st->stream.active && ! st->stream.final && (p >= st->cursor.end) )
+    {
+	((pegc_parser *)st)->stream.starved = true;
+    }
+}
+
 bool pegc_eof( pegc_parser const * st )
 {
-    return !st
-	    || !st->cursor.pos
-	    || !*(st->cursor.pos)
-	    || (st->cursor.pos >= st->cursor.end)
-	    ;
+    if( !st || !st->cursor.pos ) return true;
+    pegc_touch( st, st->cursor.pos );
+    return st->cursor.pos >= st->cursor.end;
 }
 
 bool pegc_has_error( pegc_parser const * st )
 {
-    return st && (st->errinfo.message);
+    return st && (PegcError_None != st->errinfo.code);
 }
 bool pegc_isgood( pegc_parser const * st )
 {
@@ -492,7 +1644,7 @@ pegc_const_iterator pegc_end( pegc_parser const * st )
 
 bool pegc_in_bounds( pegc_parser const * st, pegc_const_iterator p )
 {
-    return st && p && *p && (p>=pegc_begin(st)) && (p<pegc_end(st));
+    return st && p && (p>=pegc_begin(st)) && (p<pegc_end(st));
 }
 
 
@@ -530,9 +1682,43 @@ long pegc_distance( pegc_parser const * st, pegc_const_iterator e )
     return (st&&e) ? (e - pegc_pos(st)) : 0;
 }
 
-bool pegc_line_col( pegc_parser const * st,
-		    size_t * line,
-		    size_t * col )
+/**
+   Extends st's newline index up to (but not including) the input
+   offset end. Returns false on allocation error, in which case the
+   index is still valid but covers less of the input.
+*/
+static bool pegc_lines_scan( pegc_parser * st, size_t end )
+{
+    pegc_lines * li = &st->lines;
+    pegc_const_iterator const beg = st->cursor.begin;
+    while( li->scanned < end )
+    {
+	pegc_const_iterator const nl =
+	    (pegc_const_iterator)memchr( beg + li->scanned, '\n', end - li->scanned );
+	if( ! nl )
+	{
+	    li->scanned = end;
+	    break;
+	}
+	if( li->count == li->capacity )
+	{
+	    size_t const newCap = li->capacity ? (li->capacity * 2) : 256;
+	    size_t * list = (size_t *)realloc( li->list, newCap * sizeof(size_t) );
+	    if( ! list ) return false;
+	    st->stats.alloced += (newCap - li->capacity) * sizeof(size_t);
+	    li->list = list;
+	    li->capacity = newCap;
+	}
+	li->list[li->count++] = nl - beg;
+	li->scanned = (nl - beg) + 1;
+    }
+    return true;
+}
+
+bool pegc_line_col_at( pegc_parser const * st,
+		       pegc_const_iterator pos,
+		       size_t * line,
+		       size_t * col )
 {
     if( !st ) return false;
     size_t bogo;
@@ -540,23 +1726,47 @@ bool pegc_line_col( pegc_parser const * st,
     if( ! col ) col = &bogo;
     *line = 1;
     *col = 0;
-    pegc_const_iterator pos = pegc_pos(st);
-    pegc_const_iterator beg = pegc_begin(st);
-    for( ; beg && *beg && (beg != pos ); ++beg )
+    pegc_const_iterator const beg = pegc_begin(st);
+    if( ! beg ) return true;
+    if( (pos < beg) || (pos > pegc_end(st)) ) return false;
+    size_t const off = pos - beg;
+    /* The index is only a cache, so updating it is not a visible
+       change to st. */
+    pegc_lines_scan( (pegc_parser *)st, off );
+    pegc_lines const * li = &st->lines;
+    size_t lo = 0;
+    size_t hi = li->count;
+    while( lo < hi )
     {
-	if( *beg == '\n' )
-	{
-	     ++(*line);
-	     *col = 0;
-	}
-	else
+	size_t const mid = lo + ((hi - lo) / 2);
+	if( li->list[mid] < off ) lo = mid + 1;
+	else hi = mid;
+    }
+    size_t n = lo;
+    size_t bol = lo ? (li->list[lo - 1] + 1) : 0;
+    size_t i = li->scanned;
+    for( ; i < off; ++i )
+    { /* only if the index could not be extended */
+	if( '\n' == beg[i] )
 	{
-	    ++(*col);
+	    ++n;
+	    bol = i + 1;
 	}
     }
+    *line = n + 1;
+    *col = off - bol;
     return true;
 }
 
+bool pegc_line_col( pegc_parser const * st,
+		    size_t * line,
+		    size_t * col )
+{
+    return st
+	? pegc_line_col_at( st, pegc_pos(st), line, col )
+	: false;
+}
+
 pegc_cursor pegc_get_match_cursor( pegc_parser const * st )
 {
     pegc_cursor cur = pegc_cursor_init;
@@ -572,12 +1782,12 @@ pegc_cursor pegc_cursor_trimmed( pegc_cursor const cur )
 {
     pegc_cursor r = cur;
     pegc_const_iterator c = r.begin;
-    while( c && (c<r.end) && *c && isspace(*c) ) ++c;
+    while( c && (c<r.end) && isspace((unsigned char)*c) ) ++c;
     pegc_const_iterator mark = c;
     if( c == r.end ) return r;
     c = r.end-1;
     if( c <= r.begin ) return r;
-    while( c && (c>mark) && *c && isspace(*c) ) --c;
+    while( c && (c>mark) && isspace((unsigned char)*c) ) --c;
     r.begin = r.pos = mark;
     r.end = c;
     return r;
@@ -586,7 +1796,6 @@ pegc_cursor pegc_cursor_trimmed( pegc_cursor const cur )
 pegc_iterator pegc_cursor_tostring( pegc_cursor const cur )
 {
     if( !cur.begin
-	||!*(cur.begin)
 	||(cur.end<=cur.begin)
 	)
     {
@@ -596,13 +1805,8 @@ pegc_iterator pegc_cursor_tostring( pegc_cursor const cur )
     if( sz <= 0 ) return 0;
     pegc_iterator ret = (pegc_iterator)calloc( sz + 1, sizeof(pegc_char_t) );
     if( ! ret ) return 0;
-    pegc_const_iterator it = cur.begin;
-    pegc_iterator at = ret;
-    for( ; it && *it && (it != cur.end); ++it, ++at )
-    {
-	*at = *it;
-    }
-    *at = '\0';
+    memcpy( ret, cur.begin, sz * sizeof(pegc_char_t) );
+    ret[sz] = '\0';
     return ret;
 }
 
@@ -623,8 +1827,13 @@ bool pegc_set_match( pegc_parser * st, pegc_const_iterator begin, pegc_const_ite
 #if 0
 	MARKER; fprintf(stderr,"WARNING: pegc_set_match() is out of bounds.\n");
 #else
-	pegc_set_error_e( st, "pegc_set_match(parser=[%p],begin=[%p],end=[%p],%d) is out of bounds",
-			st, begin, end, movePos );
+	if( st )
+	{
+	    pegc_errinfo * e = pegc_set_error_code( st, PegcError_MatchBounds );
+	    e->ptr[0] = begin;
+	    e->ptr[1] = end;
+	    e->arg[0] = movePos;
+	}
 #endif
 	return false;
     }
@@ -648,41 +1857,36 @@ bool pegc_set_match( pegc_parser * st, pegc_const_iterator begin, pegc_const_ite
 bool pegc_matches_char( pegc_parser const * st, int ch )
 {
     return st
-	? (pegc_eof(st) ? (ch == '\0') : (*pegc_pos(st) == ch))
+	? (pegc_eof(st) ? false : (*pegc_pos(st) == (pegc_char_t)ch))
 	: false;
 }
 
 bool pegc_matches_chari( pegc_parser const * st, int ch )
 {
-    if( !st || pegc_has_error(st) ) return false;
+    if( !st || pegc_has_error(st) || pegc_eof(st) ) return false;
     pegc_const_iterator p = pegc_pos(st);
-    if( !p && !*p ) return false;
-    return (p && *p)
-	&& (tolower(*p) == tolower(ch));
+    return tolower((unsigned char)*p) == tolower((unsigned char)ch);
 }
 
 bool pegc_matches_string( pegc_parser const * st, pegc_const_iterator str, long strLen, bool caseSensitive )
 {
     if( !st || pegc_has_error(st) ) return false;
     if( strLen < 0 ) strLen = pegc_strlen(str);
-    if( ! pegc_in_bounds(st, pegc_pos(st)+strLen-1) ) return false;
-    pegc_const_iterator orig = pegc_pos(st);
-    pegc_const_iterator p = orig;
-    pegc_const_iterator sp = str;
+    pegc_const_iterator p = pegc_pos(st);
+    if( ! p ) return false;
+    if( (pegc_end(st) - p) < strLen )
+    {
+	pegc_touch( st, pegc_end(st) );
+	return false;
+    }
+    if( strLen ) pegc_touch( st, p + strLen - 1 );
+    if( caseSensitive ) return 0 == memcmp( p, str, strLen );
     long i = 0;
-    for( ; p && *p && (i < strLen); ++i, ++p, ++sp )
+    for( ; i < strLen; ++i )
     {
-	if( caseSensitive )
-	{
-	    if( tolower(*p) != tolower(*sp) ) break;
-	}
-	else
-	{
-	    if( *p != *sp ) break;
-	}
+	if( tolower((unsigned char)p[i]) != tolower((unsigned char)str[i]) ) return false;
     }
-    //MARKER; printf("matched string? == %d, i=%ld, strLen=%ld, str=[%s]\n", (i == strLen), i, strLen, str);
-    return ( i == strLen ) ? true : false;
+    return true;
 }
 
 
@@ -722,7 +1926,8 @@ static bool PegcRule_mf_char_range( PegcRule const * self, pegc_parser * st )
     int max = (evil & 0x00ff);
     //MARKER;printf("min=%c, max=%c, evil=%x\n",min,max,evil);
     pegc_const_iterator orig = pegc_pos(st);
-    if( (*orig >= min) && (*orig <= max) )
+    int ch = (unsigned char)*orig;
+    if( (ch >= min) && (ch <= max) )
     {
 	//MARKER;printf("matched: ch=%c, min=%c, max=%c, evil=%x\n",*orig?*orig:'!',min,max,evil);
 	pegc_set_match(st,orig,orig+1,true);
@@ -733,9 +1938,9 @@ static bool PegcRule_mf_char_range( PegcRule const * self, pegc_parser * st )
 
 PegcRule pegc_r_char_range( pegc_char_t start, pegc_char_t end )
 {
-    if( start > end )
+    if( (unsigned char)start > (unsigned char)end )
     {
-	pegc_char_t x = end;
+	pegc_char_t x = start;
 	start = end;
 	end = x;
     }
@@ -744,38 +1949,138 @@ PegcRule pegc_r_char_range( pegc_char_t start, pegc_char_t end )
        for this rule, since i expect it to be used often.
      */
     assert( (sizeof(size_t) <= sizeof(void*)) && "pegc_r_char_range(): invalid use of (void*) to store int value: (void*) is too small!");
-    size_t evil = ((start << 8) | (0x00ff & end));
+    size_t evil = (((size_t)(unsigned char)start << 8) | (unsigned char)end);
     PegcRule r = pegc_r( PegcRule_mf_char_range, (void*)evil );
     //MARKER;printf("min=%c, max=%c, evil=%x, r.data=%p\n",start,end,evil,r.data);
     return r;
 }
 
-static bool PegcRule_mf_char_spec( PegcRule const * self, pegc_parser * st )
+/**
+   Data for PegcRule_mf_charclass(): a 256-bit set of bytes.
+*/
+struct pegc_charclass
+{
+    unsigned char bits[32];
+};
+typedef struct pegc_charclass pegc_charclass;
+
+static bool PegcRule_mf_charclass( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, true, false, false ) ) return false;
-    if( ! pegc_isgood( st ) ) return false;
-    char const * spec = (char const *) self->data;
-    if( ! spec )
-    {
-	pegc_set_error_e(st,"PegcRule_mf_char_spec: internal char spec data not found.");
-	return false;
-    }
     pegc_const_iterator orig = pegc_pos(st);
-    //MARKER;printf("inChar=%c format=%s strlen==%d\n",*orig,spec,pegc_strlen(spec));
-    char ch[] = {0,0};
-    int rc = sscanf(pegc_pos(st), spec, ch);
-    //MARKER;printf("inChar=%c sscanf rc=%d, ch=%s\n",*orig,rc,ch);
-    if( (EOF == rc) || (0 == rc) ) return false;
+    unsigned char const c = (unsigned char)*orig;
+    if( ! (((pegc_charclass const *)self->data)->bits[c >> 3] & (1 << (c & 7))) ) return false;
     pegc_set_match( st, orig, orig + 1, true );
     return true;
 }
 
+/**
+   Parses one (possibly escaped, if escapes is true) character of a
+   class spec from *s, advancing *s past it. Returns -1 on error.
+*/
+static int pegc_charclass_char( char const ** s, bool escapes )
+{
+    char const * p = *s;
+    int c = (unsigned char)*p++;
+    if( escapes && ('\\' == c) )
+    {
+	c = (unsigned char)*p++;
+	switch( c )
+	{
+	  case 'n': c = '\n'; break;
+	  case 'r': c = '\r'; break;
+	  case 't': c = '\t'; break;
+	  case 'f': c = '\f'; break;
+	  case 'v': c = '\v'; break;
+	  case 'x': {
+	      int i = 0;
+	      c = 0;
+	      for( ; (i < 2) && isxdigit((unsigned char)*p); ++i, ++p )
+	      {
+		  c = (c * 16) + (isdigit((unsigned char)*p)
+				  ? (*p - '0')
+				  : (tolower((unsigned char)*p) - 'a' + 10));
+	      }
+	      if( ! i ) return -1;
+	      break;
+	  }
+	  case 0: return -1;
+	  default: break; /* \\, \], \-, \^, etc. */
+	}
+    }
+    *s = p;
+    return c;
+}
+
+/**
+   Parses a "[...]" character class spec into cc. If escapes is
+   false, backslashes are ordinary characters, as in sscanf()'s '%['.
+   Returns false if spec is malformed.
+*/
+static bool pegc_charclass_parse( char const * spec, bool escapes, pegc_charclass * cc )
+{
+    memset( cc, 0, sizeof(pegc_charclass) );
+    if( ! spec || ('[' != *spec) ) return false;
+    char const * p = spec + 1;
+    bool const negate = ('^' == *p);
+    if( negate ) ++p;
+    bool first = true;
+    while( *p && (first || (']' != *p)) )
+    {
+	int const lo = (first && (']' == *p)) ? (unsigned char)*p++ : pegc_charclass_char( &p, escapes );
+	int hi = lo;
+	first = false;
+	if( lo < 0 ) return false;
+	if( ('-' == p[0]) && p[1] && (']' != p[1]) )
+	{
+	    ++p;
+	    hi = pegc_charclass_char( &p, escapes );
+	    if( (hi < 0) || (hi < lo) ) return false;
+	}
+	int c = lo;
+	for( ; c <= hi; ++c ) cc->bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+    }
+    if( (']' != *p) || p[1] ) return false;
+    if( negate )
+    {
+	int i = 0;
+	for( ; i < 32; ++i ) cc->bits[i] = (unsigned char)~cc->bits[i];
+    }
+    return true;
+}
+
+/**
+   Creates a charclass rule matching the bytes in bits. The name is
+   not set.
+*/
+static PegcRule pegc_r_charclass_bits( pegc_parser * st, unsigned char const * bits )
+{
+    pegc_charclass * cc = (pegc_charclass *)pegc_alloc( st, sizeof(pegc_charclass) );
+    if( ! cc ) return PegcRule_invalid;
+    memcpy( cc->bits, bits, 32 );
+    return pegc_r( PegcRule_mf_charclass, cc );
+}
+
+/**
+   Implements pegc_r_charclass() and pegc_r_char_spec().
+*/
+static PegcRule pegc_r_charclass_impl( pegc_parser * st, char const * spec, bool escapes )
+{
+    pegc_charclass cc;
+    if( ! st || ! pegc_charclass_parse( spec, escapes, &cc ) ) return PegcRule_invalid;
+    PegcRule r = pegc_r_charclass_bits( st, cc.bits );
+    if( r.rule ) r.name = pegc_mprintf( st, "%s", spec );
+    return r;
+}
+
+PegcRule pegc_r_charclass( pegc_parser * st, char const * spec )
+{
+    return pegc_r_charclass_impl( st, spec, true );
+}
+
 PegcRule pegc_r_char_spec( pegc_parser * st, char const * spec )
 {
-    if( ! st || !spec || (*spec != '[') ) return PegcRule_invalid;
-    char * fmt = pegc_mprintf( st, "%%1%s", spec );
-    if( ! fmt ) return PegcRule_invalid;
-    return pegc_r(PegcRule_mf_char_spec, fmt);
+    return pegc_r_charclass_impl( st, spec, false );
 }
 
 static bool PegcRule_mf_error( PegcRule const * self, pegc_parser * st )
@@ -827,14 +2132,11 @@ bool pegc_is_rule_valid( PegcRule const * r )
 
 PegcRule * pegc_alloc_r( pegc_parser * st, PegcRule_mf const func, void const * data )
 {
-    PegcRule * r = (PegcRule*) malloc(sizeof(PegcRule));
+    PegcRule * r = st
+	? (PegcRule*) pegc_alloc( st, sizeof(PegcRule) )
+	: (PegcRule*) malloc(sizeof(PegcRule));
     if( ! r ) return 0;
     *r = pegc_r(func,data);
-    if( st )
-    {
-	st->stats.alloced += sizeof(PegcRule);
-	pegc_gc_add( st, r, pegc_free_key );
-    }
     return r;
 }
 
@@ -856,11 +2158,7 @@ char * pegc_vmprintf( pegc_parser * st, char const * fmt, va_list args )
     char * ret = (fmt && *fmt) ?
 	whclob_vmprintf( fmt, args )
 	: 0;
-    if( st && ret )
-    {
-	pegc_gc_add( st, ret, pegc_free );
-    }
-    return ret;
+    return st ? pegc_alloc_own_string( st, ret ) : ret;
 }
 char * pegc_mprintf( pegc_parser * st, char const * fmt, ... )
 {
@@ -892,15 +2190,14 @@ static bool PegcRule_mf_oneof_impl( PegcRule const * self, pegc_parser * st, boo
     if( ! pegc_rule_check( self, st, true, false, false ) ) return false;
     if( ! pegc_isgood(st) ) return false;
     pegc_const_iterator p = pegc_pos(st);
-    if( !*p ) return false;
     pegc_const_iterator str = (pegc_const_iterator)self->data;
     size_t len = pegc_strlen(str);
-    int i = 0;
+    size_t i = 0;
     for( ; (i < len); ++i )
     {
 	if( caseSensitive
 	    ? (*p == str[i])
-	    : (tolower(*p) == tolower(str[i])) )
+	    : (tolower((unsigned char)*p) == tolower((unsigned char)str[i])) )
 	{
 	    //MARKER;
 	    pegc_set_match( st, p, p+1, true );
@@ -996,7 +2293,7 @@ bool PegcRule_mf_notchari( PegcRule const * self, pegc_parser * st )
     if( ! pegc_rule_check( self, st, true, false, true ) ) return false;
     char const * d = (char const *)self->data;
     pegc_const_iterator orig = pegc_pos(st);
-    if( tolower(*orig) == tolower(*d) ) return false;
+    if( tolower((unsigned char)*orig) == tolower((unsigned char)*d) ) return false;
     pegc_set_match( st, orig, orig+1, true );
     return true;
 }
@@ -1006,7 +2303,7 @@ PegcRule pegc_r_notchar( pegc_char_t input, bool caseSensitive )
     return pegc_r( caseSensitive
 		   ? PegcRule_mf_notchar
 		   : PegcRule_mf_notchari,
-		   pegc_latin1(input));
+		   pegc_latin1((unsigned char)input));
 }
 
 
@@ -1015,8 +2312,17 @@ bool PegcRule_mf_chari( PegcRule const * self, pegc_parser * st )
     return PegcRule_mf_char_impl(self,st,false);
 }
 
+static pegc_span_set const * pegc_span_set_for( pegc_parser * st, PegcRule const * r );
+static size_t pegc_span( pegc_span_set const * ss, pegc_const_iterator p, size_t n );
 /**
-   This rule acts like a the regular expression (Rule)*. Always
+   Returns the set of bytes at which r->proxy cannot start a match,
+   for use by until rules. The set is empty if that is not known.
+   Returns 0 on allocation error.
+*/
+static pegc_span_set const * pegc_span_skip_set_for( pegc_parser * st, PegcRule const * r );
+
+/**
+   This rule acts like a the regular expression (Rule)*. Always
    matches but may or may not consume input.
 
    Requires that self->proxy be set to an object this routine can
@@ -1027,10 +2333,19 @@ static bool PegcRule_mf_star( PegcRule const * self, pegc_parser * st )
     if( ! pegc_rule_check( self, st, false, true, true ) ) return false;
     size_t matches = 0;
     pegc_const_iterator orig = pegc_pos(st);
+    pegc_span_set const * ss = pegc_span_set_for( st, self->proxy );
+    if( ss )
+    {
+	matches = pegc_span( ss, orig, pegc_end(st) - orig );
+	pegc_touch( st, orig + matches );
+	pegc_fail_note( st, self->proxy, orig + matches );
+	if( matches ) pegc_set_match( st, orig, orig + matches, true );
+	return true;
+    }
     pegc_const_iterator p2 = orig;
     do
     {
-	if( self->proxy->rule( self->proxy, st ) )
+	if( pegc_rule_call( self->proxy, st ) )
 	{
 	    ++matches;
 	    if( p2 == pegc_pos(st) )
@@ -1062,12 +2377,22 @@ static bool PegcRule_mf_plus( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, false, true, true ) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    int matches = self->proxy->rule( self->proxy, st )
+    pegc_span_set const * ss = pegc_span_set_for( st, self->proxy );
+    if( ss )
+    {
+	size_t const n = pegc_span( ss, orig, pegc_end(st) - orig );
+	pegc_touch( st, orig + n );
+	pegc_fail_note( st, self->proxy, orig + n );
+	if( ! n ) return false;
+	pegc_set_match( st, orig, orig + n, true );
+	return true;
+    }
+    int matches = pegc_rule_call( self->proxy, st )
 	? 1 : 0;
     pegc_const_iterator p2 = pegc_pos(st);
     while( (matches>0)
 	   && (p2 != orig)
-	   && self->proxy->rule( self->proxy, st )
+	   && pegc_rule_call( self->proxy, st )
 	   )
     {
 	++matches;
@@ -1088,8 +2413,11 @@ static bool PegcRule_mf_at( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, false, true, true ) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    bool rc = self->proxy->rule( self->proxy, st );
+    size_t const mark = st->actions.count;
+    bool rc = pegc_rule_call( self->proxy, st );
     pegc_set_pos(st,orig);
+    /* Lookahead consumes nothing, so its actions are not kept. */
+    pegc_truncate_actions( st, mark );
     return rc;
 }
 
@@ -1145,7 +2473,7 @@ static bool PegcRule_mf_or( PegcRule const * self, pegc_parser * st )
     for( ; li && li->rule; ++li )
     {
 	//MARKER;
-	if( li->rule( li, st ) )
+	if( pegc_rule_call( li, st ) )
 	{
 	    pegc_set_match( st, orig, pegc_pos(st), true );
 	    return true;
@@ -1176,7 +2504,7 @@ static bool PegcRule_mf_and( PegcRule const * self, pegc_parser * st )
     PegcRule const * li = (PegcRule const *)self->data;
     for( ; li && li->rule; ++li )
     {
-	if( ! li->rule( li, st ) )
+	if( ! pegc_rule_call( li, st ) )
 	{
 	    pegc_set_pos(st,orig);
 	    return false;
@@ -1225,9 +2553,7 @@ PegcRule pegc_nonono_r_list_a( pegc_parser * st, bool orOp, PegcRule const * li
     PegcRule r = pegc_r( orOp ? PegcRule_mf_or : PegcRule_mf_and, 0 );
 #if 1
     r.data = li;
-    char * name = pegc_list_to_string( orOp, (PegcRule const **)&li );
-    r.name = name;
-    pegc_gc_add(st, name, pegc_free );
+    r.name = pegc_alloc_own_string( st, pegc_list_to_string( orOp, (PegcRule const **)&li ) );
 #else
     int count = 0;
     if(st && li)
@@ -1282,56 +2608,19 @@ PegcRule pegc_r_list_vp( pegc_parser * st, bool orOp, va_list ap )
       simplifies those implementations.
     */
     if( !st ) return PegcRule_invalid;
-    enum { blockSize = 5 }; /* number of rules to allocate at a time. */
-    int count = 1;
-    PegcRule * li = 0;
-    int pos = 0;
-    bool ok = true;
-    while( true )
-    {
-	PegcRule const * vr = va_arg(ap,PegcRule const *);
-	if( ! pegc_is_rule_valid(vr) ) break;
-	//MARKER;printf("checking va_arg() rule @%p\n",vr);
-	if( (!pos) || (pos >=(count-1)) )
-	{ /* (re)allocate list */
-	    count += blockSize;
-	    if( ! li )
-	    {
-		//MARKER;printf("allocating list for %u items.\n",count);
-		li = (PegcRule *)calloc( count, sizeof(PegcRule) );
-		if( ! li )
-		{
-		    ok = false;
-		    break;
-		}
-	    }
-	    else
-	    {
-		//MARKER;printf("re-allocating list for %u items.\n",count);
-		PegcRule * re = (PegcRule *)realloc( li, sizeof(PegcRule) * count  );
-		if( ! re )
-		{
-		    ok = false;
-		    break;
-		}
-		li = re;
-	    }
-	}
-	if( ! li ) break;
-	li[pos++] = *vr;
-    }
-    //MARKER;printf("pos=%u count=%u\n",pos,count);
-    if( !ok || !pos || !li )
-    {
-	if(li) pegc_free(li);
-	return PegcRule_invalid;
-    }
-    st->stats.alloced += (sizeof(PegcRule)*count);
-    //MARKER;printf("pos=%u count=%u\n",pos,count);
-    li[pos] = PegcRule_invalid;
-    pegc_gc_add( st, li, pegc_free );
-    //PegcRule r = pegc_r( orOp ? PegcRule_mf_or : PegcRule_mf_and, li );
-    //return r;
+    /* Count the rules first, so that the list can be allocated in
+       one piece from st's arena. */
+    size_t count = 0;
+    va_list cp;
+    va_copy( cp, ap );
+    while( pegc_is_rule_valid( va_arg(cp,PegcRule const *) ) ) ++count;
+    va_end( cp );
+    if( ! count ) return PegcRule_invalid;
+    PegcRule * li = (PegcRule *)pegc_alloc( st, (count + 1) * sizeof(PegcRule) );
+    if( ! li ) return PegcRule_invalid;
+    size_t i = 0;
+    for( ; i < count; ++i ) li[i] = *va_arg(ap,PegcRule const *);
+    li[count] = PegcRule_invalid;
     return pegc_r_list_a( orOp, li );
 }
 
@@ -1373,7 +2662,7 @@ static bool PegcRule_mf_or_v( PegcRule const * self, pegc_parser * st )
     for( ; li && li[i].rule; ++i )
     {
 	//MARKER;
-	if( li[i].rule( &li[i], st ) )
+	if( pegc_rule_call( &li[i], st ) )
 	{
 	    pegc_set_match( st, orig, pegc_pos(st), true );
 	    return true;
@@ -1393,7 +2682,7 @@ static bool PegcRule_mf_and_v( PegcRule const * self, pegc_parser * st )
     int i = 0;
     for( ; li[i].rule; ++i )
     {
-	if( ! li[i].rule( &li[i], st ) )
+	if( ! pegc_rule_call( &li[i], st ) )
 	{
 	    pegc_set_pos(st,orig);
 	    return false;
@@ -1406,48 +2695,26 @@ static bool PegcRule_mf_and_v( PegcRule const * self, pegc_parser * st )
 PegcRule pegc_r_list_vv( pegc_parser * st, bool orOp, va_list ap )
 {
     if( !st ) return PegcRule_invalid;
-    const size_t blockSize = 3; /* number of rules to allocate at a time. */
-    int count = 1;
-    PegcRule * li = 0;
-    int pos = 0;
+    /* Count the rules first, so that the list can be allocated in
+       one piece from st's arena. */
+    size_t count = 0;
+    va_list cp;
+    va_copy( cp, ap );
     while( true )
     {
-	PegcRule const r = va_arg(ap,PegcRule const);
+	PegcRule const r = va_arg(cp,PegcRule const);
 	if( ! pegc_is_rule_valid(&r) ) break;
-	if( (!pos) || (pos >= (count-1)) )
-	{ /* (re)allocate list */
-	    count += blockSize;
-	    if( ! li )
-	    {
-		//MARKER;printf("allocating list for %u items.\n",count);
-		li = calloc( count, sizeof(PegcRule) );
-		if( ! li ) break;
-	    }
-	    else
-	    {
-		//MARKER;printf("REallocating list for %u items.\n",count);
-		PegcRule * re = (PegcRule *)realloc( li, sizeof(PegcRule) * (count)  );
-		if( ! re ) break;
-		li = re;
-	    }
-	}
-	//MARKER;printf("Added list item #%u\n",pos);
-	if( ! li ) break;
-	li[pos++] = r;
-    }
-    if( ! pos || !li )
-    {
-	if(li) pegc_free(li);
-	return PegcRule_invalid;
+	++count;
     }
-    st->stats.alloced += (sizeof(PegcRule) * pos);
-    li[pos] = PegcRule_invalid;
-    pegc_gc_add( st, li, pegc_free );
+    va_end( cp );
+    if( ! count ) return PegcRule_invalid;
+    PegcRule * li = (PegcRule *)pegc_alloc( st, (count + 1) * sizeof(PegcRule) );
+    if( ! li ) return PegcRule_invalid;
+    size_t i = 0;
+    for( ; i < count; ++i ) li[i] = va_arg(ap,PegcRule const);
+    li[count] = PegcRule_invalid;
     PegcRule r = pegc_r( orOp ? PegcRule_mf_or_v : PegcRule_mf_and_v, li );
-    char * name = pegc_list_to_string( orOp, (PegcRule const **)&li );
-    r.name = name;
-    //MARKER;printf("Added %d item(s) to rule list %s.\n",pos,name);
-    pegc_gc_add( st, name, pegc_free );
+    r.name = pegc_alloc_own_string( st, pegc_list_to_string( orOp, (PegcRule const **)&li ) );
     return r;
 }
 
@@ -1477,37 +2744,48 @@ PegcRule pegc_r_and_ev( pegc_parser * st, ... )
     return ret;
 }
 
+/**
+   Appends a copy of act to st's delayed action queue, with its match
+   range set to [begin,end). Returns false on allocation error.
+*/
+static bool pegc_queue_action( pegc_parser * st, PegcAction const * act,
+			       pegc_const_iterator begin, pegc_const_iterator end )
+{
+    pegc_action_queue * q = &st->actions;
+    if( q->count == q->capacity )
+    {
+	size_t const newCap = q->capacity ? (q->capacity * 2) : 64;
+	pegc_action * li = (pegc_action *)realloc( q->list, newCap * sizeof(pegc_action) );
+	if( ! li )
+	{ /* we should report an error, but we don't want to malloc now! */
+	    return false;
+	}
+	st->stats.alloced += (newCap - q->capacity) * sizeof(pegc_action);
+	q->list = li;
+	q->capacity = newCap;
+    }
+    pegc_action * info = &q->list[q->count++];
+    *info = pegc_action_init;
+    info->action = *act;
+    info->action.match.begin = begin;
+    info->action.match.end = end;
+    if( (st->number.begin == begin) && (st->number.end == end) )
+    {
+	info->number = st->number;
+    }
+    return true;
+}
+
 static bool PegcRule_mf_action_d( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, true, true, true ) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
     //MARKER; printf("trying rule for delayed action @%p\n", self->data);
-    if( ! self->proxy->rule( self->proxy, st ) ) return false;
-    PegcAction * theact = (PegcAction*) pegc_gc_search(st,self->data);
+    if( ! pegc_rule_call( self->proxy, st ) ) return false;
+    PegcAction const * theact = (PegcAction const *)self->data;
     //MARKER; printf("setting up delayed action @%p\n", theact);
     if( ! theact ) return false;
-    pegc_action * info = (pegc_action*)malloc(sizeof(pegc_action));
-    if( ! info )
-    { /* we should report an error, but we don't want to malloc now! */
-	return false;
-    }
-    st->stats.alloced += sizeof(pegc_action);
-    //pegc_gc_add( st, info, 0 );
-    *info = pegc_action_init;
-    info->action = *theact;
-    info->action.match.begin = orig;
-    info->action.match.end = pegc_pos(st);
-    if( ! st->actions )
-    {
-	st->actions = info;
-    }
-    else
-    {
-	info->left = st->actions;
-	st->actions->right = info;
-	st->actions = info;
-    }
-    return true;
+    return pegc_queue_action( st, theact, orig, pegc_pos(st) );
 }
 
 PegcRule pegc_r_action_d_p( pegc_parser * st,
@@ -1517,10 +2795,8 @@ PegcRule pegc_r_action_d_p( pegc_parser * st,
 {
     if( ! st || !pegc_is_rule_valid(rule) ) return PegcRule_invalid;
     //MARKER;
-    PegcAction * act = (PegcAction*)malloc(sizeof(PegcAction));
+    PegcAction * act = (PegcAction*)pegc_alloc( st, sizeof(PegcAction) );
     if( ! act ) return PegcRule_invalid;
-    st->stats.alloced += sizeof(PegcAction);
-    pegc_gc_add( st, act, pegc_free );
     act->action = onMatch;
     act->data = clientData;
     PegcRule r = pegc_r( PegcRule_mf_action_d, act );
@@ -1539,25 +2815,33 @@ PegcRule pegc_r_action_d_v( pegc_parser * st,
 bool pegc_trigger_actions( pegc_parser * st )
 {
     if( pegc_has_error(st) ) return false;
-    pegc_action * a = st->actions;
-    if( ! a ) return true;
-    while( a && a->left ) a = a->left;
-    while( a )
+    if( ! st->actions.count ) return true;
+    pegc_number const oldNumber = st->number;
+    bool rc = true;
+    size_t i = 0;
+    /* An action may queue more actions, which may move the list, so
+       we work on a copy of each entry and re-check the count. */
+    for( ; i < st->actions.count; ++i )
     {
-	if( a->action.action
+	pegc_action const a = st->actions.list[i];
+	/* Let pegc_get_number_long() and friends see the value
+	   converted when the action was queued. */
+	st->number = a.number;
+	if( a.action.action
 	    &&
-	    !a->action.action( st, &a->action.match, a->action.data ) )
+	    !a.action.action( st, &a.action.match, a.action.data ) )
 	{
 	    if( ! pegc_has_error(st) )
 	    {
-		pegc_set_error_e(st,"%s(): action @%p->%p(cursor=@%p,data=@%p) failed.",
-				 a, a->action,&a->action.match, a->action.data );
+		pegc_set_error_e(st,"%s(): action #%u (data=@%p) failed.",
+				 __func__, (unsigned int)i, a.action.data );
 	    }
-	    return false;
+	    rc = false;
+	    break;
 	}
-	a = a->right;
     }
-    return true;
+    st->number = oldNumber;
+    return rc;
 }
 
 const PegcRule PegcRule_flush_actions = PEGCRULE_INIT1(PegcRule_mf_flush_actions);
@@ -1578,7 +2862,7 @@ static bool PegcRule_mf_action( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, true, true, true ) ) return false;
     //pegc_const_iterator orig = pegc_pos(st);
-    bool rc = self->proxy->rule( self->proxy, st );
+    bool rc = pegc_rule_call( self->proxy, st );
     //MARKER; printf("rule matched =? %d\n", rc);
     if( rc )
     {
@@ -1609,13 +2893,11 @@ PegcRule pegc_r_action_i_p( pegc_parser * st,
     if( ! st || !rule ) return PegcRule_invalid;
     if( onMatch )
     {
-	info = (pegc_action_info*)malloc(sizeof(pegc_action_info));
+	info = (pegc_action_info*)pegc_alloc( st, sizeof(pegc_action_info) );
 	if( ! info )
 	{
 	    return PegcRule_invalid;
 	}
-	st->stats.alloced += sizeof(pegc_action_info);
-	pegc_gc_add( st, info, pegc_free_value );
 	info->action = onMatch;
 	info->data = clientData;
     }
@@ -1696,7 +2978,7 @@ PegcRule pegc_r_char( pegc_char_t input, bool caseSensitive )
     return pegc_r( caseSensitive
 		   ? PegcRule_mf_char
 		   : PegcRule_mf_chari,
-		   pegc_latin1(input));
+		   pegc_latin1((unsigned char)input));
 }
 
 
@@ -1709,7 +2991,7 @@ static bool PegcRule_mf_ ## F( PegcRule const * self, pegc_parser * st ) \
 { \
     if( !pegc_rule_check( self, st, false, false, false ) ) return false; \
     pegc_const_iterator pos = pegc_pos(st); \
-    if( is ## F(*pos) ) { \
+    if( is ## F((unsigned char)*pos) ) { \
 	pegc_set_match( st, pos, pos+1, true ); \
 	return true; \
     } \
@@ -1748,7 +3030,7 @@ const PegcRule PegcRule_blanks = PEGCRULE_INIT1(PegcRule_mf_blanks);
 static bool PegcRule_mf_opt( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, false, true, true ) ) return false;
-    self->proxy->rule( self->proxy, st );
+    pegc_rule_call( self->proxy, st );
     return true;
 }
 
@@ -1798,77 +3080,238 @@ static bool PegcRule_mf_digits( PegcRule const * self, pegc_parser * st )
 }
 const PegcRule PegcRule_digits = PEGCRULE_INIT1(PegcRule_mf_digits);
 
-static bool PegcRule_mf_int_dec( PegcRule const * self, pegc_parser * st )
+/**
+   Scans an optionally signed integer from [p,end): decimal if base
+   is 10, "0x"-prefixed hex if base is 16, and '0'-prefixed octal if
+   base is 8. On success the value is stored in *v (saturated at
+   LONG_MIN/LONG_MAX, like strtol()) and the number of bytes scanned
+   is returned. Returns 0 if there is no such number at p.
+
+   *far is set to where the scan stopped looking, which is end if the
+   result might change were there more input.
+*/
+static size_t pegc_scan_long( pegc_const_iterator p, pegc_const_iterator end,
+			      int base, long * v, pegc_const_iterator * far )
+{
+    unsigned char const * s = (unsigned char const *)p;
+    unsigned char const * const e = (unsigned char const *)end;
+    bool neg = false;
+    if( (s < e) && ((*s == '+') || (*s == '-')) ) neg = ('-' == *s++);
+    *far = (pegc_const_iterator)s;
+    if( 16 == base )
+    {
+	if( (e - s) < 3 ) *far = end;
+	if( ((e - s) < 3) || (s[0] != '0') || ((s[1] != 'x') && (s[1] != 'X')) ) return 0;
+	s += 2;
+    }
+    else if( (8 == base) && ((s == e) || (*s != '0')) )
+    {
+	return 0;
+    }
+    unsigned long const limit = neg
+	? ((unsigned long)LONG_MAX + 1UL)
+	: (unsigned long)LONG_MAX;
+    unsigned long acc = 0;
+    bool overflow = false;
+    unsigned char const * const digits = s;
+    for( ; s < e; ++s )
+    {
+	int d;
+	if( (*s >= '0') && (*s <= '9') ) d = *s - '0';
+	else if( (16 == base) && (*s >= 'a') && (*s <= 'f') ) d = *s - 'a' + 10;
+	else if( (16 == base) && (*s >= 'A') && (*s <= 'F') ) d = *s - 'A' + 10;
+	else break;
+	if( d >= base ) break;
+	if( overflow ) continue;
+	if( acc > (limit - (unsigned long)d) / (unsigned long)base ) overflow = true;
+	else acc = acc * (unsigned long)base + (unsigned long)d;
+    }
+    *far = (pegc_const_iterator)s;
+    if( s == digits ) return 0;
+    if( overflow ) *v = neg ? LONG_MIN : LONG_MAX;
+    else if( neg ) *v = (acc == ((unsigned long)LONG_MAX + 1UL)) ? LONG_MIN : -(long)acc;
+    else *v = (long)acc;
+    return s - (unsigned char const *)p;
+}
+
+/**
+   Converts the decimal floating-point number [p,end) using strtod(),
+   working around the current locale's idea of the decimal point.
+   Only used when pegc_scan_double() cannot convert the number
+   exactly on its own.
+*/
+static double pegc_strtod( pegc_const_iterator p, pegc_const_iterator end )
+{
+    size_t const n = end - p;
+    char buf[128];
+    char * b = (n < sizeof(buf)) ? buf : (char *)malloc( n + 1 );
+    if( ! b ) return 0.0;
+    memcpy( b, p, n );
+    b[n] = 0;
+    char const point = *localeconv()->decimal_point;
+    if( point && ('.' != point) )
+    {
+	char * x = strchr( b, '.' );
+	if( x ) *x = point;
+    }
+    double const d = strtod( b, 0 );
+    if( b != buf ) pegc_free( b );
+    return d;
+}
+
+/**
+   Scans an optionally signed decimal floating-point number from
+   [p,end), with an optional fraction and exponent part, storing its
+   value in *v. Returns the number of bytes scanned, or 0 if there is
+   no such number at p.
+
+   Numbers with at most 19 significant digits and a small enough
+   exponent are converted exactly by a single multiplication or
+   division (Clinger's fast path); all others go through strtod().
+
+   *far is set as for pegc_scan_long().
+*/
+static size_t pegc_scan_double( pegc_const_iterator p, pegc_const_iterator end,
+				double * v, pegc_const_iterator * far )
+{
+    static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    unsigned char const * s = (unsigned char const *)p;
+    unsigned char const * const e = (unsigned char const *)end;
+    bool neg = false;
+    if( (s < e) && ((*s == '+') || (*s == '-')) ) neg = ('-' == *s++);
+    unsigned long long m = 0;
+    int ndigits = 0; /* significant digits in m */
+    long scale = 0; /* power of 10 to apply to m */
+    bool inexact = false; /* true if digits were dropped from m */
+    bool any = false;
+    bool frac = false;
+    for( ; s < e; ++s )
+    {
+	if( ('.' == *s) && ! frac )
+	{
+	    frac = true;
+	    continue;
+	}
+	if( (*s < '0') || (*s > '9') ) break;
+	any = true;
+	int const d = *s - '0';
+	if( ndigits < 19 )
+	{
+	    m = m * 10 + d;
+	    if( m ) ++ndigits;
+	    if( frac ) --scale;
+	}
+	else
+	{
+	    if( d ) inexact = true;
+	    if( ! frac ) ++scale;
+	}
+    }
+    *far = (pegc_const_iterator)s;
+    if( ! any ) return 0;
+    if( (s < e) && ((*s == 'e') || (*s == 'E')) )
+    {
+	unsigned char const * x = s + 1;
+	bool eneg = false;
+	if( (x < e) && ((*x == '+') || (*x == '-')) ) eneg = ('-' == *x++);
+	if( x == e ) *far = end;
+	if( (x < e) && (*x >= '0') && (*x <= '9') )
+	{
+	    long ev = 0;
+	    for( ; (x < e) && (*x >= '0') && (*x <= '9'); ++x )
+	    {
+		if( ev < 100000 ) ev = ev * 10 + (*x - '0');
+	    }
+	    scale += eneg ? -ev : ev;
+	    s = x;
+	    *far = (pegc_const_iterator)x;
+	}
+    }
+    if( ! m && ! inexact )
+    {
+	*v = neg ? -0.0 : 0.0;
+    }
+    else if( ! inexact && (m <= (1ULL << 53)) && (scale >= -22) && (scale <= 22) )
+    {
+	double const d = (double)m;
+	*v = (scale < 0) ? (d / pow10[-scale]) : (d * pow10[scale]);
+	if( neg ) *v = -*v;
+    }
+    else
+    {
+	*v = pegc_strtod( p, (pegc_const_iterator)s );
+    }
+    return s - (unsigned char const *)p;
+}
+
+/**
+   Implementation of the native integer rules: scans a number of the
+   given base at the current position and, on success, records it in
+   st->number and matches it.
+*/
+static bool pegc_match_long( pegc_parser * st, int base )
 {
+    if( ! pegc_isgood(st) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    long myv = 0;
-    int len = 0;
-    int rc = sscanf(pegc_pos(st), "%ld%n",&myv,&len);
-    //MARKER;printf("sscanf(%%ld) rc=%d len=%ld\n", rc, len );
-    if( (1 != rc) || (0 == len) ) return false;
-    //MARKER;printf("sscanf(%%ld) rc=%d len=%ld\n", rc, len );
-    //if( ! pegc_advance(st,len) ) return false;
-    //MARKER;printf("sscanf(%%ld) rc=%d len=%ld\n", rc, len );
-    pegc_set_match( st, orig, orig + len, true );
-    return true;
+    long v = 0;
+    pegc_const_iterator far = orig;
+    size_t const len = pegc_scan_long( orig, pegc_end(st), base, &v, &far );
+    pegc_touch( st, far );
+    if( ! len ) return false;
+    st->number.kind = PegcNumber_Long;
+    st->number.begin = orig;
+    st->number.end = orig + len;
+    st->number.lval = v;
+    st->number.dval = (double)v;
+    return pegc_set_match( st, orig, orig + len, true );
+}
+
+static bool PegcRule_mf_int_dec( PegcRule const * ARG_UNUSED(self), pegc_parser * st )
+{
+    return pegc_match_long( st, 10 );
 }
 const PegcRule PegcRule_int_dec = PEGCRULE_INIT1(PegcRule_mf_int_dec);
 
+static bool PegcRule_mf_int_hex( PegcRule const * ARG_UNUSED(self), pegc_parser * st )
+{
+    return pegc_match_long( st, 16 );
+}
+const PegcRule PegcRule_int_hex = PEGCRULE_INIT1(PegcRule_mf_int_hex);
+
+static bool PegcRule_mf_int_oct( PegcRule const * ARG_UNUSED(self), pegc_parser * st )
+{
+    return pegc_match_long( st, 8 );
+}
+const PegcRule PegcRule_int_oct = PEGCRULE_INIT1(PegcRule_mf_int_oct);
 
-bool PegcRule_mf_int_dec_strict( PegcRule const * self, pegc_parser * st )
+bool PegcRule_mf_int_dec_strict( PegcRule const * ARG_UNUSED(self), pegc_parser * st )
 {
-    //if( ! pegc_rule_check( self, st, false, false, false ) ) return false;
     if( ! pegc_isgood(st) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    PegcRule * r = 0;
-    void * x = pegc_gc_search( st, (void const *)PegcRule_mf_int_dec_strict );
-    if( x )
-    {
-	r = (PegcRule *)x;
-	//MARKER;printf("Got cached rule for pegc_r_int_dec_strict()\n");
-    }
-    else
-    {
-	r = pegc_alloc_r( st, PegcRule_mf_int_dec_strict, 0 );
-	pegc_gc_register( st, (void *)PegcRule_mf_int_dec_strict, 0, r, 0 );
-	//MARKER;printf("Creating shared proxy rule for pegc_r_int_dec_strict()\n");
-	/**
-	   After we've matched digits we need to ensure that the next
-	   character is [what we consider to be] legal.
-	*/
-#if 0
-#define DECL(N) PegcRule const * N 
-#define CP(X) pegc_copy_r_v( st, X )
-	DECL(aend) = 0;
-	DECL(punct) = CP(pegc_r_oneof("._",true));
-	DECL(illegaltail) = CP( pegc_r_or_ep( st, &PegcRule_alpha, punct, aend ) );
-	DECL(next) = CP( pegc_r_notat_p( illegaltail ) );
-	DECL(end) = CP(pegc_r_or_ep( st, &PegcRule_eof, next, aend ));
-	DECL(R) = CP(pegc_r_and_ep( st, &PegcRule_int_dec, end, aend ));
-	r->proxy = R;
-#else
-#define DECL(N) PegcRule const N 
-#define CP(X) X
-	DECL(aend) = PegcRule_invalid;
-	DECL(punct) = pegc_r_oneof("._",true);
-	DECL(illegaltail) = pegc_r_or_ev( st, PegcRule_alpha, punct, aend );
-	DECL(next) = pegc_r_notat_v( st, illegaltail );
-	DECL(end) = pegc_r_or_ev( st, PegcRule_eof, next, aend );
-	DECL(R) = pegc_r_and_ev( st, PegcRule_int_dec, end, aend );
-	r = pegc_copy_r_v(st, R );
-#endif
-#undef CP
-#undef DECL
-    }
-    if( r && r->rule && r->rule( r, st ) )
+    long v = 0;
+    pegc_const_iterator far = orig;
+    size_t const len = pegc_scan_long( orig, pegc_end(st), 10, &v, &far );
+    pegc_touch( st, far );
+    if( ! len ) return false;
+    /**
+       After we've matched digits we need to ensure that the next
+       character is [what we consider to be] legal.
+    */
+    pegc_const_iterator const tail = orig + len;
+    if( (tail < pegc_end(st))
+	&& (isalpha((unsigned char)*tail) || ('.' == *tail) || ('_' == *tail)) )
     {
-	//DUMPPOS(st);
-	pegc_set_match( st, orig, pegc_pos(st), true );
-	return true;
+	return false;
     }
-    //MARKER;
-    //pegc_set_pos(st,orig);
-    return false;
+    st->number.kind = PegcNumber_Long;
+    st->number.begin = orig;
+    st->number.end = tail;
+    st->number.lval = v;
+    st->number.dval = (double)v;
+    return pegc_set_match( st, orig, tail, true );
 }
 const PegcRule PegcRule_int_dec_strict = PEGCRULE_INIT1(PegcRule_mf_int_dec_strict);
 
@@ -1882,15 +3325,52 @@ static bool PegcRule_mf_double( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, false, false, false ) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    double myv = 0.0;
-    int len = 0;
-    int rc = sscanf(pegc_pos(st), "%lf%n",&myv,&len);
-    if( (0 == rc) || (EOF == rc) || (0 == len) ) return false;
+    double v = 0.0;
+    pegc_const_iterator far = orig;
+    size_t const len = pegc_scan_double( orig, pegc_end(st), &v, &far );
+    pegc_touch( st, far );
+    if( ! len ) return false;
+    st->number.kind = PegcNumber_Double;
+    st->number.begin = orig;
+    st->number.end = orig + len;
+    st->number.lval = 0;
+    st->number.dval = v;
     return pegc_set_match( st, orig, orig + len, true );
 }
 
 const PegcRule PegcRule_double = PEGCRULE_INIT1(PegcRule_mf_double);
 
+/**
+   Returns st->number if its range is exactly that of m (or of st's
+   current match if m is 0), else 0.
+*/
+static pegc_number const * pegc_number_for( pegc_parser const * st, pegc_cursor const * m )
+{
+    if( ! st ) return 0;
+    if( ! m ) m = &st->match;
+    return ( (PegcNumber_None != st->number.kind)
+	     && (st->number.begin == m->begin)
+	     && (st->number.end == m->end) )
+	? &st->number
+	: 0;
+}
+
+bool pegc_get_number_long( pegc_parser const * st, pegc_cursor const * m, long * v )
+{
+    pegc_number const * n = pegc_number_for( st, m );
+    if( ! n || (PegcNumber_Long != n->kind) ) return false;
+    if( v ) *v = n->lval;
+    return true;
+}
+
+bool pegc_get_number_double( pegc_parser const * st, pegc_cursor const * m, double * v )
+{
+    pegc_number const * n = pegc_number_for( st, m );
+    if( ! n ) return false;
+    if( v ) *v = n->dval;
+    return true;
+}
+
 
 static bool PegcRule_mf_ascii_impl( PegcRule const * ARG_UNUSED(self),
 				    pegc_parser * st, int max )
@@ -1898,7 +3378,7 @@ static bool PegcRule_mf_ascii_impl( PegcRule const * ARG_UNUSED(self),
     if(  st && pegc_isgood(st) )
     {
 	pegc_const_iterator p = pegc_pos(st);
-	int ch = *p;
+	int ch = (unsigned char)*p;
 	if( (ch >= 0) && (ch <=max) )
 	{
 	    pegc_set_match( st, p, p+1, true );
@@ -1933,7 +3413,21 @@ static bool PegcRule_mf_repeat( PegcRule const * self, pegc_parser * st )
     if( ! info ) return false;
     pegc_const_iterator orig = pegc_pos(st);
     size_t count = 0;
-    while( self->proxy->rule( self->proxy, st ) )
+    pegc_span_set const * ss = pegc_span_set_for( st, self->proxy );
+    if( ss )
+    {
+	size_t const avail = pegc_end(st) - orig;
+	count = pegc_span( ss, orig, (avail < info->max) ? avail : info->max );
+	if( count < info->max )
+	{
+	    pegc_touch( st, orig + count );
+	    pegc_fail_note( st, self->proxy, orig + count );
+	}
+	if( count < info->min ) return false;
+	pegc_set_match( st, orig, orig + count, true );
+	return true;
+    }
+    while( pegc_rule_call( self->proxy, st ) )
     {
 	if( (++count == info->max)
 	    || pegc_eof(st)
@@ -1965,10 +3459,8 @@ PegcRule pegc_r_repeat( pegc_parser * st,
        TODO: consider stuffing min into st->data and max into st->proxy, to
        avoid an allocation here.
     */
-    pegc_range_info * info = (pegc_range_info *)malloc(sizeof(pegc_range_info));
+    pegc_range_info * info = (pegc_range_info *)pegc_alloc( st, sizeof(pegc_range_info) );
     if( ! info ) return PegcRule_invalid;
-    st->stats.alloced += sizeof(pegc_range_info);
-    pegc_gc_add( st, info, pegc_free_key );
     info->min = min;
     info->max = max;
     PegcRule r = pegc_r( PegcRule_mf_repeat, info );
@@ -1991,14 +3483,14 @@ static bool PegcRule_mf_pad( PegcRule const * self, pegc_parser * st )
     pegc_const_iterator tail = 0;
     if( info && info->left.rule )
     {
-	info->left.rule( &(info->left), st );
+	pegc_rule_call( &(info->left), st );
 	if( info->discard ) orig = pegc_pos(st);
     }
-    bool ret = self->proxy->rule( self->proxy, st );
+    bool ret = pegc_rule_call( self->proxy, st );
     tail = pegc_pos(st);
     if( ret && info && info->right.rule )
     {
-	info->right.rule( &(info->right), st );
+	pegc_rule_call( &(info->right), st );
 	if( ! info->discard ) tail = pegc_pos(st);
     }
     if( ret )
@@ -2020,13 +3512,11 @@ PegcRule pegc_r_pad_p( pegc_parser * st,
 {
     if( !st || !rule ) return PegcRule_invalid;
     if( ! left && !right ) return *rule;
-    pegc_pad_info * d = (pegc_pad_info *) malloc(sizeof(pegc_pad_info));
+    pegc_pad_info * d = (pegc_pad_info *) pegc_alloc( st, sizeof(pegc_pad_info) );
     if( ! d ) return PegcRule_invalid;
-    st->stats.alloced += sizeof(pegc_pad_info);
     d->discard = discardLeftRight;
     PegcRule r = pegc_r( PegcRule_mf_pad, d );
     r.proxy = rule;
-    pegc_gc_add( st, d, pegc_free_value );
     d->left = d->right = PegcRule_invalid;
     if( left )
     {
@@ -2071,10 +3561,10 @@ static bool PegcRule_mf_if_then_else( PegcRule const * self, pegc_parser * st )
     if( ! pegc_rule_check( self, st, true, false, true ) ) return false;
     pegc_if_then_else const * ite = (pegc_if_then_else const *)self->data;
     pegc_const_iterator orig = pegc_pos(st);
-    if( ite->If->rule && ite->If->rule( ite->If, st ) )
+    if( ite->If->rule && pegc_rule_call( ite->If, st ) )
     {
 	//MARKER;printf("IF succeeded.\n");
-	if( ite->Then && ite->Then->rule( ite->Then, st ) )
+	if( ite->Then && pegc_rule_call( ite->Then, st ) )
 	{
 	    //MARKER;printf("THEN succeeded.\n");
 	    pegc_set_match( st, orig, pegc_pos(st), false );
@@ -2084,7 +3574,7 @@ static bool PegcRule_mf_if_then_else( PegcRule const * self, pegc_parser * st )
 	//MARKER;printf("THEN failed.\n");
 	return false;
     }
-    else if( ite->Else && ite->Else->rule && ite->Else->rule( ite->Else, st ) )
+    else if( ite->Else && ite->Else->rule && pegc_rule_call( ite->Else, st ) )
     {
 	//MARKER;printf("ELSE succeeded.\n");
 	pegc_set_match( st, orig, pegc_pos(st), false );
@@ -2101,10 +3591,8 @@ PegcRule pegc_r_if_then_else_p( pegc_parser * st,
 				PegcRule const * Else )
 {
     if( !st || ! If || ! Then ) return PegcRule_invalid;
-    pegc_if_then_else * ite = (pegc_if_then_else*)malloc(sizeof(pegc_if_then_else));
+    pegc_if_then_else * ite = (pegc_if_then_else*)pegc_alloc( st, sizeof(pegc_if_then_else) );
     if( ! ite ) return PegcRule_invalid;
-    st->stats.alloced += sizeof(pegc_if_then_else);
-    pegc_gc_add( st, ite, pegc_free_value );
     ite->If = If;
     ite->Then = Then;
     ite->Else = Else;
@@ -2127,17 +3615,21 @@ static bool PegcRule_mf_until( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, false, true, true ) ) return false;
     pegc_const_iterator orig = pegc_pos(st);
-    pegc_const_iterator pos = orig;
-    bool matched = self->proxy->rule( self->proxy, st );
-    bool isConsumer = (matched && (pos==pegc_pos(st)));
-    while( !matched )
+    pegc_const_iterator const end = pegc_end(st);
+    /* Skip over bytes where the proxy cannot start a match, so that
+       e.g. until("*" "/") only tries the string at each '*'. */
+    pegc_span_set const * skip = pegc_span_skip_set_for( st, self );
+    bool matched = false;
+    while( true )
     {
-	if( ! pegc_bump(st) ) break;
-	matched = self->proxy->rule( self->proxy, st );
-	if(0) if( matched && !isConsumer )
+	if( skip )
 	{
-	    matched = false;
+	    pegc_const_iterator const pos = pegc_pos(st);
+	    size_t const n = pegc_span( skip, pos, end - pos );
+	    if( n && ! pegc_set_pos( st, pos + n ) ) break;
 	}
+	matched = pegc_rule_call( self->proxy, st );
+	if( matched || ! pegc_bump(st) ) break;
     }
     if( ! matched )
     {
@@ -2191,7 +3683,6 @@ static void pegc_free_string_quoted_data(void *x)
 	{
 	    pegc_free(p->freeme);
 	}
-	pegc_free(p);
     }
 }
 
@@ -2201,24 +3692,27 @@ char * pegc_unescape_quoted_string( pegc_const_iterator inp,
 		      int escChar
 		      )
 {
-    if( !inp || !inlen || (quoteChar != *inp) ) return 0;
+    if( !inp || !inlen ) return 0;
     if( inlen < 0 ) inlen = pegc_strlen(inp);
-    ++inp;
-    whclob * cb = whclob_new();
-    char const * at = inp;
-    long i = 1;
-    bool ok = true;
-    for( ; at && *at && (i<inlen-1); ++at, ++i )
+    if( (inlen < 2) || (quoteChar != inp[0]) || (quoteChar != inp[inlen-1]) ) return 0;
+    /* The unescaped string is never longer than the input, minus
+       the quotes, plus a NUL. */
+    char * ret = (char *)malloc( inlen - 1 );
+    if( ! ret ) return 0;
+    char * out = ret;
+    pegc_const_iterator at = inp + 1;
+    pegc_const_iterator const end = inp + inlen - 1; /* closing quote */
+    for( ; at < end; ++at )
     {
 	char ch = *at;
 	if( escChar && (escChar == ch) )
 	{
-	    if( ++i == inlen )
-	    {
-		ok = false;
-		break;
+	    if( ++at == end )
+	    { /* the closing quote is escaped */
+		pegc_free( ret );
+		return 0;
 	    }
-	    ch = *++at;
+	    ch = *at;
 	    if(escChar == '\\') switch(ch)
 	    {
 	      case 't': ch = '\t'; break;
@@ -2231,20 +3725,13 @@ char * pegc_unescape_quoted_string( pegc_const_iterator inp,
 	    };
 	}
 	else if( quoteChar == ch )
-	{
-	    break;
+	{ /* unescaped quote before the end */
+	    pegc_free( ret );
+	    return 0;
 	}
-	whclob_append_char_n( cb, ch, 1 );
-    }
-    ++i;
-    ok = ok && (quoteChar == *at) && (i==inlen);
-    //MARKER;printf("ok=%d i=%ld inlen=%ld\n",ok,i,inlen);
-    char * ret = 0;
-    if( ok )
-    {
-	ret = whclob_take_buffer(cb);
+	*out++ = ch;
     }
-    whclob_finalize(cb);
+    *out = '\0';
     return ret;
 }
 
@@ -2254,7 +3741,7 @@ char * pegc_unescape_quoted_string( pegc_const_iterator inp,
 static bool PegcRule_mf_string_quoted( PegcRule const * self, pegc_parser * st )
 {
     if( ! pegc_rule_check( self, st, true, false, false ) ) return false;
-    pegc_string_quoted_data * sd = (pegc_string_quoted_data*)pegc_gc_search( st, self->data );
+    pegc_string_quoted_data * sd = (pegc_string_quoted_data*)self->data;
     if( ! sd ) return false;
     pegc_const_iterator orig = pegc_pos(st);
     if( *pegc_pos(st) != sd->quote ) return false;
@@ -2265,7 +3752,7 @@ static bool PegcRule_mf_string_quoted( PegcRule const * self, pegc_parser * st )
 	pegc_char_t ch = *pegc_pos(st);
 	if( sd->esc && (sd->esc == ch) )
 	{
-	    if( ! pegc_bump(st) )
+	    if( ! pegc_bump(st) || pegc_eof(st) )
 	    {
 		ok = false;
 		break;
@@ -2284,31 +3771,13 @@ static bool PegcRule_mf_string_quoted( PegcRule const * self, pegc_parser * st )
     {
 	if( ! pegc_has_error(st) )
 	{
-	    pegc_const_iterator pos = pegc_pos(st);
-	    size_t line1 = 0, line2 = 0;
-	    size_t col1 = 0, col2 = 0;
-	    pegc_line_col( st, &line1, &col1 );
-	    pegc_set_pos( st, orig );
-	    pegc_line_col( st, &line2, &col2 );
-	    pegc_set_pos(st,pos);
-	    char const * detail = 0;
-	    if( *pegc_pos(st) != sd->quote )
-	    {
-		detail = "unexpected end of quoted string.";
-	    }
-	    else if( pegc_eof(st) )
-	    {
-		detail = "hit EOF while inside a quoted string.";
-	    }
-	    else
-	    {
-		detail = "unknown error parsing quoted string.";
-	    }
-	    pegc_set_error_e(st,
-			     "%s() parse error near line %u, col %u: %s"
-			     "\nPossibly started near line %u, col %u.",
-			     __func__, line1, col1, detail,
-			     line2, col2);
+	    /* Only recorded here: pegc_get_error() works out the
+	       positions and text if they are asked for. */
+	    pegc_errinfo * e = pegc_set_error_code( st, PegcError_QuotedString );
+	    e->arg[0] = orig - pegc_begin(st);
+	    if( pegc_eof(st) ) e->arg[1] = 0;
+	    else if( *pegc_pos(st) != sd->quote ) e->arg[1] = 1;
+	    else e->arg[1] = 2;
 	}
 	pegc_set_pos( st, orig );
 	return false;
@@ -2339,7 +3808,7 @@ PegcRule pegc_r_string_quoted( pegc_parser * st,
 			       pegc_char_t ** target )
 {
     if( ! st || !quoteChar ) return PegcRule_invalid;
-    pegc_string_quoted_data * sd = (pegc_string_quoted_data*)malloc(sizeof(pegc_string_quoted_data));
+    pegc_string_quoted_data * sd = (pegc_string_quoted_data*)pegc_alloc( st, sizeof(pegc_string_quoted_data) );
     if( ! sd ) return PegcRule_invalid;
     sd->quote = quoteChar;
     sd->esc = escChar;
@@ -2351,6 +3820,2738 @@ PegcRule pegc_r_string_quoted( pegc_parser * st,
     return pegc_r( PegcRule_mf_string_quoted, sd );
 }
 
+/**
+   Implementation of pegc_r_leftrec(). self->proxy (and self->data)
+   is the rule's body.
+
+   This uses the seed-growing technique described by Warth et al.
+   (as refined by Medeiros et al.): the first time the rule runs at
+   a given position, a failing "seed" result is memoized for it. The
+   body is then run repeatedly; recursive calls to this rule at the
+   same position get the current seed from the memo table, and each
+   run which consumes more input than the previous one becomes the
+   new seed. When the body stops making progress, the last seed is
+   the result.
+*/
+static bool PegcRule_mf_leftrec( PegcRule const * self, pegc_parser * st )
+{
+    if( ! pegc_rule_check( self, st, true, true, true ) ) return false;
+    pegc_const_iterator const beg = st->cursor.begin;
+    pegc_const_iterator const orig = pegc_pos(st);
+    size_t const offset = orig - beg;
+    pegc_memo_key const key = pegc_memo_key_of( self );
+    pegc_memo_entry * e = pegc_memo_search( st, &key, offset );
+    if( e && (PegcMemo_Stale != e->state) )
+    {
+	pegc_touch( st, beg + e->far );
+	if( (PegcMemo_Matched != e->state) && (PegcMemo_GrowingMatched != e->state) ) return false;
+	st->cursor.pos = beg + e->end;
+	if( PEGC_MEMO_NOMATCH != e->mbegin )
+	{
+	    st->match.pos = st->match.begin = beg + e->mbegin;
+	    st->match.end = beg + e->mend;
+	}
+	return true;
+    }
+    e = pegc_memo_insert( st, &key, offset );
+    if( ! e )
+    {
+	pegc_set_error_e( st, "Out of memory for left-recursion memo table." );
+	return false;
+    }
+    e->state = PegcMemo_GrowingFailed;
+    ++st->memo.growing;
+    bool matched = false;
+    size_t end = offset;
+    pegc_cursor m = pegc_cursor_init;
+    size_t mark = st->actions.count;
+    pegc_const_iterator const outer = st->memo.far;
+    st->memo.far = 0;
+    while( true )
+    {
+	st->cursor.pos = orig;
+	bool const rc = pegc_rule_call( self->proxy, st );
+	size_t const now = pegc_pos(st) - beg;
+	if( pegc_has_error(st) ) break;
+	if( ! rc || (matched && (now <= end)) )
+	{ /* No progress: drop the actions queued by this run. */
+	    pegc_truncate_actions( st, mark );
+	    break;
+	}
+	matched = true;
+	end = now;
+	m = st->match;
+	mark = st->actions.count;
+	/* The table may have been re-allocated by the body. */
+	e = pegc_memo_search( st, &key, offset );
+	e->state = PegcMemo_GrowingMatched;
+	e->end = end;
+	if( m.begin && (m.begin >= beg) && (m.end <= st->cursor.end) )
+	{
+	    e->mbegin = m.begin - beg;
+	    e->mend = m.end - beg;
+	}
+	else
+	{
+	    e->mbegin = e->mend = PEGC_MEMO_NOMATCH;
+	}
+    }
+    --st->memo.growing;
+    if( matched ) st->cursor.pos = beg + end;
+    size_t const far = pegc_memo_far_end( st, orig, outer );
+    e = pegc_memo_search( st, &key, offset );
+    e->far = far;
+    if( pegc_has_error(st) || st->memo.growing )
+    { /* Our result may depend on an outer rule's seed. */
+	e->state = PegcMemo_Stale;
+    }
+    else
+    {
+	e->state = matched ? PegcMemo_Matched : PegcMemo_Failed;
+    }
+    if( ! matched || pegc_has_error(st) )
+    {
+	st->cursor.pos = orig;
+	return false;
+    }
+    st->cursor.pos = beg + end;
+    if( m.begin ) st->match = m;
+    return true;
+}
+
+PegcRule pegc_r_leftrec( PegcRule const * body )
+{
+    if( ! body ) return PegcRule_invalid;
+    /* Using body as the data makes all left-recursive rules with the
+       same body share one memo entry per position, which is fine
+       because they are equivalent. */
+    PegcRule r = pegc_r( PegcRule_mf_leftrec, body );
+    r.proxy = body;
+    r.name = "LeftRecursive";
+    return r;
+}
+
+/**
+   Implementation of pegc_r_ref(). self->proxy is the reference's
+   slot, which holds the bound rule.
+*/
+static bool PegcRule_mf_ref( PegcRule const * self, pegc_parser * st )
+{
+    if( pegc_has_error(st) ) return false;
+    PegcRule const * target = self->proxy;
+    if( ! target || ! target->rule )
+    {
+	pegc_set_error_e( st, "%s(): reference '%s' was never bound.",
+			  __func__, self->name ? self->name : "" );
+	return false;
+    }
+    return pegc_rule_call( target, st );
+}
+
+PegcRule pegc_r_ref( pegc_parser * st, char const * name )
+{
+    if( ! st ) return PegcRule_invalid;
+    /* The slot lives in st's arena, next to the grammar's other
+       rules, and is reached from the rule with a single load. */
+    PegcRule * slot = (PegcRule *)pegc_alloc( st, sizeof(PegcRule) );
+    if( ! slot ) return PegcRule_invalid;
+    *slot = PegcRule_invalid;
+    PegcRule r = pegc_r( PegcRule_mf_ref, 0 );
+    r.proxy = slot;
+    r.name = name ? name : "Ref";
+    return r;
+}
+
+bool pegc_ref_bind( PegcRule const * ref, PegcRule const target )
+{
+    if( ! ref || (ref->rule != PegcRule_mf_ref) || ! ref->proxy
+	|| ! pegc_is_rule_valid( &target ) )
+    {
+	return false;
+    }
+    *((PegcRule *)ref->proxy) = target;
+    return true;
+}
+
+/************************************************************************
+Rule compiler and virtual machine. pegc_compile() lowers a rule graph
+into a flat array of instructions which pegc_parse_program() runs in a
+single dispatch loop, avoiding the per-rule indirect call and
+pegc_rule_check() overhead of the native rules. The instruction set
+is modeled after that of LPeg's parsing machine: backtracking is
+done via CHOICE entries on an explicit stack instead of via the C
+stack.
+************************************************************************/
+
+/**
+   Opcodes for pegc_vm_insn.
+*/
+enum pegc_vm_opcodes {
+/** Success: stop the VM. */
+PegcOp_End = 0,
+/** Fail unconditionally. */
+PegcOp_Fail,
+/** Fail unless pegc_isgood(). Emulates pegc_rule_check(). */
+PegcOp_Check,
+/** Match the byte in arg. */
+PegcOp_Char,
+/** Match one byte from the set prog->sets[arg]. */
+PegcOp_Set,
+/** Match the string ptr (length arg2), case-sensitively. */
+PegcOp_String,
+/** Match the string ptr (length arg2), case-insensitively. */
+PegcOp_StringI,
+/** Fail unless pegc_eof(). */
+PegcOp_Eof,
+/** Fail unless pegc_bump() succeeds. */
+PegcOp_Bump,
+/** Run the (un-lowerable) rule ptr via pegc_rule_call(). */
+PegcOp_Rule,
+/** Jump to arg. */
+PegcOp_Jmp,
+/** Push a backtrack entry which resumes at arg. */
+PegcOp_Choice,
+/** Pop the top CHOICE and jump to arg. */
+PegcOp_Commit,
+/** Update the top CHOICE's position and jump to arg, or pop it
+    and continue if no input was consumed since it was pushed. */
+PegcOp_PartialCommit,
+/** Restore the position from the top CHOICE, pop it, jump to arg. */
+PegcOp_BackCommit,
+/** Pop the top CHOICE and fail. */
+PegcOp_FailTwice,
+/** Call the subroutine at arg. */
+PegcOp_Call,
+/** Return from a subroutine. */
+PegcOp_Ret,
+/** Push the current position. */
+PegcOp_Mark,
+/** Pop a MARK and set the match from there to the current
+    position. If arg is non-zero, do so only if the match is not
+    empty. */
+PegcOp_SetMatch,
+/** Jump to arg if the position equals that of the top MARK. */
+PegcOp_IfNoProgress,
+/** Push a repetition counter. */
+PegcOp_RepInit,
+/** Pop the top CHOICE, bump the counter, and jump to arg unless the
+    count has reached arg2 or no more input can be consumed. */
+PegcOp_RepStep,
+/** Pop the counter and fail if it is less than arg2. */
+PegcOp_RepEnd,
+/** Pop a MARK and run the immediate action ptr (a pegc_action_info)
+    on the matched range. */
+PegcOp_ActionI,
+/** Pop a MARK and queue the delayed action ptr (a PegcAction) for
+    the matched range. */
+PegcOp_ActionD
+};
+
+/**
+   One VM instruction. Jump targets are indexes into the program's
+   code array.
+*/
+struct pegc_vm_insn
+{
+    int op;
+    int arg;
+    size_t arg2;
+    void const * ptr;
+    /** For terminal instructions, the rule they implement. */
+    PegcRule const * rule;
+};
+typedef struct pegc_vm_insn pegc_vm_insn;
+
+/**
+   A 256-bit set of bytes, used by PegcOp_Set.
+*/
+struct pegc_vm_set
+{
+    unsigned char bits[32];
+};
+typedef struct pegc_vm_set pegc_vm_set;
+
+struct pegc_program
+{
+    pegc_vm_insn * code;
+    size_t count;
+    size_t capacity;
+    pegc_vm_set * sets;
+    size_t set_count;
+    size_t set_capacity;
+};
+
+static void pegc_free_program( void * p )
+{
+    pegc_program * prog = (pegc_program *)p;
+    if( ! prog ) return;
+    pegc_free( prog->code );
+    pegc_free( prog->sets );
+    pegc_free( prog );
+}
+
+size_t pegc_program_size( pegc_program const * prog )
+{
+    return prog ? prog->count : 0;
+}
+
+/**
+   Internal state for pegc_compile().
+
+   Composite rules are tracked in an open-addressed table keyed by
+   rule contents (see pegc_memo_key). Nodes which are referenced more
+   than once (which includes all recursive rules) are compiled only
+   once, as a subroutine.
+*/
+struct pegc_vm_node
+{
+    pegc_memo_key key;
+    PegcRule const * rule;
+    size_t refs;
+    size_t addr;
+    bool queued;
+};
+typedef struct pegc_vm_node pegc_vm_node;
+
+struct pegc_vm_compiler
+{
+    pegc_parser * st;
+    pegc_program * prog;
+    pegc_vm_node * nodes;
+    size_t node_capacity;
+    size_t node_count;
+    /** Indexes of nodes waiting to be compiled as subroutines. */
+    size_t * pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    bool ok;
+};
+typedef struct pegc_vm_compiler pegc_vm_compiler;
+
+/**
+   Categories used by pegc_vm_kind().
+*/
+enum pegc_vm_kinds {
+/** Not lowered: run via PegcOp_Rule. */
+PegcKind_Native,
+/** Lowered inline at every use. */
+PegcKind_Terminal,
+/** Lowered, and has sub-rules. */
+PegcKind_Composite
+};
+
+static int pegc_vm_kind( PegcRule const * r )
+{
+    PegcRule_mf const f = r->rule;
+    if( (f == PegcRule_mf_or) || (f == PegcRule_mf_and)
+	|| (f == PegcRule_mf_or_v) || (f == PegcRule_mf_and_v) )
+    {
+	return r->data ? PegcKind_Composite : PegcKind_Native;
+    }
+    if( (f == PegcRule_mf_star) || (f == PegcRule_mf_plus)
+	|| (f == PegcRule_mf_opt) || (f == PegcRule_mf_at)
+	|| (f == PegcRule_mf_notat) || (f == PegcRule_mf_until) )
+    {
+	return r->proxy ? PegcKind_Composite : PegcKind_Native;
+    }
+    if( (f == PegcRule_mf_repeat) || (f == PegcRule_mf_action_d) )
+    {
+	return (r->proxy && r->data) ? PegcKind_Composite : PegcKind_Native;
+    }
+    if( f == PegcRule_mf_action )
+    {
+	return r->proxy ? PegcKind_Composite : PegcKind_Native;
+    }
+    if( f == PegcRule_mf_ref )
+    { /* an unbound reference reports its error at runtime */
+	return (r->proxy && r->proxy->rule) ? PegcKind_Composite : PegcKind_Native;
+    }
+    if( (f == PegcRule_mf_string) || (f == PegcRule_mf_stringi) )
+    {
+	return (r->data && *((char const *)r->data)) ? PegcKind_Terminal : PegcKind_Native;
+    }
+    if( (f == PegcRule_mf_char) || (f == PegcRule_mf_chari)
+	|| (f == PegcRule_mf_notchar) || (f == PegcRule_mf_notchari)
+	|| (f == PegcRule_mf_oneof) || (f == PegcRule_mf_oneofi) )
+    {
+	return r->data ? PegcKind_Terminal : PegcKind_Native;
+    }
+    if( (f == PegcRule_mf_char_range) || (f == PegcRule_mf_noteof)
+	|| ((f == PegcRule_mf_charclass) && r->data)
+	|| (f == PegcRule_mf_eof) || (f == PegcRule_mf_success)
+	|| (f == PegcRule_mf_failure) || (f == PegcRule_mf_blanks)
+	|| (f == PegcRule_mf_digits)
+	|| (f == PegcRule_mf_alnum) || (f == PegcRule_mf_alpha)
+	|| (f == PegcRule_mf_cntrl) || (f == PegcRule_mf_digit)
+	|| (f == PegcRule_mf_graph) || (f == PegcRule_mf_lower)
+	|| (f == PegcRule_mf_print) || (f == PegcRule_mf_punct)
+	|| (f == PegcRule_mf_space) || (f == PegcRule_mf_upper)
+	|| (f == PegcRule_mf_xdigit) )
+    {
+	return PegcKind_Terminal;
+    }
+    return PegcKind_Native;
+}
+
+/**
+   If r is a single-byte rule which can be expressed as a byte set,
+   fills bits with that set and returns true. The set is computed by
+   evaluating the rule's own predicate for each byte value, so it is
+   exact for the current locale.
+*/
+static bool pegc_rule_charset( PegcRule const * r, unsigned char * bits )
+{
+    PegcRule_mf const f = r->rule;
+    int i;
+    memset( bits, 0, 32 );
+#define SETIF(EXPR) for( i = 0; i < 256; ++i ) { char const c = (char)i; (void)c; if( EXPR ) bits[i>>3] |= (unsigned char)(1 << (i&7)); }
+#define ISA(F) if( f == PegcRule_mf_ ## F ) { SETIF( is ## F(i) ); return true; }
+    ISA(alnum); ISA(alpha); ISA(cntrl); ISA(digit); ISA(graph);
+    ISA(lower); ISA(print); ISA(punct); ISA(space); ISA(upper);
+    ISA(xdigit);
+#undef ISA
+    if( f == PegcRule_mf_noteof )
+    {
+	SETIF( true );
+	return true;
+    }
+    if( (f == PegcRule_mf_charclass) && r->data )
+    {
+	memcpy( bits, ((pegc_charclass const *)r->data)->bits, 32 );
+	return true;
+    }
+    if( f == PegcRule_mf_char_range )
+    {
+	size_t const evil = (size_t)r->data;
+	int const min = ((evil >> 8) & 0x00ff);
+	int const max = (evil & 0x00ff);
+	SETIF( (c >= min) && (c <= max) );
+	return true;
+    }
+    if( ! r->data ) return false;
+    char const d = *((char const *)r->data);
+    if( f == PegcRule_mf_char )
+    {
+	SETIF( c == d );
+	return true;
+    }
+    if( f == PegcRule_mf_chari )
+    {
+	SETIF( tolower(i) == tolower((unsigned char)d) );
+	return true;
+    }
+    if( f == PegcRule_mf_notchar )
+    {
+	SETIF( c != d );
+	return true;
+    }
+    if( f == PegcRule_mf_notchari )
+    {
+	SETIF( tolower(i) != tolower((unsigned char)d) );
+	return true;
+    }
+    if( (f == PegcRule_mf_oneof) || (f == PegcRule_mf_oneofi) )
+    {
+	bool const cs = (f == PegcRule_mf_oneof);
+	char const * s = (char const *)r->data;
+	for( ; *s; ++s )
+	{
+	    SETIF( cs ? (c == *s) : (tolower(i) == tolower((unsigned char)*s)) );
+	}
+	return true;
+    }
+#undef SETIF
+    return false;
+}
+
+static bool pegc_vm_reserve( pegc_vm_compiler * cx )
+{
+    pegc_program * prog = cx->prog;
+    if( ! cx->ok ) return false;
+    if( prog->count < prog->capacity ) return true;
+    size_t const newCap = prog->capacity ? (prog->capacity * 2) : 64;
+    pegc_vm_insn * li = (newCap > (size_t)INT_MAX)
+	? 0
+	: (pegc_vm_insn *)realloc( prog->code, newCap * sizeof(pegc_vm_insn) );
+    if( ! li )
+    {
+	cx->ok = false;
+	return false;
+    }
+    cx->st->stats.alloced += (newCap - prog->capacity) * sizeof(pegc_vm_insn);
+    prog->code = li;
+    prog->capacity = newCap;
+    return true;
+}
+
+/**
+   Appends an instruction to cx's program and returns its index. On
+   allocation error cx->ok is set to false and 0 is returned.
+*/
+static size_t pegc_vm_emit( pegc_vm_compiler * cx, int op, int arg, size_t arg2, void const * ptr )
+{
+    if( ! pegc_vm_reserve( cx ) ) return 0;
+    pegc_vm_insn * in = &cx->prog->code[cx->prog->count];
+    in->op = op;
+    in->arg = arg;
+    in->arg2 = arg2;
+    in->ptr = ptr;
+    in->rule = 0;
+    return cx->prog->count++;
+}
+
+/** Sets the jump target of instruction #at to the next instruction. */
+static void pegc_vm_patch( pegc_vm_compiler * cx, size_t at )
+{
+    if( cx->ok ) cx->prog->code[at].arg = (int)cx->prog->count;
+}
+
+static int pegc_vm_add_set( pegc_vm_compiler * cx, unsigned char const * bits )
+{
+    pegc_program * prog = cx->prog;
+    if( ! cx->ok ) return 0;
+    if( prog->set_count == prog->set_capacity )
+    {
+	size_t const newCap = prog->set_capacity ? (prog->set_capacity * 2) : 8;
+	pegc_vm_set * li = (pegc_vm_set *)realloc( prog->sets, newCap * sizeof(pegc_vm_set) );
+	if( ! li )
+	{
+	    cx->ok = false;
+	    return 0;
+	}
+	cx->st->stats.alloced += (newCap - prog->set_capacity) * sizeof(pegc_vm_set);
+	prog->sets = li;
+	prog->set_capacity = newCap;
+    }
+    memcpy( prog->sets[prog->set_count].bits, bits, 32 );
+    return (int)prog->set_count++;
+}
+
+/**
+   Returns the node for r, adding it if add is true. Returns 0 if it
+   is not found or on allocation error.
+*/
+static pegc_vm_node * pegc_vm_node_get( pegc_vm_compiler * cx, PegcRule const * r, bool add )
+{
+    pegc_memo_key const key = pegc_memo_key_of( r );
+    if( add && ((cx->node_count + 1) * 2 > cx->node_capacity) )
+    {
+	size_t const newCap = cx->node_capacity ? (cx->node_capacity * 2) : 64;
+	pegc_vm_node * li = (pegc_vm_node *)calloc( newCap, sizeof(pegc_vm_node) );
+	if( ! li )
+	{
+	    cx->ok = false;
+	    return 0;
+	}
+	size_t i = 0;
+	for( ; i < cx->node_capacity; ++i )
+	{
+	    pegc_vm_node const * n = &cx->nodes[i];
+	    if( ! n->key.rule ) continue;
+	    size_t h = pegc_memo_hash( &n->key, 0 ) & (newCap - 1);
+	    while( li[h].key.rule ) h = (h + 1) & (newCap - 1);
+	    li[h] = *n;
+	}
+	pegc_free( cx->nodes );
+	cx->nodes = li;
+	cx->node_capacity = newCap;
+    }
+    if( ! cx->node_capacity ) return 0;
+    size_t const mask = cx->node_capacity - 1;
+    size_t h = pegc_memo_hash( &key, 0 ) & mask;
+    for( ; cx->nodes[h].key.rule; h = (h + 1) & mask )
+    {
+	if( pegc_memo_key_eq( &cx->nodes[h].key, &key ) ) return &cx->nodes[h];
+    }
+    if( ! add ) return 0;
+    cx->nodes[h].key = key;
+    cx->nodes[h].rule = r;
+    ++cx->node_count;
+    return &cx->nodes[h];
+}
+
+/**
+   Calls func(cx,child) for each sub-rule of the composite rule r.
+*/
+static void pegc_vm_each_child( pegc_vm_compiler * cx, PegcRule const * r,
+				void (*func)( pegc_vm_compiler *, PegcRule const * ) )
+{
+    PegcRule_mf const f = r->rule;
+    if( (f == PegcRule_mf_or) || (f == PegcRule_mf_and)
+	|| (f == PegcRule_mf_or_v) || (f == PegcRule_mf_and_v) )
+    {
+	PegcRule const * li = (PegcRule const *)r->data;
+	for( ; cx->ok && li->rule; ++li ) func( cx, li );
+    }
+    else
+    {
+	func( cx, r->proxy );
+    }
+}
+
+/**
+   First pass of pegc_compile(): counts references to each composite
+   rule reachable from r.
+*/
+static void pegc_vm_count( pegc_vm_compiler * cx, PegcRule const * r )
+{
+    if( PegcKind_Composite != pegc_vm_kind( r ) ) return;
+    pegc_vm_node * n = pegc_vm_node_get( cx, r, true );
+    if( ! n ) return;
+    if( n->refs++ ) return;
+    pegc_vm_each_child( cx, r, pegc_vm_count );
+}
+
+static void pegc_vm_compile_rule( pegc_vm_compiler * cx, PegcRule const * r );
+
+/**
+   Emits code for r in the given STAR (isPlus==false) or PLUS
+   (isPlus==true) form. Expects a MARK to be on the stack, and leaves
+   it there.
+*/
+static void pegc_vm_compile_loop( pegc_vm_compiler * cx, PegcRule const * r, bool isPlus )
+{
+    size_t t = 0;
+    if( isPlus )
+    {
+	pegc_vm_compile_rule( cx, r );
+	t = pegc_vm_emit( cx, PegcOp_IfNoProgress, 0, 0, 0 );
+    }
+    size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+    size_t const top = cx->prog->count;
+    pegc_vm_compile_rule( cx, r );
+    pegc_vm_emit( cx, PegcOp_PartialCommit, (int)top, 0, 0 );
+    pegc_vm_patch( cx, c );
+    if( isPlus ) pegc_vm_patch( cx, t );
+}
+
+/**
+   Emits the code for the body of the composite rule r.
+*/
+static void pegc_vm_compile_body( pegc_vm_compiler * cx, PegcRule const * r )
+{
+    PegcRule_mf const f = r->rule;
+    if( f == PegcRule_mf_ref )
+    { /* Transparent, even at EOF. */
+	pegc_vm_compile_rule( cx, r->proxy );
+	return;
+    }
+    pegc_vm_emit( cx, PegcOp_Check, 0, 0, 0 );
+    if( (f == PegcRule_mf_or) || (f == PegcRule_mf_or_v) )
+    {
+	PegcRule const * li = (PegcRule const *)r->data;
+	size_t * commits = 0;
+	size_t n = 0;
+	for( ; li[n].rule; ++n ) {}
+	if( ! n )
+	{ /* PegcRule_mf_or() fails on an empty list. */
+	    pegc_vm_emit( cx, PegcOp_Fail, 0, 0, 0 );
+	    return;
+	}
+	if( n > 1 )
+	{
+	    commits = (size_t *)malloc( n * sizeof(size_t) );
+	    if( ! commits )
+	    {
+		cx->ok = false;
+		return;
+	    }
+	}
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	size_t i = 0;
+	for( ; cx->ok && (i < n); ++i )
+	{
+	    if( i == (n-1) )
+	    {
+		pegc_vm_compile_rule( cx, &li[i] );
+		break;
+	    }
+	    size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	    pegc_vm_compile_rule( cx, &li[i] );
+	    commits[i] = pegc_vm_emit( cx, PegcOp_Commit, 0, 0, 0 );
+	    pegc_vm_patch( cx, c );
+	}
+	for( i = 0; cx->ok && (i < (n-1)); ++i ) pegc_vm_patch( cx, commits[i] );
+	pegc_free( commits );
+	pegc_vm_emit( cx, PegcOp_SetMatch, 0, 0, 0 );
+    }
+    else if( (f == PegcRule_mf_and) || (f == PegcRule_mf_and_v) )
+    {
+	PegcRule const * li = (PegcRule const *)r->data;
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	for( ; cx->ok && li->rule; ++li ) pegc_vm_compile_rule( cx, li );
+	pegc_vm_emit( cx, PegcOp_SetMatch, 0, 0, 0 );
+    }
+    else if( (f == PegcRule_mf_star) || (f == PegcRule_mf_plus) )
+    {
+	bool const isPlus = (f == PegcRule_mf_plus);
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	pegc_vm_compile_loop( cx, r->proxy, isPlus );
+	pegc_vm_emit( cx, PegcOp_SetMatch, isPlus ? 0 : 1, 0, 0 );
+    }
+    else if( f == PegcRule_mf_opt )
+    {
+	size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	size_t const j = pegc_vm_emit( cx, PegcOp_Commit, 0, 0, 0 );
+	pegc_vm_patch( cx, c );
+	pegc_vm_patch( cx, j );
+    }
+    else if( f == PegcRule_mf_at )
+    {
+	size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	size_t const b = pegc_vm_emit( cx, PegcOp_BackCommit, 0, 0, 0 );
+	pegc_vm_patch( cx, c );
+	pegc_vm_emit( cx, PegcOp_Fail, 0, 0, 0 );
+	pegc_vm_patch( cx, b );
+    }
+    else if( f == PegcRule_mf_notat )
+    {
+	size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	pegc_vm_emit( cx, PegcOp_FailTwice, 0, 0, 0 );
+	pegc_vm_patch( cx, c );
+    }
+    else if( f == PegcRule_mf_until )
+    {
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	size_t const top = cx->prog->count;
+	size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	size_t const j = pegc_vm_emit( cx, PegcOp_Commit, 0, 0, 0 );
+	pegc_vm_patch( cx, c );
+	pegc_vm_emit( cx, PegcOp_Bump, 0, 0, 0 );
+	pegc_vm_emit( cx, PegcOp_Jmp, (int)top, 0, 0 );
+	pegc_vm_patch( cx, j );
+	pegc_vm_emit( cx, PegcOp_SetMatch, 0, 0, 0 );
+    }
+    else if( f == PegcRule_mf_repeat )
+    {
+	pegc_range_info const * info = (pegc_range_info const *)r->data;
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	pegc_vm_emit( cx, PegcOp_RepInit, 0, 0, 0 );
+	size_t const top = cx->prog->count;
+	size_t const c = pegc_vm_emit( cx, PegcOp_Choice, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	pegc_vm_emit( cx, PegcOp_RepStep, (int)top, info->max, 0 );
+	pegc_vm_patch( cx, c );
+	pegc_vm_emit( cx, PegcOp_RepEnd, 0, info->min, 0 );
+	pegc_vm_emit( cx, PegcOp_SetMatch, 0, 0, 0 );
+    }
+    else if( f == PegcRule_mf_action )
+    {
+	if( ! r->data )
+	{ /* PegcRule_mf_action() fails if it has no action. */
+	    pegc_vm_emit( cx, PegcOp_Fail, 0, 0, 0 );
+	    return;
+	}
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	pegc_vm_emit( cx, PegcOp_ActionI, 0, 0, r->data );
+    }
+    else if( f == PegcRule_mf_action_d )
+    {
+	PegcAction const * act = (PegcAction const *)r->data;
+	if( ! act )
+	{
+	    pegc_vm_emit( cx, PegcOp_Fail, 0, 0, 0 );
+	    return;
+	}
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	pegc_vm_compile_rule( cx, r->proxy );
+	pegc_vm_emit( cx, PegcOp_ActionD, 0, 0, act );
+    }
+}
+
+/**
+   Emits the code for a terminal rule.
+*/
+static void pegc_vm_compile_terminal( pegc_vm_compiler * cx, PegcRule const * r )
+{
+    PegcRule_mf const f = r->rule;
+    unsigned char bits[32];
+    size_t at = (size_t)-1;
+    if( (f == PegcRule_mf_string) || (f == PegcRule_mf_stringi) )
+    {
+	char const * s = (char const *)r->data;
+	at = pegc_vm_emit( cx, (f == PegcRule_mf_string) ? PegcOp_String : PegcOp_StringI,
+			   0, pegc_strlen(s), s );
+    }
+    else if( f == PegcRule_mf_char )
+    {
+	unsigned char const c = *((unsigned char const *)r->data);
+	at = pegc_vm_emit( cx, PegcOp_Char, c, 0, 0 );
+    }
+    else if( f == PegcRule_mf_eof )
+    {
+	at = pegc_vm_emit( cx, PegcOp_Eof, 0, 0, 0 );
+    }
+    else if( f == PegcRule_mf_success )
+    {
+	/* no-op */
+    }
+    else if( f == PegcRule_mf_failure )
+    {
+	pegc_vm_emit( cx, PegcOp_Fail, 0, 0, 0 );
+    }
+    else if( (f == PegcRule_mf_blanks) || (f == PegcRule_mf_digits) )
+    {
+	bool const isPlus = (f == PegcRule_mf_digits);
+	pegc_vm_emit( cx, PegcOp_Check, 0, 0, 0 );
+	pegc_vm_emit( cx, PegcOp_Mark, 0, 0, 0 );
+	pegc_vm_compile_loop( cx, isPlus ? &PegcRule_digit : &PegcRule_blank, isPlus );
+	pegc_vm_emit( cx, PegcOp_SetMatch, isPlus ? 0 : 1, 0, 0 );
+    }
+    else if( pegc_rule_charset( r, bits ) )
+    {
+	at = pegc_vm_emit( cx, PegcOp_Set, pegc_vm_add_set( cx, bits ), 0, 0 );
+    }
+    else
+    {
+	pegc_vm_emit( cx, PegcOp_Rule, 0, 0, r );
+	return;
+    }
+    /* For pegc_fail_note() */
+    if( cx->ok && (at != (size_t)-1) ) cx->prog->code[at].rule = r;
+}
+
+/**
+   Emits the code for r. Shared composite rules are emitted as a CALL
+   to a subroutine, which is queued for compilation if needed.
+*/
+static void pegc_vm_compile_rule( pegc_vm_compiler * cx, PegcRule const * r )
+{
+    if( ! cx->ok ) return;
+    switch( pegc_vm_kind( r ) )
+    {
+      case PegcKind_Terminal:
+	  pegc_vm_compile_terminal( cx, r );
+	  return;
+      case PegcKind_Composite:
+	  break;
+      default:
+	  pegc_vm_emit( cx, PegcOp_Rule, 0, 0, r );
+	  return;
+    }
+    pegc_vm_node * n = pegc_vm_node_get( cx, r, false );
+    if( ! n || (n->refs < 2) )
+    {
+	pegc_vm_compile_body( cx, r );
+	return;
+    }
+    /* The jump target is not known yet, so we store the node's index
+       in arg2 and fix it up at the end. */
+    pegc_vm_emit( cx, PegcOp_Call, 0, (size_t)(n - cx->nodes), 0 );
+    if( n->queued ) return;
+    if( cx->pending_count == cx->pending_capacity )
+    {
+	size_t const newCap = cx->pending_capacity ? (cx->pending_capacity * 2) : 16;
+	size_t * li = (size_t *)realloc( cx->pending, newCap * sizeof(size_t) );
+	if( ! li )
+	{
+	    cx->ok = false;
+	    return;
+	}
+	cx->pending = li;
+	cx->pending_capacity = newCap;
+    }
+    n->queued = true;
+    cx->pending[cx->pending_count++] = (size_t)(n - cx->nodes);
+}
+
+pegc_program * pegc_compile( pegc_parser * st, PegcRule const * r )
+{
+    if( ! st || ! pegc_is_rule_valid(r) ) return 0;
+    pegc_program * prog = (pegc_program *)calloc( 1, sizeof(pegc_program) );
+    if( ! prog ) return 0;
+    st->stats.alloced += sizeof(pegc_program);
+    pegc_vm_compiler cx;
+    memset( &cx, 0, sizeof(cx) );
+    cx.st = st;
+    cx.prog = prog;
+    cx.ok = true;
+    pegc_vm_count( &cx, r );
+    pegc_vm_emit( &cx, PegcOp_Mark, 0, 0, 0 );
+    pegc_vm_compile_rule( &cx, r );
+    pegc_vm_emit( &cx, PegcOp_SetMatch, 0, 0, 0 );
+    pegc_vm_emit( &cx, PegcOp_End, 0, 0, 0 );
+    size_t i = 0;
+    for( ; cx.ok && (i < cx.pending_count); ++i )
+    {
+	pegc_vm_node * n = &cx.nodes[cx.pending[i]];
+	n->addr = prog->count;
+	pegc_vm_compile_body( &cx, n->rule );
+	pegc_vm_emit( &cx, PegcOp_Ret, 0, 0, 0 );
+    }
+    for( i = 0; cx.ok && (i < prog->count); ++i )
+    {
+	pegc_vm_insn * in = &prog->code[i];
+	if( PegcOp_Call != in->op ) continue;
+	in->arg = (int)cx.nodes[in->arg2].addr;
+	in->arg2 = 0;
+    }
+    pegc_free( cx.nodes );
+    pegc_free( cx.pending );
+    if( ! cx.ok )
+    {
+	pegc_free_program( prog );
+	return 0;
+    }
+    pegc_gc_add( st, prog, pegc_free_program );
+    return prog;
+}
+
+/**
+   Makes room for at least one more entry in st->vm, which currently
+   has sp entries in use. Fails, and sets st's error state, if the
+   stack would exceed st's depth limit or on allocation error.
+*/
+static bool pegc_vm_grow( pegc_parser * st, size_t sp )
+{
+    if( st->depth_limit && (sp >= st->depth_limit) )
+    {
+	pegc_set_error_e( st, "Parse depth limit (%lu) exceeded at input offset %lu.",
+			  (unsigned long)st->depth_limit,
+			  (unsigned long)(st->cursor.pos - st->cursor.begin) );
+	return false;
+    }
+    if( sp < st->vm.capacity ) return true;
+    size_t newCap = st->vm.capacity ? (st->vm.capacity * 2) : 64;
+    if( st->depth_limit && (newCap > st->depth_limit) ) newCap = st->depth_limit;
+    pegc_vm_frame * li = (pegc_vm_frame *)realloc( st->vm.list, newCap * sizeof(pegc_vm_frame) );
+    if( ! li )
+    {
+	pegc_set_error_e( st, "pegc_parse_program(): out of memory for %u stack entries",
+			  (unsigned int)newCap );
+	return false;
+    }
+    st->stats.alloced += (newCap - st->vm.capacity) * sizeof(pegc_vm_frame);
+    st->vm.list = li;
+    st->vm.capacity = newCap;
+    return true;
+}
+
+/**
+   Runs prog against st, starting at the current position. On failure
+   the position is not restored: that is the caller's job.
+
+   The VM's entries are pushed onto st->vm above any entries in use
+   by an outer program, and popped before returning.
+*/
+static bool pegc_vm_exec( pegc_parser * st, pegc_program const * prog )
+{
+    pegc_vm_insn const * const code = prog->code;
+    size_t const base = st->vm.count;
+    pegc_vm_frame * stack = st->vm.list;
+    size_t sp = base;
+    size_t pc = 0;
+    bool rc = false;
+#define VM_PUSH(KIND,PC) \
+    if( (sp >= st->vm.capacity) || (st->depth_limit && (sp >= st->depth_limit)) ) { \
+	if( ! pegc_vm_grow( st, sp ) ) goto done; \
+	stack = st->vm.list; \
+    } \
+    stack[sp].kind = (KIND); stack[sp].pc = (PC); \
+    stack[sp].pos = st->cursor.pos; stack[sp].count = 0; ++sp
+    for( ;; )
+    {
+	pegc_vm_insn const * in = &code[pc];
+	switch( in->op )
+	{
+	  case PegcOp_End:
+	      rc = true;
+	      goto done;
+	  case PegcOp_Fail:
+	      goto fail;
+	  case PegcOp_Check:
+	      if( ! pegc_isgood(st) ) goto fail;
+	      ++pc;
+	      continue;
+	  case PegcOp_Char:
+	      if( ! pegc_isgood(st)
+		  || (in->arg != (unsigned char)*st->cursor.pos) ) goto fail_terminal;
+	      ++st->cursor.pos;
+	      ++pc;
+	      continue;
+	  case PegcOp_Set: {
+	      if( ! pegc_isgood(st) ) goto fail_terminal;
+	      unsigned char const c = (unsigned char)*st->cursor.pos;
+	      if( ! (prog->sets[in->arg].bits[c >> 3] & (1 << (c & 7))) ) goto fail_terminal;
+	      ++st->cursor.pos;
+	      ++pc;
+	      continue;
+	  }
+	  case PegcOp_String:
+	  case PegcOp_StringI: {
+	      if( ! pegc_isgood(st) ) goto fail_terminal;
+	      if( (size_t)(st->cursor.end - st->cursor.pos) < in->arg2 )
+	      {
+		  pegc_touch( st, st->cursor.end );
+		  goto fail_terminal;
+	      }
+	      if( in->arg2 ) pegc_touch( st, st->cursor.pos + in->arg2 - 1 );
+	      char const * s = (char const *)in->ptr;
+	      pegc_const_iterator p = st->cursor.pos;
+	      size_t i = 0;
+	      if( PegcOp_String == in->op )
+	      {
+		  if( 0 != memcmp( p, s, in->arg2 ) ) goto fail_terminal;
+	      }
+	      else for( ; i < in->arg2; ++i )
+	      {
+		  if( tolower((unsigned char)p[i]) != tolower((unsigned char)s[i]) ) goto fail_terminal;
+	      }
+	      st->cursor.pos += in->arg2;
+	      ++pc;
+	      continue;
+	  }
+	  case PegcOp_Eof:
+	      if( ! pegc_eof(st) ) goto fail_terminal;
+	      ++pc;
+	      continue;
+	  case PegcOp_Bump:
+	      if( ! pegc_bump(st) ) goto fail;
+	      ++pc;
+	      continue;
+	  case PegcOp_Rule: {
+	      st->vm.count = sp;
+	      bool const b = pegc_rule_call( (PegcRule const *)in->ptr, st );
+	      stack = st->vm.list; /* might have been re-allocated */
+	      if( ! b ) goto fail;
+	      ++pc;
+	      continue;
+	  }
+	  case PegcOp_Jmp:
+	      pc = in->arg;
+	      continue;
+	  case PegcOp_Choice:
+	      VM_PUSH(PegcFrame_Choice,(size_t)in->arg);
+	      stack[sp-1].count = st->actions.count;
+	      ++pc;
+	      continue;
+	  case PegcOp_Commit:
+	      --sp;
+	      pc = in->arg;
+	      continue;
+	  case PegcOp_PartialCommit:
+	      if( stack[sp-1].pos == st->cursor.pos )
+	      { /* avoid endless loops on non-consuming rules */
+		  --sp;
+		  ++pc;
+	      }
+	      else
+	      {
+		  stack[sp-1].pos = st->cursor.pos;
+		  stack[sp-1].count = st->actions.count;
+		  pc = in->arg;
+	      }
+	      continue;
+	  case PegcOp_BackCommit:
+	      /* Lookahead consumes nothing, so its actions are not kept. */
+	      --sp;
+	      st->cursor.pos = stack[sp].pos;
+	      pegc_truncate_actions( st, stack[sp].count );
+	      pc = in->arg;
+	      continue;
+	  case PegcOp_FailTwice:
+	      --sp;
+	      goto fail;
+	  case PegcOp_Call:
+	      VM_PUSH(PegcFrame_Call,pc+1);
+	      pc = in->arg;
+	      continue;
+	  case PegcOp_Ret:
+	      pc = stack[--sp].pc;
+	      continue;
+	  case PegcOp_Mark:
+	  case PegcOp_RepInit:
+	      VM_PUSH((PegcOp_Mark == in->op) ? PegcFrame_Mark : PegcFrame_Count,0);
+	      ++pc;
+	      continue;
+	  case PegcOp_SetMatch: {
+	      pegc_const_iterator const b = stack[--sp].pos;
+	      if( (!in->arg || (b != st->cursor.pos)) && pegc_in_bounds( st, b ) )
+	      {
+		  pegc_set_match( st, b, st->cursor.pos, false );
+	      }
+	      ++pc;
+	      continue;
+	  }
+	  case PegcOp_IfNoProgress:
+	      pc = (stack[sp-1].pos == st->cursor.pos) ? (size_t)in->arg : (pc+1);
+	      continue;
+	  case PegcOp_RepStep: {
+	      --sp; /* the CHOICE */
+	      pegc_vm_frame * const f = &stack[sp-1];
+	      if( (++f->count == in->arg2)
+		  || pegc_eof(st)
+		  || (f->pos == st->cursor.pos) )
+	      {
+		  ++pc;
+	      }
+	      else
+	      {
+		  pc = in->arg;
+	      }
+	      continue;
+	  }
+	  case PegcOp_RepEnd:
+	      if( (stack[--sp].count < in->arg2) || pegc_has_error(st) ) goto fail;
+	      ++pc;
+	      continue;
+	  case PegcOp_ActionI: {
+	      pegc_action_info const * act = (pegc_action_info const *)in->ptr;
+	      st->match.pos = st->match.begin = stack[--sp].pos;
+	      st->match.end = st->cursor.pos;
+	      st->vm.count = sp;
+	      bool const b = act->action( st, &st->match, act->data );
+	      stack = st->vm.list;
+	      if( ! b ) goto fail;
+	      ++pc;
+	      continue;
+	  }
+	  case PegcOp_ActionD:
+	      if( ! pegc_queue_action( st, (PegcAction const *)in->ptr,
+				       stack[--sp].pos, st->cursor.pos ) ) goto fail;
+	      ++pc;
+	      continue;
+	  default:
+	      pegc_set_error_e( st, "pegc_parse_program(): invalid opcode %d at %u",
+				in->op, (unsigned int)pc );
+	      goto done;
+	}
+      fail_terminal:
+	pegc_fail_note( st, in->rule, st->cursor.pos );
+      fail:
+	while( (sp > base) && (PegcFrame_Choice != stack[sp-1].kind) ) --sp;
+	if( sp == base ) break;
+	--sp;
+	st->cursor.pos = stack[sp].pos;
+	pegc_truncate_actions( st, stack[sp].count );
+	pc = stack[sp].pc;
+    }
+  done:
+#undef VM_PUSH
+    st->vm.count = base;
+    return rc;
+}
+
+bool pegc_set_depth_limit( pegc_parser * st, size_t limit )
+{
+    if( ! st ) return false;
+    st->depth_limit = limit;
+    return true;
+}
+
+size_t pegc_get_depth_limit( pegc_parser const * st )
+{
+    return st ? st->depth_limit : 0;
+}
+
+bool pegc_parse_program( pegc_parser * st, pegc_program const * prog )
+{
+    if( ! st || ! prog || ! prog->count ) return false;
+    pegc_const_iterator const orig = pegc_pos(st);
+    size_t const mark = st->actions.count;
+    bool const rc = pegc_vm_exec( st, prog );
+    if( ! rc )
+    {
+	st->cursor.pos = orig;
+	pegc_truncate_actions( st, mark );
+    }
+    return rc;
+}
+
+static bool PegcRule_mf_program( PegcRule const * self, pegc_parser * st )
+{
+    if( pegc_has_error(st) ) return false;
+    return pegc_parse_program( st, (pegc_program const *)self->data );
+}
+
+PegcRule pegc_r_program( pegc_program const * prog )
+{
+    return prog
+	? pegc_r( PegcRule_mf_program, prog )
+	: PegcRule_invalid;
+}
+
+/************************************************************************
+FIRST sets and first-character dispatch for ordered choice. See
+pegc_r_or_dispatch().
+************************************************************************/
+
+/**
+   Data for PegcRule_mf_or_dispatch().
+*/
+struct pegc_or_dispatch
+{
+    /** The alternatives, terminated by an invalid rule. */
+    PegcRule const * list;
+    /** True once the table below is built. */
+    bool ready;
+    /** Next entry in pegc_parser::dispatch. */
+    struct pegc_or_dispatch * next;
+    /**
+       The candidate alternatives for the byte c are
+       cand[offsets[c]] through cand[offsets[c+1]-1], as indexes into
+       list, in list order.
+    */
+    size_t offsets[257];
+    unsigned int * cand;
+};
+typedef struct pegc_or_dispatch pegc_or_dispatch;
+
+static bool PegcRule_mf_or_dispatch( PegcRule const * self, pegc_parser * st );
+
+/**
+   The FIRST set of a rule: the set of bytes which the rule might
+   consume first when it matches, and whether it might match without
+   consuming anything (in which case any byte might follow).
+*/
+struct pegc_first
+{
+    unsigned char bits[32];
+    bool nullable;
+};
+typedef struct pegc_first pegc_first;
+
+/** Max nesting depth of pegc_first_of(). */
+#define PEGC_FIRST_MAX_DEPTH 64
+
+/**
+   Internal state for pegc_first_of(): the rules currently being
+   analyzed, used for detecting cycles.
+*/
+struct pegc_first_cx
+{
+    PegcRule const * stack[PEGC_FIRST_MAX_DEPTH];
+    size_t depth;
+};
+typedef struct pegc_first_cx pegc_first_cx;
+
+static void pegc_first_all( pegc_first * f )
+{
+    memset( f->bits, 0xff, 32 );
+    f->nullable = true;
+}
+
+static void pegc_first_add( pegc_first * f, int ch )
+{
+    unsigned char const c = (unsigned char)ch;
+    f->bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static void pegc_first_union( pegc_first * f, pegc_first const * o )
+{
+    int i = 0;
+    for( ; i < 32; ++i ) f->bits[i] |= o->bits[i];
+}
+
+/**
+   Adds the FIRST set of r to f. Rules which we know nothing about
+   (e.g. client-defined rules) are assumed to possibly match anything,
+   as are cycles.
+*/
+static void pegc_first_of( pegc_first_cx * cx, PegcRule const * r, pegc_first * f )
+{
+    memset( f, 0, sizeof(pegc_first) );
+    PegcRule_mf const fn = r->rule;
+    if( ! fn ) return;
+    size_t i = 0;
+    for( ; i < cx->depth; ++i )
+    {
+	if( cx->stack[i] == r ) break;
+    }
+    if( (i < cx->depth) || (cx->depth == PEGC_FIRST_MAX_DEPTH) )
+    {
+	pegc_first_all( f );
+	return;
+    }
+    cx->stack[cx->depth++] = r;
+    pegc_first sub;
+    if( (fn == PegcRule_mf_char) || (fn == PegcRule_mf_string)
+	|| (fn == PegcRule_mf_chari) || (fn == PegcRule_mf_stringi) )
+    {
+	char const * s = (char const *)r->data;
+	bool const isString = (fn == PegcRule_mf_string) || (fn == PegcRule_mf_stringi);
+	if( ! s || (isString && ! *s) )
+	{
+	    if( isString ) pegc_first_all( f );
+	}
+	else if( (fn == PegcRule_mf_char) || (fn == PegcRule_mf_string) )
+	{
+	    pegc_first_add( f, *s );
+	}
+	else
+	{
+	    pegc_first_add( f, tolower((unsigned char)*s) );
+	    pegc_first_add( f, toupper((unsigned char)*s) );
+	}
+    }
+    else if( pegc_rule_charset( r, f->bits ) )
+    {
+    }
+    else if( (fn == PegcRule_mf_failure) )
+    {
+    }
+    else if( (fn == PegcRule_mf_success) || (fn == PegcRule_mf_eof) )
+    {
+	f->nullable = true;
+    }
+    else if( fn == PegcRule_mf_blanks )
+    {
+	pegc_first_add( f, ' ' );
+	pegc_first_add( f, '\t' );
+	f->nullable = true;
+    }
+    else if( fn == PegcRule_mf_digits )
+    {
+	int c = '0';
+	for( ; c <= '9'; ++c ) pegc_first_add( f, c );
+    }
+    else if( ((fn == PegcRule_mf_or) || (fn == PegcRule_mf_or_v)
+	      || (fn == PegcRule_mf_and) || (fn == PegcRule_mf_and_v)
+	      || (fn == PegcRule_mf_or_dispatch))
+	     && r->data )
+    {
+	bool const isAnd = (fn == PegcRule_mf_and) || (fn == PegcRule_mf_and_v);
+	PegcRule const * li = (fn == PegcRule_mf_or_dispatch)
+	    ? ((pegc_or_dispatch const *)r->data)->list
+	    : (PegcRule const *)r->data;
+	f->nullable = isAnd;
+	for( ; li->rule; ++li )
+	{
+	    pegc_first_of( cx, li, &sub );
+	    pegc_first_union( f, &sub );
+	    if( isAnd )
+	    {
+		if( ! sub.nullable )
+		{
+		    f->nullable = false;
+		    break;
+		}
+	    }
+	    else if( sub.nullable )
+	    {
+		f->nullable = true;
+	    }
+	}
+    }
+    else if( r->proxy
+	     && ((fn == PegcRule_mf_star) || (fn == PegcRule_mf_opt)
+		 || (fn == PegcRule_mf_plus) || (fn == PegcRule_mf_at)
+		 || (fn == PegcRule_mf_repeat) || (fn == PegcRule_mf_action)
+		 || (fn == PegcRule_mf_action_d) || (fn == PegcRule_mf_leftrec)
+		 || ((fn == PegcRule_mf_ref) && r->proxy->rule)) )
+    {
+	pegc_first_of( cx, r->proxy, f );
+	if( (fn == PegcRule_mf_star) || (fn == PegcRule_mf_opt) || (fn == PegcRule_mf_at) )
+	{ /* at() does not consume, so whatever follows it also sees
+	     the current byte. */
+	    f->nullable = true;
+	}
+	else if( (fn == PegcRule_mf_repeat) && r->data
+		 && (0 == ((pegc_range_info const *)r->data)->min) )
+	{
+	    f->nullable = true;
+	}
+    }
+    else
+    {
+	pegc_first_all( f );
+    }
+    --cx->depth;
+}
+
+static void pegc_free_or_dispatch( void * p )
+{
+    pegc_or_dispatch * d = (pegc_or_dispatch *)p;
+    if( ! d ) return;
+    pegc_free( d->cand );
+    pegc_free( d );
+}
+
+/**
+   Builds d's dispatch table. Returns false on allocation error.
+*/
+static bool pegc_or_dispatch_build( pegc_parser * st, pegc_or_dispatch * d )
+{
+    size_t n = 0;
+    for( ; d->list[n].rule; ++n ) {}
+    pegc_first * firsts = (pegc_first *)malloc( (n ? n : 1) * sizeof(pegc_first) );
+    if( ! firsts ) return false;
+    pegc_first_cx cx;
+    cx.depth = 0;
+    size_t i = 0;
+    size_t total = 0;
+    for( ; i < n; ++i )
+    {
+	pegc_first_of( &cx, &d->list[i], &firsts[i] );
+	if( firsts[i].nullable ) memset( firsts[i].bits, 0xff, 32 );
+	int b = 0;
+	for( ; b < 32; ++b )
+	{
+	    unsigned char x = firsts[i].bits[b];
+	    for( ; x; x &= (unsigned char)(x - 1) ) ++total;
+	}
+    }
+    d->cand = (unsigned int *)malloc( (total ? total : 1) * sizeof(unsigned int) );
+    if( ! d->cand )
+    {
+	pegc_free( firsts );
+	return false;
+    }
+    st->stats.alloced += total * sizeof(unsigned int);
+    size_t at = 0;
+    int c = 0;
+    for( ; c < 256; ++c )
+    {
+	d->offsets[c] = at;
+	for( i = 0; i < n; ++i )
+	{
+	    if( firsts[i].bits[c >> 3] & (1 << (c & 7)) ) d->cand[at++] = (unsigned int)i;
+	}
+    }
+    d->offsets[256] = at;
+    pegc_free( firsts );
+    d->ready = true;
+    return true;
+}
+
+static bool PegcRule_mf_or_dispatch( PegcRule const * self, pegc_parser * st )
+{
+    if( ! pegc_rule_check( self, st, true, false, true ) ) return false;
+    pegc_or_dispatch * d = (pegc_or_dispatch *)self->data;
+    if( ! d->ready && ! pegc_or_dispatch_build( st, d ) )
+    {
+	pegc_set_error_e( st, "Out of memory for dispatch table." );
+	return false;
+    }
+    pegc_const_iterator orig = pegc_pos(st);
+    unsigned char const c = (unsigned char)*orig;
+    size_t i = d->offsets[c];
+    size_t const e = d->offsets[c + 1];
+    for( ; i < e; ++i )
+    {
+	if( pegc_rule_call( &d->list[d->cand[i]], st ) )
+	{
+	    pegc_set_match( st, orig, pegc_pos(st), true );
+	    return true;
+	}
+    }
+    pegc_set_pos( st, orig );
+    return false;
+}
+
+PegcRule pegc_r_or_dispatch( pegc_parser * st, PegcRule const * li )
+{
+    if( ! st || ! li || ! li->rule ) return PegcRule_invalid;
+    pegc_or_dispatch * d = (pegc_or_dispatch *)calloc( 1, sizeof(pegc_or_dispatch) );
+    if( ! d ) return PegcRule_invalid;
+    st->stats.alloced += sizeof(pegc_or_dispatch);
+    pegc_gc_add( st, d, pegc_free_or_dispatch );
+    d->list = li;
+    d->next = st->dispatch;
+    st->dispatch = d;
+    PegcRule r = pegc_r( PegcRule_mf_or_dispatch, d );
+    r.name = "OrDispatch";
+    return r;
+}
+
+/************************************************************************
+Fast scanning of runs of single-byte rules, used by star, plus, and
+repeat when their proxy matches exactly one byte from a fixed set
+(PegcRule_blank, PegcRule_digit, notchar, charclass rules, etc.).
+
+On x86-64 GCC/Clang builds the scan uses SSE2 or (if the CPU
+supports it) AVX2 kernels, which test 16 or 32 bytes at a time
+against up to PEGC_SPAN_MAX_RANGES byte ranges. Define PEGC_NO_SIMD
+to use only the portable code.
+************************************************************************/
+#if !defined(PEGC_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define PEGC_SPAN_SIMD 1
+#  include <immintrin.h>
+#else
+#  define PEGC_SPAN_SIMD 0
+#endif
+
+/**
+   Returns true if ss contains the byte c.
+*/
+static bool pegc_span_has( pegc_span_set const * ss, unsigned char c )
+{
+    return 0 != (ss->bits[c >> 3] & (1 << (c & 7)));
+}
+
+/**
+   Portable implementation of pegc_span().
+*/
+static size_t pegc_span_scalar( pegc_span_set const * ss, unsigned char const * p, size_t n )
+{
+    size_t i = 0;
+    for( ; (i < n) && pegc_span_has( ss, p[i] ); ++i ) {}
+    return i;
+}
+
+#if PEGC_SPAN_SIMD
+/**
+   SSE2 implementation of pegc_span().
+*/
+static size_t pegc_span_sse2( pegc_span_set const * ss, unsigned char const * p, size_t n )
+{
+    __m128i lo[PEGC_SPAN_MAX_RANGES];
+    __m128i lim[PEGC_SPAN_MAX_RANGES];
+    __m128i const bias = _mm_set1_epi8( (char)0x80 );
+    int const nr = ss->nranges;
+    int r = 0;
+    for( ; r < nr; ++r )
+    {
+	lo[r] = _mm_set1_epi8( (char)ss->lo[r] );
+	lim[r] = _mm_set1_epi8( (char)((ss->hi[r] - ss->lo[r]) ^ 0x80) );
+    }
+    size_t i = 0;
+    for( ; (i + 16) <= n; i += 16 )
+    {
+	__m128i const x = _mm_loadu_si128( (__m128i const *)(p + i) );
+	/* Bytes outside all ranges. (x-lo) > (hi-lo), unsigned, is
+	   done as a signed compare by flipping the high bits. */
+	__m128i out = _mm_set1_epi8( (char)0xff );
+	for( r = 0; r < nr; ++r )
+	{
+	    __m128i const d = _mm_xor_si128( _mm_sub_epi8( x, lo[r] ), bias );
+	    out = _mm_and_si128( out, _mm_cmpgt_epi8( d, lim[r] ) );
+	}
+	unsigned int const stop = ss->negated
+	    ? (unsigned int)(0xffff & ~_mm_movemask_epi8( out ))
+	    : (unsigned int)_mm_movemask_epi8( out );
+	if( stop ) return i + __builtin_ctz( stop );
+    }
+    return i + pegc_span_scalar( ss, p + i, n - i );
+}
+
+/**
+   AVX2 implementation of pegc_span().
+*/
+__attribute__((target("avx2")))
+static size_t pegc_span_avx2( pegc_span_set const * ss, unsigned char const * p, size_t n )
+{
+    __m256i lo[PEGC_SPAN_MAX_RANGES];
+    __m256i lim[PEGC_SPAN_MAX_RANGES];
+    __m256i const bias = _mm256_set1_epi8( (char)0x80 );
+    int const nr = ss->nranges;
+    int r = 0;
+    for( ; r < nr; ++r )
+    {
+	lo[r] = _mm256_set1_epi8( (char)ss->lo[r] );
+	lim[r] = _mm256_set1_epi8( (char)((ss->hi[r] - ss->lo[r]) ^ 0x80) );
+    }
+    size_t i = 0;
+    for( ; (i + 32) <= n; i += 32 )
+    {
+	__m256i const x = _mm256_loadu_si256( (__m256i const *)(p + i) );
+	__m256i out = _mm256_set1_epi8( (char)0xff );
+	for( r = 0; r < nr; ++r )
+	{
+	    __m256i const d = _mm256_xor_si256( _mm256_sub_epi8( x, lo[r] ), bias );
+	    out = _mm256_and_si256( out, _mm256_cmpgt_epi8( d, lim[r] ) );
+	}
+	unsigned int const m = (unsigned int)_mm256_movemask_epi8( out );
+	unsigned int const stop = ss->negated ? ~m : m;
+	if( stop ) return i + __builtin_ctz( stop );
+    }
+    return i + pegc_span_scalar( ss, p + i, n - i );
+}
+
+typedef size_t (*pegc_span_f)( pegc_span_set const * ss, unsigned char const * p, size_t n );
+
+/**
+   Returns the best available SIMD kernel for this CPU.
+*/
+static pegc_span_f pegc_span_kernel()
+{
+    static pegc_span_f f = 0;
+    if( ! f )
+    {
+	__builtin_cpu_init();
+	f = __builtin_cpu_supports("avx2") ? pegc_span_avx2 : pegc_span_sse2;
+    }
+    return f;
+}
+#endif /* PEGC_SPAN_SIMD */
+
+/**
+   Returns the number of bytes at the start of [p,p+n) which are in
+   ss.
+*/
+static size_t pegc_span( pegc_span_set const * ss, pegc_const_iterator p, size_t n )
+{
+    unsigned char const * u = (unsigned char const *)p;
+    if( ss->single )
+    {
+	pegc_const_iterator const x = (pegc_const_iterator)memchr( p, ss->stop, n );
+	return x ? (size_t)(x - p) : n;
+    }
+    /* Most runs are short, so check those without setting up the
+       vector registers. */
+    size_t const head = (n < 16) ? n : 16;
+    size_t i = pegc_span_scalar( ss, u, head );
+    if( (i < head) || (i == n) ) return i;
+#if PEGC_SPAN_SIMD
+    if( ss->nranges > 0 ) return i + pegc_span_kernel()( ss, u + i, n - i );
+#endif
+    return i + pegc_span_scalar( ss, u + i, n - i );
+}
+
+/**
+   Fills in ss's range list from its bitmap: either the ranges of
+   the set itself or, if that takes fewer ranges, of its complement
+   (in which case ss->negated is set). If both need more than
+   PEGC_SPAN_MAX_RANGES ranges, ss->nranges is set to 0 and only the
+   portable code is used. Also sets ss->single.
+*/
+static void pegc_span_ranges( pegc_span_set * ss )
+{
+    int missing = 0;
+    int i = 0;
+    for( ; (i < 256) && (missing < 2); ++i )
+    {
+	if( ! pegc_span_has( ss, (unsigned char)i ) )
+	{
+	    ss->stop = (unsigned char)i;
+	    ++missing;
+	}
+    }
+    ss->single = (1 == missing);
+    int pass = 0;
+    for( ; pass < 2; ++pass )
+    {
+	bool const want = (0 == pass);
+	int nr = 0;
+	int c = 0;
+	while( c < 256 )
+	{
+	    if( pegc_span_has( ss, (unsigned char)c ) != want )
+	    {
+		++c;
+		continue;
+	    }
+	    int const start = c;
+	    while( (c < 256) && (pegc_span_has( ss, (unsigned char)c ) == want) ) ++c;
+	    if( nr == PEGC_SPAN_MAX_RANGES )
+	    {
+		nr = -1;
+		break;
+	    }
+	    ss->lo[nr] = (unsigned char)start;
+	    ss->hi[nr] = (unsigned char)(c - 1);
+	    ++nr;
+	}
+	if( nr >= 0 )
+	{
+	    ss->nranges = nr;
+	    ss->negated = ! want;
+	    return;
+	}
+    }
+    ss->nranges = 0;
+    ss->negated = false;
+}
+
+/**
+   Returns true if r might be a single-byte rule, i.e. one for which
+   pegc_rule_charset() could succeed. This is much cheaper than
+   calling pegc_rule_charset().
+*/
+static bool pegc_span_candidate( PegcRule const * r )
+{
+    PegcRule_mf const f = r->rule;
+    return (f == PegcRule_mf_charclass) || (f == PegcRule_mf_oneof)
+	|| (f == PegcRule_mf_oneofi) || (f == PegcRule_mf_char)
+	|| (f == PegcRule_mf_chari) || (f == PegcRule_mf_notchar)
+	|| (f == PegcRule_mf_notchari) || (f == PegcRule_mf_char_range)
+	|| (f == PegcRule_mf_noteof)
+	|| (f == PegcRule_mf_alnum) || (f == PegcRule_mf_alpha)
+	|| (f == PegcRule_mf_cntrl) || (f == PegcRule_mf_digit)
+	|| (f == PegcRule_mf_graph) || (f == PegcRule_mf_lower)
+	|| (f == PegcRule_mf_print) || (f == PegcRule_mf_punct)
+	|| (f == PegcRule_mf_space) || (f == PegcRule_mf_upper)
+	|| (f == PegcRule_mf_xdigit);
+}
+
+/**
+   Returns the entry for key from st's span cache, or 0 if there is
+   none.
+*/
+static pegc_span_set const * pegc_span_cache_find( pegc_parser * st, pegc_memo_key const * key )
+{
+    pegc_span_cache * sc = &st->spans;
+    if( ! sc->count ) return 0;
+    size_t const mask = sc->capacity - 1;
+    size_t h = pegc_memo_hash( key, 0 ) & mask;
+    for( ; sc->list[h].key.rule; h = (h + 1) & mask )
+    {
+	if( pegc_memo_key_eq( &sc->list[h].key, key ) ) return &sc->list[h];
+    }
+    return 0;
+}
+
+/**
+   Fills in ss's range list and adds a copy of ss to st's span
+   cache. Returns the cached copy, or 0 on allocation error.
+*/
+static pegc_span_set const * pegc_span_cache_add( pegc_parser * st, pegc_span_set * ss )
+{
+    pegc_span_cache * sc = &st->spans;
+    size_t h;
+    pegc_span_ranges( ss );
+    if( (sc->count + 1) * 2 > sc->capacity )
+    {
+	size_t const newCap = sc->capacity ? (sc->capacity * 2) : 16;
+	pegc_span_set * li = (pegc_span_set *)calloc( newCap, sizeof(pegc_span_set) );
+	if( ! li ) return 0;
+	size_t i = 0;
+	for( ; i < sc->capacity; ++i )
+	{
+	    if( ! sc->list[i].key.rule ) continue;
+	    h = pegc_memo_hash( &sc->list[i].key, 0 ) & (newCap - 1);
+	    while( li[h].key.rule ) h = (h + 1) & (newCap - 1);
+	    li[h] = sc->list[i];
+	}
+	st->stats.alloced += (newCap - sc->capacity) * sizeof(pegc_span_set);
+	pegc_free( sc->list );
+	sc->list = li;
+	sc->capacity = newCap;
+    }
+    h = pegc_memo_hash( &ss->key, 0 ) & (sc->capacity - 1);
+    while( sc->list[h].key.rule ) h = (h + 1) & (sc->capacity - 1);
+    sc->list[h] = *ss;
+    ++sc->count;
+    return &sc->list[h];
+}
+
+static pegc_span_set const * pegc_span_set_for( pegc_parser * st, PegcRule const * r )
+{
+    if( ! r || ! pegc_span_candidate( r ) ) return 0;
+    pegc_memo_key const key = pegc_memo_key_of( r );
+    pegc_span_set const * found = pegc_span_cache_find( st, &key );
+    if( found ) return found;
+    pegc_span_set ss;
+    memset( &ss, 0, sizeof(ss) );
+    ss.key = key;
+    if( ! pegc_rule_charset( r, ss.bits ) ) return 0;
+    return pegc_span_cache_add( st, &ss );
+}
+
+static pegc_span_set const * pegc_span_skip_set_for( pegc_parser * st, PegcRule const * r )
+{
+    if( ! r || ! r->proxy ) return 0;
+    pegc_memo_key const key = pegc_memo_key_of( r );
+    pegc_span_set const * found = pegc_span_cache_find( st, &key );
+    if( found ) return found;
+    pegc_first_cx cx;
+    cx.depth = 0;
+    pegc_first f;
+    pegc_first_of( &cx, r->proxy, &f );
+    pegc_span_set ss;
+    memset( &ss, 0, sizeof(ss) );
+    ss.key = key;
+    if( ! f.nullable )
+    {
+	int i = 0;
+	for( ; i < 32; ++i ) ss.bits[i] = (unsigned char)~f.bits[i];
+    }
+    return pegc_span_cache_add( st, &ss );
+}
+
+/************************************************************************
+Grammar optimizer. See pegc_optimize().
+************************************************************************/
+
+/**
+   OR lists with at least this many alternatives are converted to
+   dispatching OR rules by pegc_optimize().
+*/
+#define PEGC_OPT_DISPATCH_MIN 3
+
+/**
+   Maps an original rule (by address) to its optimized copy.
+*/
+struct pegc_opt_map_entry
+{
+    PegcRule const * from;
+    PegcRule * to;
+};
+typedef struct pegc_opt_map_entry pegc_opt_map_entry;
+
+/**
+   Internal state for pegc_optimize().
+*/
+struct pegc_opt
+{
+    pegc_parser * st;
+    pegc_opt_map_entry * map;
+    size_t capacity;
+    size_t count;
+    /** Number of rules removed so far. */
+    size_t removed;
+    bool ok;
+};
+typedef struct pegc_opt pegc_opt;
+
+/**
+   Allocates n zeroed bytes from cx->st's arena (see pegc_alloc()).
+   On error cx->ok is set to false and 0 is returned.
+*/
+static void * pegc_opt_alloc( pegc_opt * cx, size_t n )
+{
+    void * p = cx->ok ? pegc_alloc( cx->st, n ) : 0;
+    if( ! p ) cx->ok = false;
+    return p;
+}
+
+static size_t pegc_opt_hash( void const * p )
+{
+    return (size_t)p / sizeof(void*);
+}
+
+/**
+   Returns the map entry for r, adding an empty one if needed.
+   Returns 0 on allocation error.
+*/
+static pegc_opt_map_entry * pegc_opt_map( pegc_opt * cx, PegcRule const * r )
+{
+    if( (cx->count + 1) * 2 > cx->capacity )
+    {
+	size_t const newCap = cx->capacity ? (cx->capacity * 2) : 64;
+	pegc_opt_map_entry * li = (pegc_opt_map_entry *)calloc( newCap, sizeof(pegc_opt_map_entry) );
+	if( ! li )
+	{
+	    cx->ok = false;
+	    return 0;
+	}
+	size_t i = 0;
+	for( ; i < cx->capacity; ++i )
+	{
+	    if( ! cx->map[i].from ) continue;
+	    size_t h = pegc_opt_hash( cx->map[i].from ) & (newCap - 1);
+	    while( li[h].from ) h = (h + 1) & (newCap - 1);
+	    li[h] = cx->map[i];
+	}
+	pegc_free( cx->map );
+	cx->map = li;
+	cx->capacity = newCap;
+    }
+    size_t const mask = cx->capacity - 1;
+    size_t h = pegc_opt_hash( r ) & mask;
+    for( ; cx->map[h].from; h = (h + 1) & mask )
+    {
+	if( cx->map[h].from == r ) return &cx->map[h];
+    }
+    cx->map[h].from = r;
+    ++cx->count;
+    return &cx->map[h];
+}
+
+/**
+   Returns true if r is known to fail at EOF, like all rules which
+   start with a pegc_rule_check() call. Only such rules may be
+   moved out of a list, because the list itself fails at EOF.
+*/
+static bool pegc_opt_fails_at_eof( PegcRule const * r )
+{
+    return (r->rule == PegcRule_mf_leftrec)
+	|| (r->rule == PegcRule_mf_or_dispatch)
+	|| ((PegcKind_Native != pegc_vm_kind( r ))
+	    && (r->rule != PegcRule_mf_ref)
+	    && (r->rule != PegcRule_mf_eof)
+	    && (r->rule != PegcRule_mf_success));
+}
+
+static bool pegc_opt_is_or( PegcRule const * r )
+{
+    return (r->rule == PegcRule_mf_or) || (r->rule == PegcRule_mf_or_v);
+}
+
+static bool pegc_opt_is_and( PegcRule const * r )
+{
+    return (r->rule == PegcRule_mf_and) || (r->rule == PegcRule_mf_and_v);
+}
+
+static PegcRule pegc_opt_rule( pegc_opt * cx, PegcRule const * r );
+
+/**
+   Returns the optimized copy of the rule r points to. The copy is
+   allocated before r is optimized, so that cycles in the rule graph
+   end up pointing to the copy.
+*/
+static PegcRule const * pegc_opt_ref( pegc_opt * cx, PegcRule const * r )
+{
+    if( ! cx->ok || ! r ) return r;
+    pegc_opt_map_entry * e = pegc_opt_map( cx, r );
+    if( ! e ) return r;
+    if( e->to ) return e->to;
+    PegcRule * to = (PegcRule *)pegc_opt_alloc( cx, sizeof(PegcRule) );
+    if( ! to ) return r;
+    /* Until r is optimized, cycles back to it see a plain copy. */
+    *to = *r;
+    e->to = to;
+    PegcRule const o = pegc_opt_rule( cx, r );
+    *to = o;
+    return to;
+}
+
+/**
+   Returns the literal string matched by r if r is a case-sensitive
+   char or non-empty string rule, else 0. Sets *n to its length.
+*/
+static char const * pegc_opt_literal( PegcRule const * r, size_t * n )
+{
+    if( ! r->data || ! *((char const *)r->data) ) return 0;
+    if( r->rule == PegcRule_mf_char )
+    {
+	*n = 1;
+	return (char const *)r->data;
+    }
+    if( r->rule == PegcRule_mf_string )
+    {
+	*n = pegc_strlen( (char const *)r->data );
+	return (char const *)r->data;
+    }
+    return 0;
+}
+
+/**
+   Merges adjacent literals (for AND lists) or adjacent single-byte
+   rules (for OR lists, into a charclass rule) in li, which has n entries. Returns the new
+   number of entries.
+*/
+static size_t pegc_opt_merge( pegc_opt * cx, bool orOp, PegcRule * li, size_t n )
+{
+    size_t out = 0;
+    size_t i = 0;
+    while( cx->ok && (i < n) )
+    {
+	size_t j = i + 1;
+	if( orOp )
+	{
+	    unsigned char bits[32];
+	    unsigned char more[32];
+	    bool const isSet = pegc_rule_charset( &li[i], bits );
+	    while( isSet && (j < n) && pegc_rule_charset( &li[j], more ) )
+	    {
+		int k = 0;
+		for( ; k < 32; ++k ) bits[k] |= more[k];
+		++j;
+	    }
+	    if( j > i + 1 )
+	    {
+		li[out] = pegc_r_charclass_bits( cx->st, bits );
+		if( ! li[out].rule )
+		{
+		    cx->ok = false;
+		    return n;
+		}
+		li[out].name = "[...]";
+		cx->removed += (j - i - 1);
+		++out;
+		i = j;
+		continue;
+	    }
+	}
+	else
+	{
+	    size_t len = 0;
+	    size_t n1 = 0;
+	    if( pegc_opt_literal( &li[i], &n1 ) )
+	    {
+		len = n1;
+		while( (j < n) && pegc_opt_literal( &li[j], &n1 ) )
+		{
+		    len += n1;
+		    ++j;
+		}
+	    }
+	    if( j > i + 1 )
+	    {
+		char * s = (char *)pegc_opt_alloc( cx, len + 1 );
+		if( ! s ) return n;
+		size_t k = i;
+		size_t at = 0;
+		for( ; k < j; ++k )
+		{
+		    char const * lit = pegc_opt_literal( &li[k], &n1 );
+		    memcpy( s + at, lit, n1 );
+		    at += n1;
+		}
+		li[out] = pegc_r_string( s, true );
+		li[out].name = s;
+		cx->removed += (j - i - 1);
+		++out;
+		i = j;
+		continue;
+	    }
+	}
+	li[out++] = li[i++];
+    }
+    return out;
+}
+
+/**
+   Optimizes an OR or AND list rule.
+*/
+static PegcRule pegc_opt_list( pegc_opt * cx, PegcRule const * r )
+{
+    bool const orOp = pegc_opt_is_or( r );
+    PegcRule const * src = (PegcRule const *)r->data;
+    size_t cap = 0;
+    for( ; src[cap].rule; ++cap ) {}
+    if( ! cap ) return *r;
+    PegcRule * li = (PegcRule *)malloc( (cap + 1) * sizeof(PegcRule) );
+    if( ! li )
+    {
+	cx->ok = false;
+	return *r;
+    }
+    size_t n = 0;
+    size_t i = 0;
+    for( ; cx->ok && src[i].rule; ++i )
+    {
+	PegcRule const it = pegc_opt_rule( cx, &src[i] );
+	PegcRule const * sub = (PegcRule const *)it.data;
+	bool splice = sub && (orOp ? pegc_opt_is_or( &it ) : pegc_opt_is_and( &it ));
+	if( orOp && (it.rule == PegcRule_mf_or_dispatch) )
+	{
+	    sub = ((pegc_or_dispatch const *)it.data)->list;
+	    splice = true;
+	}
+	size_t k = 0;
+	/* The nested list fails at EOF, so its items may only be
+	   spliced into ours if they would fail there as well: all of
+	   them for OR, the first one for AND. */
+	for( ; splice && sub[k].rule; ++k )
+	{
+	    if( ! pegc_opt_fails_at_eof( &sub[k] ) ) splice = false;
+	    if( ! orOp ) break;
+	}
+	if( splice && ! sub[0].rule ) splice = false;
+	size_t const add = splice ? 0 : 1;
+	size_t subCount = 0;
+	if( splice )
+	{
+	    for( ; sub[subCount].rule; ++subCount ) {}
+	}
+	if( n + (splice ? subCount : add) > cap )
+	{
+	    size_t const newCap = (cap * 2) + subCount;
+	    PegcRule * re = (PegcRule *)realloc( li, (newCap + 1) * sizeof(PegcRule) );
+	    if( ! re )
+	    {
+		cx->ok = false;
+		break;
+	    }
+	    li = re;
+	    cap = newCap;
+	}
+	if( splice )
+	{
+	    memcpy( li + n, sub, subCount * sizeof(PegcRule) );
+	    n += subCount;
+	    ++cx->removed;
+	}
+	else
+	{
+	    li[n++] = it;
+	}
+    }
+    if( cx->ok ) n = pegc_opt_merge( cx, orOp, li, n );
+    PegcRule ret = *r;
+    if( ! cx->ok )
+    {
+	pegc_free( li );
+	return ret;
+    }
+    if( (1 == n) && pegc_opt_fails_at_eof( &li[0] ) )
+    {
+	ret = li[0];
+	++cx->removed;
+	pegc_free( li );
+	return ret;
+    }
+    PegcRule * list = (PegcRule *)pegc_opt_alloc( cx, (n + 1) * sizeof(PegcRule) );
+    if( list )
+    {
+	memcpy( list, li, n * sizeof(PegcRule) );
+	list[n] = PegcRule_invalid;
+	ret = pegc_r( orOp ? PegcRule_mf_or_v : PegcRule_mf_and_v, list );
+	if( orOp && (n >= PEGC_OPT_DISPATCH_MIN) )
+	{
+	    ret = pegc_r_or_dispatch( cx->st, list );
+	    if( ! pegc_is_rule_valid( &ret )
+		|| ! pegc_or_dispatch_build( cx->st, (pegc_or_dispatch *)ret.data ) )
+	    {
+		cx->ok = false;
+	    }
+	}
+	ret.name = r->name;
+    }
+    pegc_free( li );
+    return ret;
+}
+
+/**
+   Returns (min,max) for the repetition wrappers (opt, star, plus),
+   with max 0 meaning "unlimited", or false if r is not one of them.
+*/
+static bool pegc_opt_wrapper( PegcRule const * r, int * min, int * max )
+{
+    if( ! r->proxy ) return false;
+    if( r->rule == PegcRule_mf_opt ) { *min = 0; *max = 1; }
+    else if( r->rule == PegcRule_mf_star ) { *min = 0; *max = 0; }
+    else if( r->rule == PegcRule_mf_plus ) { *min = 1; *max = 0; }
+    else return false;
+    return true;
+}
+
+static PegcRule pegc_opt_rule( pegc_opt * cx, PegcRule const * r )
+{
+    if( ! cx->ok || ! r->rule ) return *r;
+    if( (pegc_opt_is_or( r ) || pegc_opt_is_and( r )) && r->data )
+    {
+	return pegc_opt_list( cx, r );
+    }
+    PegcRule_mf const f = r->rule;
+    unsigned char bits[32];
+    if( ((f == PegcRule_mf_oneof) || (f == PegcRule_mf_oneofi)
+	 || (f == PegcRule_mf_chari) || (f == PegcRule_mf_char_range)
+	 || (f == PegcRule_mf_notchar) || (f == PegcRule_mf_notchari))
+	&& pegc_rule_charset( r, bits ) )
+    { /* A bitmap lookup is cheaper than any of these. */
+	PegcRule ret = pegc_r_charclass_bits( cx->st, bits );
+	if( ! ret.rule )
+	{
+	    cx->ok = false;
+	    return *r;
+	}
+	ret.name = r->name;
+	return ret;
+    }
+    if( ! r->proxy
+	|| ! ((f == PegcRule_mf_star) || (f == PegcRule_mf_plus)
+	      || (f == PegcRule_mf_opt) || (f == PegcRule_mf_at)
+	      || (f == PegcRule_mf_notat) || (f == PegcRule_mf_until)
+	      || (f == PegcRule_mf_repeat) || (f == PegcRule_mf_action)
+	      || (f == PegcRule_mf_action_d) || (f == PegcRule_mf_leftrec)) )
+    {
+	return *r;
+    }
+    PegcRule ret = *r;
+    ret.proxy = pegc_opt_ref( cx, r->proxy );
+    if( f == PegcRule_mf_leftrec ) ret.data = ret.proxy;
+    int omin, omax, imin, imax;
+    PegcRule const * in = ret.proxy;
+    if( pegc_opt_wrapper( &ret, &omin, &omax )
+	&& pegc_opt_wrapper( in, &imin, &imax ) )
+    { /* e.g. (X*)? == X*, (X+)* == X* */
+	int const min = (omin && imin) ? 1 : 0;
+	int const max = (omax && imax) ? 1 : 0;
+	ret.rule = min
+	    ? PegcRule_mf_plus
+	    : (max ? PegcRule_mf_opt : PegcRule_mf_star);
+	ret.proxy = in->proxy;
+	ret.name = in->name;
+	++cx->removed;
+    }
+    else if( ((f == PegcRule_mf_at) || (f == PegcRule_mf_notat))
+	     && ((in->rule == PegcRule_mf_at) || (in->rule == PegcRule_mf_notat))
+	     && in->proxy )
+    { /* &&X == &X, !&X == !X, &!X == !X, !!X == &X */
+	ret.rule = ((f == PegcRule_mf_at) == (in->rule == PegcRule_mf_at))
+	    ? PegcRule_mf_at
+	    : PegcRule_mf_notat;
+	ret.proxy = in->proxy;
+	++cx->removed;
+    }
+    return ret;
+}
+
+size_t pegc_optimize( pegc_parser * st, PegcRule * r )
+{
+    if( ! st || ! pegc_is_rule_valid(r) ) return 0;
+    pegc_opt cx;
+    memset( &cx, 0, sizeof(cx) );
+    cx.st = st;
+    cx.ok = true;
+    PegcRule const o = pegc_opt_rule( &cx, r );
+    pegc_free( cx.map );
+    if( ! cx.ok ) return 0;
+    *r = o;
+    return cx.removed;
+}
+
+/************************************************************************
+Shared grammars. See pegc_create_grammar().
+************************************************************************/
+
+pegc_grammar * pegc_create_grammar()
+{
+    pegc_grammar * g = (pegc_grammar *)malloc( sizeof(pegc_grammar) );
+    if( ! g ) return 0;
+    g->builder = pegc_create_parser( 0, 0 );
+    g->frozen = false;
+    if( ! g->builder )
+    {
+	pegc_free( g );
+	return 0;
+    }
+    pegc_set_name( g->builder, "pegc_grammar" );
+    g->builder->stats.alloced += sizeof(pegc_grammar);
+    return g;
+}
+
+pegc_parser * pegc_grammar_builder( pegc_grammar * g )
+{
+    return (g && ! g->frozen) ? g->builder : 0;
+}
+
+bool pegc_grammar_freeze( pegc_grammar * g )
+{
+    if( ! g ) return false;
+    if( g->frozen ) return true;
+    pegc_parser * b = g->builder;
+    if( pegc_has_error(b) ) return false;
+    while( b->dispatch )
+    {
+	pegc_or_dispatch * d = b->dispatch;
+	if( ! d->ready && ! pegc_or_dispatch_build( b, d ) ) return false;
+	b->dispatch = d->next;
+    }
+    /* Set up the lazily-initialized globals now, so that threads
+       which parse concurrently do not race to do so. */
+    pegc_latin1( 0 );
+#if PEGC_SPAN_SIMD
+    pegc_span_kernel();
+#endif
+    g->frozen = true;
+    return true;
+}
+
+pegc_parser * pegc_create_grammar_parser( pegc_grammar const * g, char const * inp, long len )
+{
+    if( ! g || ! g->frozen ) return 0;
+    pegc_parser * st = pegc_create_parser( inp, len );
+    if( st ) st->grammar = g;
+    return st;
+}
+
+pegc_grammar const * pegc_get_grammar( pegc_parser const * st )
+{
+    return st ? st->grammar : 0;
+}
+
+bool pegc_destroy_grammar( pegc_grammar * g )
+{
+    if( ! g ) return false;
+    pegc_destroy_parser( g->builder );
+    pegc_free( g );
+    return true;
+}
+
+/************************************************************************
+Parallel parsing of records. See pegc_parse_parallel().
+************************************************************************/
+
+/**
+   Target number of chunks per worker in pegc_parse_parallel(), so
+   that workers which get easy chunks do not sit idle.
+*/
+#define PEGC_PAR_CHUNKS_PER_THREAD 16
+/** Min and max chunk sizes for pegc_parse_parallel(). */
+#define PEGC_PAR_CHUNK_MIN (16 * 1024)
+#define PEGC_PAR_CHUNK_MAX (8 * 1024 * 1024)
+/**
+   Max number of chunks which workers may parse ahead of the oldest
+   chunk whose actions have not been triggered, per worker. This
+   bounds the memory held by queued actions.
+*/
+#define PEGC_PAR_AHEAD 4
+
+/**
+   One chunk of pegc_parse_parallel()'s input.
+*/
+struct pegc_par_chunk
+{
+    pegc_const_iterator begin;
+    pegc_const_iterator end;
+    /** The chunk's parser, holding its queued actions. */
+    pegc_parser * st;
+    bool done;
+    bool ok;
+};
+typedef struct pegc_par_chunk pegc_par_chunk;
+
+/**
+   Shared state for pegc_parse_parallel().
+*/
+struct pegc_par
+{
+    pegc_parser * st;
+    PegcRule const * item;
+    pegc_par_chunk * chunks;
+    size_t count;
+    /** Index of the next chunk for a worker to take. */
+    size_t next;
+    /** Index of the oldest chunk whose actions are not yet run. */
+    size_t consumed;
+    /** Max value of (next - consumed). */
+    size_t window;
+    /** Set when the result is known to be a failure. */
+    bool abort;
+#if PEGC_USE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+typedef struct pegc_par pegc_par;
+
+/**
+   Parses cx->chunks[i] into a new parser, item by item. On error the
+   chunk's parser holds the error message.
+*/
+static void pegc_par_run_chunk( pegc_par * cx, size_t i )
+{
+    pegc_par_chunk * c = &cx->chunks[i];
+    pegc_parser * p = pegc_create_grammar_parser( cx->st->grammar, c->begin, c->end - c->begin );
+    c->st = p;
+    c->ok = false;
+    if( ! p ) return;
+    pegc_set_memo_mode( p, cx->st->memo.mode );
+    p->depth_limit = cx->st->depth_limit;
+    while( p->cursor.pos < p->cursor.end )
+    {
+	pegc_const_iterator const at = p->cursor.pos;
+	bool const ok = pegc_parse( p, cx->item );
+	if( ! ok || (p->cursor.pos == at) )
+	{
+	    if( ! pegc_has_error(p) )
+	    {
+		pegc_set_error_e( p, ok
+				  ? "Record matched no input at offset %lu."
+				  : "Record failed to parse at offset %lu.",
+				  (unsigned long)(at - cx->st->cursor.begin) );
+	    }
+	    return;
+	}
+    }
+    c->ok = true;
+}
+
+#if PEGC_USE_THREADS
+/**
+   The worker thread for pegc_parse_parallel(): parses chunks until
+   none are left.
+*/
+static void * pegc_par_worker( void * arg )
+{
+    pegc_par * cx = (pegc_par *)arg;
+    pthread_mutex_lock( &cx->lock );
+    while( true )
+    {
+	while( ! cx->abort && (cx->next < cx->count)
+	       && ((cx->next - cx->consumed) >= cx->window) )
+	{
+	    pthread_cond_wait( &cx->cond, &cx->lock );
+	}
+	if( cx->abort || (cx->next >= cx->count) ) break;
+	size_t const i = cx->next++;
+	pthread_mutex_unlock( &cx->lock );
+	pegc_par_run_chunk( cx, i );
+	pthread_mutex_lock( &cx->lock );
+	cx->chunks[i].done = true;
+	pthread_cond_broadcast( &cx->cond );
+    }
+    pthread_mutex_unlock( &cx->lock );
+    return 0;
+}
+#endif
+
+/**
+   Returns the end of the chunk which should end near p: just after
+   the first boundary at or after p, or end if there is none.
+*/
+static pegc_const_iterator pegc_par_split( pegc_parser * st, pegc_const_iterator p, pegc_const_iterator end,
+					   int sep, PegcRule const * sepRule )
+{
+    if( p >= end ) return end;
+    if( ! sepRule )
+    {
+	pegc_const_iterator const x = (pegc_const_iterator)memchr( p, (unsigned char)sep, end - p );
+	return x ? (x + 1) : end;
+    }
+    for( ; p < end; ++p )
+    {
+	st->cursor.pos = p;
+	if( pegc_parse( st, sepRule ) && (st->cursor.pos > p) ) return st->cursor.pos;
+	if( pegc_has_error(st) ) break;
+    }
+    return end;
+}
+
+/**
+   Copies the error and farthest failure of chunk c's parser to st,
+   moving their positions from chunk offsets to offsets in st's
+   input, so that st reports them as if it had parsed the chunk
+   itself.
+*/
+static void pegc_par_adopt_error( pegc_parser * st, pegc_par_chunk const * c )
+{
+    size_t const off = (size_t)(c->begin - st->cursor.begin);
+    pegc_errinfo const * ce = &c->st->errinfo;
+    pegc_errinfo * e = pegc_set_error_code( st, ce->code );
+    e->pos = off + ce->pos;
+    e->arg[0] = ce->arg[0];
+    e->arg[1] = ce->arg[1];
+    if( PegcError_QuotedString == ce->code ) e->arg[0] += off;
+    e->ptr[0] = ce->ptr[0];
+    e->ptr[1] = ce->ptr[1];
+    e->used = ce->used;
+    memcpy( e->text, ce->text, ce->used + 1 );
+    if( c->st->failure.end && ((off + c->st->failure.end) >= st->failure.end) )
+    {
+	st->failure = c->st->failure;
+	st->failure.end += off;
+    }
+}
+
+bool pegc_parse_parallel( pegc_parser * st, PegcRule const * item,
+			  int sep, PegcRule const * sepRule, unsigned int threads )
+{
+    if( ! st || ! item || ! item->rule || ! st->cursor.pos || pegc_has_error(st) ) return false;
+    if( ! st->grammar )
+    {
+	pegc_set_error_e( st, "pegc_parse_parallel() requires a parser made by pegc_create_grammar_parser()." );
+	return false;
+    }
+    if( ! threads ) threads = 1;
+    pegc_const_iterator const begin = st->cursor.pos;
+    pegc_const_iterator const end = st->cursor.end;
+    size_t size = (size_t)(end - begin) / (threads * PEGC_PAR_CHUNKS_PER_THREAD);
+    if( size < PEGC_PAR_CHUNK_MIN ) size = PEGC_PAR_CHUNK_MIN;
+    else if( size > PEGC_PAR_CHUNK_MAX ) size = PEGC_PAR_CHUNK_MAX;
+    pegc_par cx;
+    memset( &cx, 0, sizeof(cx) );
+    cx.st = st;
+    cx.item = item;
+    cx.window = threads * PEGC_PAR_AHEAD;
+    size_t cap = 0;
+    pegc_const_iterator p = begin;
+    while( p < end )
+    {
+	if( cx.count == cap )
+	{
+	    cap = cap ? (cap * 2) : 64;
+	    pegc_par_chunk * li = (pegc_par_chunk *)realloc( cx.chunks, cap * sizeof(pegc_par_chunk) );
+	    if( ! li )
+	    {
+		pegc_free( cx.chunks );
+		pegc_set_error_e( st, "Out of memory for parallel parse chunks." );
+		return false;
+	    }
+	    cx.chunks = li;
+	}
+	pegc_par_chunk * c = &cx.chunks[cx.count++];
+	memset( c, 0, sizeof(pegc_par_chunk) );
+	c->begin = p;
+	c->end = p = pegc_par_split( st, ((size_t)(end - p) > size) ? (p + size) : end, end, sep, sepRule );
+    }
+    st->cursor.pos = begin;
+    if( pegc_has_error(st) )
+    {
+	pegc_free( cx.chunks );
+	return false;
+    }
+    size_t nthreads = 0;
+#if PEGC_USE_THREADS
+    pthread_t * tids = 0;
+    if( (threads > 1) && (cx.count > 1) )
+    {
+	if( threads > cx.count ) threads = (unsigned int)cx.count;
+	tids = (pthread_t *)malloc( threads * sizeof(pthread_t) );
+    }
+    if( tids )
+    { /* If this fails, we parse in this thread. */
+	pthread_mutex_init( &cx.lock, 0 );
+	pthread_cond_init( &cx.cond, 0 );
+	for( ; nthreads < threads; ++nthreads )
+	{
+	    if( 0 != pthread_create( &tids[nthreads], 0, pegc_par_worker, &cx ) ) break;
+	}
+    }
+#endif
+    /* Trigger each chunk's actions, in input order, as soon as the
+       chunk is parsed. */
+    bool ok = true;
+    size_t i = 0;
+    for( ; i < cx.count; ++i )
+    {
+	pegc_par_chunk * c = &cx.chunks[i];
+	if( ! nthreads ) pegc_par_run_chunk( &cx, i );
+#if PEGC_USE_THREADS
+	else
+	{
+	    pthread_mutex_lock( &cx.lock );
+	    while( ! c->done ) pthread_cond_wait( &cx.cond, &cx.lock );
+	    pthread_mutex_unlock( &cx.lock );
+	}
+#endif
+	if( c->ok )
+	{
+	    pegc_set_client_data( c->st, pegc_get_client_data( st ) );
+	    c->ok = pegc_trigger_actions( c->st );
+	}
+	if( ! c->ok )
+	{
+	    ok = false;
+	    if( c->st && pegc_has_error(c->st) )
+	    {
+		pegc_par_adopt_error( st, c );
+	    }
+	    else
+	    {
+		pegc_set_error_e( st, "Parallel parse failed in the chunk at offset %lu.",
+				  (unsigned long)(c->begin - st->cursor.begin) );
+	    }
+	}
+	pegc_destroy_parser( c->st );
+	c->st = 0;
+#if PEGC_USE_THREADS
+	if( nthreads )
+	{
+	    pthread_mutex_lock( &cx.lock );
+	    cx.consumed = i + 1;
+	    if( ! ok ) cx.abort = true;
+	    pthread_cond_broadcast( &cx.cond );
+	    pthread_mutex_unlock( &cx.lock );
+	}
+#endif
+	if( ! ok ) break;
+    }
+#if PEGC_USE_THREADS
+    if( tids )
+    {
+	size_t t = 0;
+	for( ; t < nthreads; ++t ) pthread_join( tids[t], 0 );
+	pegc_free( tids );
+	pthread_cond_destroy( &cx.cond );
+	pthread_mutex_destroy( &cx.lock );
+    }
+#endif
+    /* After a failure, workers may have finished chunks we did not
+       consume. */
+    for( i = 0; i < cx.count; ++i ) pegc_destroy_parser( cx.chunks[i].st );
+    pegc_free( cx.chunks );
+    if( ok ) st->cursor.pos = end;
+    return ok;
+}
+
+/************************************************************************
+Streaming input. See pegc_stream_begin().
+************************************************************************/
+
+bool pegc_stream_begin( pegc_parser * st, PegcRule const * item )
+{
+    if( ! st || ! item || ! item->rule ) return false;
+    pegc_set_input( st, 0, 0 );
+    st->stream.item = item;
+    st->stream.size = 0;
+    st->stream.start = 0;
+    st->stream.offset = 0;
+    st->stream.final = false;
+    st->stream.starved = false;
+    st->stream.active = true;
+    st->cursor.begin = st->cursor.pos = st->cursor.end = st->stream.buf;
+    return true;
+}
+
+/**
+   Points st's cursor at its stream buffer, with the position at the
+   first unparsed byte.
+*/
+static void pegc_stream_sync( pegc_parser * st )
+{
+    st->cursor.begin = st->stream.buf;
+    st->cursor.end = st->stream.buf + st->stream.size;
+    st->cursor.pos = st->stream.buf + st->stream.start;
+}
+
+/**
+   Parses as many complete items from st's stream buffer as
+   possible. Returns false if an item fails to parse, an action
+   fails, or some other error occurs.
+*/
+static bool pegc_stream_run( pegc_parser * st )
+{
+    while( st->stream.start < st->stream.size )
+    {
+	size_t const mark = st->actions.count;
+	pegc_clear_memo( st );
+	pegc_stream_sync( st );
+	st->stream.starved = false;
+	bool const ok = pegc_parse( st, st->stream.item );
+	if( st->stream.starved )
+	{ /* The result might be different with more input, so undo
+	     this attempt and wait for more. */
+	    pegc_truncate_actions( st, mark );
+	    pegc_set_error_e( st, 0, 0 );
+	    pegc_stream_sync( st );
+	    return true;
+	}
+	size_t const at = st->stream.offset + st->stream.start;
+	if( ! ok || (pegc_pos(st) == (st->cursor.begin + st->stream.start)) )
+	{
+	    if( ! pegc_has_error(st) )
+	    {
+		pegc_set_error_e( st, ok
+				  ? "Stream item matched no input at stream offset %lu."
+				  : "Stream item failed to parse at stream offset %lu.",
+				  (unsigned long)at );
+	    }
+	    return false;
+	}
+	/* The item is complete, so nothing can refer to its bytes once
+	   its actions have run. */
+	bool const rc = pegc_trigger_actions( st );
+	pegc_clear_actions( st );
+	if( ! rc ) return false;
+	st->stream.start = pegc_pos(st) - st->cursor.begin;
+    }
+    return true;
+}
+
+/**
+   Discards the parsed part of st's stream buffer, except for one
+   byte of look-behind (for PegcRule_bol).
+*/
+static void pegc_stream_compact( pegc_parser * st )
+{
+    if( st->stream.start < 2 ) return;
+    size_t const drop = st->stream.start - 1;
+    memmove( st->stream.buf, st->stream.buf + drop, st->stream.size - drop );
+    st->stream.size -= drop;
+    st->stream.start -= drop;
+    st->stream.offset += drop;
+    /* Keep the newline index relative to the retained input. */
+    pegc_lines * li = &st->lines;
+    size_t i = 0;
+    size_t n = 0;
+    for( ; i < li->count; ++i )
+    {
+	if( li->list[i] >= drop ) li->list[n++] = li->list[i] - drop;
+    }
+    li->count = n;
+    li->scanned = (li->scanned > drop) ? (li->scanned - drop) : 0;
+    st->failure.end = (st->failure.end > drop) ? (st->failure.end - drop) : 0;
+    st->errinfo.pos = (st->errinfo.pos > drop) ? (st->errinfo.pos - drop) : 0;
+    pegc_stream_sync( st );
+}
+
+bool pegc_feed( pegc_parser * st, char const * bytes, long n )
+{
+    if( ! st || ! st->stream.active || st->stream.final || pegc_has_error(st) ) return false;
+    if( ! bytes ) n = 0;
+    else if( n < 0 ) n = (long)pegc_strlen( bytes );
+    if( (size_t)n > (st->stream.capacity - st->stream.size) )
+    {
+	size_t newCap = st->stream.capacity ? st->stream.capacity : 4096;
+	while( newCap < (st->stream.size + (size_t)n) ) newCap *= 2;
+	char * x = (char *)realloc( st->stream.buf, newCap );
+	if( ! x )
+	{
+	    pegc_set_error_e( st, "Out of memory for stream buffer." );
+	    return false;
+	}
+	st->stats.alloced += newCap - st->stream.capacity;
+	st->stream.buf = x;
+	st->stream.capacity = newCap;
+    }
+    if( n ) memcpy( st->stream.buf + st->stream.size, bytes, n );
+    st->stream.size += n;
+    bool const rc = pegc_stream_run( st );
+    pegc_stream_compact( st );
+    return rc;
+}
+
+bool pegc_stream_end( pegc_parser * st )
+{
+    if( ! st || ! st->stream.active ) return false;
+    st->stream.final = true;
+    bool rc = ! pegc_has_error(st) && pegc_stream_run( st );
+    pegc_stream_compact( st );
+    st->stream.active = false;
+    return rc;
+}
+
+size_t pegc_stream_retained( pegc_parser const * st )
+{
+    return st ? st->stream.size : 0;
+}
+
+/**
+   Returns true if r is a terminal rule, for purposes of
+   pegc_fail_note(): one which does not run sub-rules.
+*/
+static bool pegc_rule_is_terminal( PegcRule const * r )
+{
+    PegcRule_mf const f = r->rule;
+    return ! r->proxy
+	&& (f != PegcRule_mf_or) && (f != PegcRule_mf_and)
+	&& (f != PegcRule_mf_or_v) && (f != PegcRule_mf_and_v)
+	&& (f != PegcRule_mf_or_dispatch) && (f != PegcRule_mf_if_then_else)
+	&& (f != PegcRule_mf_program);
+}
+
+/**
+   Records that the rule r failed at input position p, if r is a
+   terminal rule and p is at least as far as the farthest failure so
+   far. Failures before the farthest one (i.e. nearly all of them)
+   cost only one compare.
+*/
+static void pegc_fail_note( pegc_parser * st, PegcRule const * r, pegc_const_iterator p )
+{
+    size_t const end = (size_t)(p - st->cursor.begin) + 1;
+    if( (end < st->failure.end) || ! r || ! st->cursor.begin
+	|| ! pegc_rule_is_terminal( r ) ) return;
+    if( end > st->failure.end )
+    {
+	st->failure.end = end;
+	st->failure.count = 0;
+	st->failure.truncated = false;
+    }
+    size_t i = 0;
+    for( ; i < st->failure.count; ++i )
+    {
+	if( (st->failure.expected[i].rule == r->rule)
+	    && (st->failure.expected[i].data == r->data) ) return;
+    }
+    if( i < PEGC_FAILURE_MAX_EXPECTED ) st->failure.expected[st->failure.count++] = *r;
+    else st->failure.truncated = true;
+}
+
+bool pegc_get_failure_info( pegc_parser const * st, pegc_failure_info * info )
+{
+    if( ! st || ! info ) return false;
+    memset( info, 0, sizeof(pegc_failure_info) );
+    info->line = 1;
+    if( ! st->failure.end ) return true;
+    info->failed = true;
+    info->pos = st->cursor.begin + (st->failure.end - 1);
+    pegc_line_col_at( st, info->pos, &info->line, &info->col );
+    info->count = st->failure.count;
+    info->truncated = st->failure.truncated;
+    memcpy( info->expected, st->failure.expected, st->failure.count * sizeof(PegcRule) );
+    return true;
+}
+
 pegc_stats pegc_get_stats( pegc_parser const * cx )
 {
     whgc_stats const wh = whgc_get_stats( cx ? cx->gc : 0 );
@@ -74,10 +74,10 @@ too dependent on the character type (instead using typedefs for the
 supported char type), but some routines explicitly require a certain
 character type (e.g. those few which use strlen()).
 
-- It requires buffering all input before parsing begins. It
-would be very interesting to have a mechanism which allows it to
-stream data, but knowing at which point(s) we can discard old input
-is a difficult problem.
+- Normally it requires buffering all input before parsing begins.
+Input which is a sequence of independent items (e.g. log records) can
+instead be streamed with pegc_feed(), which only keeps the item
+currently being parsed in memory. See pegc_stream_begin().
 
 - Converting tokens to client-side types (e.g. parsing/unescaping
 quoted strings or converting tokens to integers) can be tricky
@@ -308,9 +308,9 @@ extern "C" {
 	*/
 	pegc_const_iterator pos;
 	/*
-	  One address after the end of the string (i.e., where the
-	  null terminator should be, except that the end may be within a
-	  substring of a larger string).
+	  One address after the end of the input. The input need not be
+	  null-terminated, and may contain NUL bytes: only this pointer
+	  marks its end.
 	*/
 	pegc_const_iterator end;
     };
@@ -390,10 +390,133 @@ extern "C" {
     */
     pegc_parser * pegc_create_parser( char const * inp, long len );
 
+    /**
+       Creates a new parser whose input is the contents of the given
+       file. If filename is "-" then stdin is read.
+
+       On POSIX systems, regular files are mapped read-only into
+       memory (with sequential-access hints) rather than copied, so
+       large inputs do not need to fit in the heap. Pipes, devices,
+       and empty files (and all files on other platforms, or if the
+       library is built with PEGC_USE_MMAP=0) are read into a buffer
+       owned by the parser. Either way the input belongs to the
+       parser and is released by pegc_destroy_parser().
+
+       The file must not be modified while the parser uses it.
+
+       Calling pegc_set_input() on the returned parser points it at
+       new input, but the file's contents stay available until the
+       parser is destroyed.
+
+       Returns 0 if the file cannot be opened or read, or on
+       allocation error.
+    */
+    pegc_parser * pegc_create_parser_from_file( char const * filename );
+
+    /**
+       @typedef struct pegc_grammar
+
+       A set of rules which, once complete, can be shared by any
+       number of parsers, including parsers used concurrently from
+       different threads. Normally the rules built via a parser (e.g.
+       with pegc_r_list_vv() or pegc_r_action_d_v()) are owned by that
+       parser and cached in it, so they cannot outlive it or be used
+       safely from another thread. A grammar instead owns its rules,
+       and the parsers created for it only hold the per-parse state
+       (input, cursor, memo table, actions, etc.).
+
+       Usage:
+
+       \code
+       pegc_grammar * g = pegc_create_grammar();
+       pegc_parser * b = pegc_grammar_builder( g );
+       PegcRule const * R = ...; // built using b
+       pegc_grammar_freeze( g );
+       ...
+       // in any thread:
+       pegc_parser * p = pegc_create_grammar_parser( g, input, -1 );
+       pegc_parse( p, R );
+       ...
+       pegc_destroy_parser( p );
+       ...
+       pegc_destroy_grammar( g );
+       \endcode
+
+       A parser created for a grammar finds the grammar's rule data
+       (e.g. via pegc_gc_search()) in addition to its own, so data
+       which rules register lazily while parsing is owned by the
+       parser which registered it.
+
+       Client data given to the rules of a shared grammar (e.g. an
+       action's clientData) is shared, too, so actions which must
+       write per-parse results should find their destination via
+       pegc_get_client_data() rather than via their clientData
+       argument. Likewise, pegc_r_string_quoted() rules with a
+       non-null target write to that target, so they must not be used
+       by several threads at once.
+    */
+    struct pegc_grammar;
+    typedef struct pegc_grammar pegc_grammar;
+
+    /**
+       Creates a new, empty grammar. Build its rules using the parser
+       returned by pegc_grammar_builder(), then call
+       pegc_grammar_freeze(). The grammar must be destroyed with
+       pegc_destroy_grammar(). Returns 0 on allocation error.
+    */
+    pegc_grammar * pegc_create_grammar();
+
+    /**
+       Returns the parser which owns g's rules, for passing to the
+       rule-building functions, or 0 if g is null or has been frozen.
+       The builder has no input and must not be used for parsing, and
+       it must not be destroyed by the caller.
+    */
+    pegc_parser * pegc_grammar_builder( pegc_grammar * g );
+
+    /**
+       Marks g as complete. This finishes any lazily-built parts of
+       its rules (e.g. the tables of pegc_r_or_dispatch() rules) so
+       that parsing does not modify the grammar, after which g can be
+       used by pegc_create_grammar_parser(), and its rules by any
+       number of threads at once, without locking.
+
+       After this, g must not be modified: no more rules may be built
+       in it, and pegc_grammar_builder() returns 0.
+
+       Returns false if g is null, if building g's rules left an
+       error in its builder, or on allocation error. Returns true if g
+       is already frozen.
+    */
+    bool pegc_grammar_freeze( pegc_grammar * g );
+
+    /**
+       Works like pegc_create_parser(), but the new parser is meant
+       for parsing with g's rules. g must be frozen and must outlive
+       the parser. Each thread needs its own parser(s), but any number
+       of parsers may share one grammar. Returns 0 if g is null or not
+       frozen, or on allocation error.
+    */
+    pegc_parser * pegc_create_grammar_parser( pegc_grammar const * g, char const * inp, long len );
+
+    /**
+       Returns the grammar st was created for by
+       pegc_create_grammar_parser(), or 0.
+    */
+    pegc_grammar const * pegc_get_grammar( pegc_parser const * st );
+
+    /**
+       Destroys g and its rules. All parsers created for g must be
+       destroyed first. Returns false only if g is null.
+    */
+    bool pegc_destroy_grammar( pegc_grammar * g );
+
     /**
        Initializes st's input range and clears the error state. This
        effectively invalidates any current parse, as the input range
-       has changed. The input range must outlive the parser. If the
+       has changed. The range [begin,begin+length) may be any byte
+       slice: it need not be null-terminated and may contain NUL
+       bytes, which the rules treat like any other byte. The input range must outlive the parser. If the
        input of a parser changes, the old input range must still
        outlive the new input if the parser has triggered any delayed
        actions because those actions' string matches still refer to
@@ -407,6 +530,23 @@ extern "C" {
     */
     bool pegc_set_input( pegc_parser * st, pegc_const_iterator begin, long length );
 
+    /**
+       Prepares st for parsing a new input, as if it were a newly
+       created parser with the same rules: like pegc_set_input(), but
+       it also discards any queued delayed actions (without running
+       them) and the current match.
+
+       Everything else is kept: memory allocated by rules built via
+       st, client data, memoization settings, and the internal
+       buffers (memo table, backtracking stack, span cache, etc.),
+       which keep their capacity. Parsing many small inputs with one
+       parser and this function is therefore far cheaper than
+       creating a parser for each of them.
+
+       Returns false if st is null.
+    */
+    bool pegc_reset( pegc_parser * st, pegc_const_iterator begin, long length );
+
     /**
        Sets a descriptive name for the parser. Intended for debugging
        and error reporting. e.g. it to the name of a file being
@@ -453,8 +593,8 @@ extern "C" {
     bool pegc_destroy_parser( pegc_parser * st );
 
     /**
-       Returns true if st is 0, points to a null character, or is
-       currently pointed out of its bounds (see pegc_in_bounds(),
+       Returns true if st is 0 or is currently pointed out of its
+       bounds (see pegc_in_bounds(),
        pegc_begin(), and pegc_end()).
 
        Rules should check this value before doing any comparisons.
@@ -485,12 +625,9 @@ extern "C" {
        line number starts at one and column starts at zero (because
        this is how emacs does it).
 
-       Returns false if any of the arguments are null, otherwise
-       returns true.
+       Returns false if st is null, otherwise returns true.
 
-       Note that this is a linear-time operation, as rules to not
-       update this information themselves (it would complicate the
-       implementation of nearly every single rule).
+       This is equivalent to pegc_line_col_at(st,pegc_pos(st),line,col).
 
        FIXME: does not correctly handle platforms which use a single
        carriage return as the newline character. We can use
@@ -498,6 +635,29 @@ extern "C" {
     */
     bool pegc_line_col( pegc_parser const * st, size_t * line, size_t * col );
 
+    /**
+       Like pegc_line_col(), but for the input position pos, which
+       must lie within st's input (from pegc_begin() to pegc_end(),
+       inclusive).
+
+       The lookup uses a newline index which st builds lazily. The
+       first lookup at or beyond a given position scans the input
+       up to that position once (using memchr()). After that a lookup
+       is a binary search, O(log n) in the number of lines. So
+       looking up the position of every record of a large input
+       takes linear time overall, not quadratic time. The index is
+       reset by pegc_set_input(), kept up to the edited offset by
+       pegc_edit_input(), and freed by pegc_destroy_parser(). It is
+       updated even though st is const, so lookups on a parser must
+       not run concurrently with other uses of it.
+
+       Returns false if st is null or pos is outside of st's input,
+       otherwise returns true. If st has no input, the line and
+       column are 1 and 0.
+    */
+    bool pegc_line_col_at( pegc_parser const * st, pegc_const_iterator pos,
+			   size_t * line, size_t * col );
+
     /**
        Gets the current error string (which may be 0), line, and
        column.
@@ -513,26 +673,33 @@ extern "C" {
        The returned string is owned by the parser and will be
        invalidated by the next parsing operation which sets the error
        state or when the parser is destroyed.
+
+       Setting an error only records it. The message, including the
+       line and column, is built (and allocated) by the first call to
+       this function after the error was set, so failed parses whose
+       errors are never read do not pay for formatting them. If that
+       allocation fails, the unadorned message is returned and line
+       and col are left untouched.
     */
     char const * pegc_get_error( pegc_parser const * st,
 				 size_t * line,
 				 size_t * col );
 
     /**
-       Copies the given null-terminated string as the current error
-       message for the parser. Also sets the line/column position.
-       The error can be fetched with pegc_get_error().
+       Formats the given printf-style message (see vappendf()) as
+       the current error for the parser, and remembers the current
+       position for its line/column. The error can be fetched with
+       pegc_get_error().
 
-       If msg if NULL then the error state is cleared.
+       If fmt is NULL or empty then the error state is cleared.
 
-       Returns false if:
+       The message is formatted into a fixed-size buffer in the
+       parser (messages longer than about 500 bytes are truncated),
+       and the line/column are not computed until pegc_get_error()
+       is called, so this does not allocate memory. It is therefore
+       safe to use in response to alloc errors.
 
-       - st is null
-
-       - cannot allocate memory for the error string.
-
-       Note that because it must allocate memory for the error string,
-       it is not a wise idea to set this in response to alloc errors.
+       Returns false only if st is null.
     */
     bool pegc_set_error_v( pegc_parser * st, char const * fmt, va_list vargs );
 
@@ -908,6 +1075,498 @@ extern "C" {
     */
     bool pegc_parse( pegc_parser * st, PegcRule const * r );
 
+    /**
+       Parses each of the count given inputs with the rule r, reusing
+       st for all of them (see pegc_reset()). lengths holds the length
+       of each input, with negative values meaning to use
+       pegc_strlen(), or may be null if all inputs are NUL-terminated.
+
+       After a successful parse of an input, its queued delayed
+       actions are triggered (they refer to that input, so they
+       cannot be deferred until after the next one) and then
+       cleared. If results is not null, results[i] is set to true if
+       input i parsed and its actions succeeded, else false. As for
+       pegc_parse(), a parse succeeds if r matches a prefix of the
+       input, so use a rule ending with PegcRule_eof to require a
+       complete match.
+
+       Once st's internal buffers (including the delayed action
+       queue) have grown to fit the inputs, this allocates no memory.
+       Error messages are only built if pegc_get_error() asks for
+       them.
+
+       After this returns, st still points to the last input and
+       holds its error state, if any.
+
+       Returns the number of inputs which parsed successfully. Returns
+       0 if st or r are null, or if count is not 0 and inputs is null.
+    */
+    size_t pegc_parse_many( pegc_parser * st, PegcRule const * r,
+			    pegc_const_iterator const * inputs, long const * lengths,
+			    size_t count, bool * results );
+
+    /**
+       Sets the maximum parse depth for st. This limits both the
+       nesting level of rules run by the core rules (each nested call
+       uses space on the C stack) and the number of entries on the
+       backtracking stack used by pegc_parse_program(). When the limit
+       is reached, st's error state is set (see pegc_get_error()) and
+       the parse fails, rather than the application crashing because
+       of deeply nested input.
+
+       Deeply nested input needs several levels per level of nesting
+       (e.g. an OR, an AND, and a star rule), so the limit should be
+       several times the input nesting depth which should be
+       supported. A limit of 0 means no limit.
+
+       The default is 10000, which is safe for the default C stack
+       sizes of common platforms. Note that this is a change from
+       older versions of pegc, which had no limit: grammars which
+       legitimately nest more deeply than that must raise the limit
+       (or disable it with 0), or their parses will fail.
+
+       The stack used by pegc_parse_program() is kept by st and
+       re-used by later parses, so it only allocates memory when
+       the input is nested more deeply than any previous input.
+
+       Rules called directly via their function pointers (rather than
+       via pegc_parse() or the core rules) are not counted.
+
+       Returns false only if !st.
+    */
+    bool pegc_set_depth_limit( pegc_parser * st, size_t limit );
+
+    /**
+       Returns st's depth limit (see pegc_set_depth_limit()), or 0 if
+       !st.
+    */
+    size_t pegc_get_depth_limit( pegc_parser const * st );
+
+    /**
+       The max number of rules recorded in
+       pegc_failure_info::expected.
+    */
+#define PEGC_FAILURE_MAX_EXPECTED 8
+
+    /**
+       Describes the farthest input position at which a terminal rule
+       (one which does not run sub-rules, e.g. a char, string or
+       character class rule, or a client-defined rule) failed. See
+       pegc_get_failure_info().
+    */
+    struct pegc_failure_info
+    {
+	/**
+	   True if any terminal rule has failed since the input was
+	   set. If false, the other members are empty.
+	*/
+	bool failed;
+	/**
+	   The farthest position at which a terminal rule failed.
+	*/
+	pegc_const_iterator pos;
+	/**
+	   The line and column of pos, as for pegc_line_col_at().
+	*/
+	size_t line;
+	size_t col;
+	/**
+	   The number of entries in expected.
+	*/
+	size_t count;
+	/**
+	   True if more distinct rules failed at pos than expected can
+	   hold.
+	*/
+	bool truncated;
+	/**
+	   Copies of the distinct rules which failed at pos, in the
+	   order they first failed there. Their data and proxy
+	   pointers are only valid as long as the original rules'.
+	*/
+	PegcRule expected[PEGC_FAILURE_MAX_EXPECTED];
+    };
+    typedef struct pegc_failure_info pegc_failure_info;
+
+    /**
+       Fills info with the farthest failure of a terminal rule since
+       st's input was last set. After pegc_parse() fails, this is
+       usually the place to report, as "expected one of
+       info->expected at line info->line". It also works after a
+       successful parse (e.g. one which stopped short of the end of
+       the input).
+
+       Failures are recorded while parsing, for rules run via
+       pegc_parse(), the core rules, or a compiled program (but not
+       for rules called directly via their function pointers).
+       Failures before the farthest one cost a single comparison,
+       so this is always enabled.
+
+       The record is reset by pegc_set_input() and
+       pegc_edit_input(). For a stream (see pegc_stream_begin()) it
+       covers the retained input.
+
+       Returns false if st or info are null.
+    */
+    bool pegc_get_failure_info( pegc_parser const * st, pegc_failure_info * info );
+
+    /**
+       Parses the rest of st's input as a sequence of records, each of
+       which must match the item rule, using up to the given number
+       of worker threads. This is intended for large inputs made of
+       many independent records, e.g. lines of a log file.
+
+       The input is split into chunks of roughly equal size, each of
+       which ends just after a record boundary: the byte sep if
+       sepRule is null, or else a match of sepRule (which is looked
+       for, starting at each split point, using st). Each chunk is
+       parsed by its own parser (see pegc_create_grammar_parser()),
+       which runs item repeatedly until the end of the chunk, so item
+       must consume the boundary itself (e.g. a line rule must end
+       with its '\n'). The chunks are parsed concurrently, but their
+       delayed actions are triggered by the calling thread, in input
+       order, as soon as each chunk (and all chunks before it) have
+       been parsed. While the actions run, pegc_get_client_data() on
+       their parser returns st's client data.
+
+       Requirements and caveats:
+
+       - st must have been created by pegc_create_grammar_parser(),
+       and item and sepRule must belong to st's grammar.
+
+       - The chunk parsers use st's memo mode and depth limit, but
+       rules marked via pegc_memoize_rule() on st are not marked for
+       them.
+
+       - Errors are reported via st. Error messages set by rules
+       (including their line/column numbers) are relative to the start
+       of the chunk they occur in.
+
+       - Immediate actions (see pegc_r_action_i()) and match
+       listeners run in the worker threads, so they must be
+       thread-safe. Delayed actions need not be.
+
+       - If the library is built with PEGC_USE_THREADS=0 (the default
+       on non-POSIX platforms) the chunks are parsed one at a time in
+       the calling thread.
+
+       On success, st's cursor is moved to the end of the input and
+       true is returned. If a record fails to parse, or an action
+       fails, false is returned, the remaining chunks are abandoned
+       (though actions for the chunks before the failing one have
+       been run), and st's error state describes the failure. Returns
+       false without setting an error if st or item are null, st has
+       no input, or st is already in an error state.
+    */
+    bool pegc_parse_parallel( pegc_parser * st, PegcRule const * item,
+			      int sep, PegcRule const * sepRule, unsigned int threads );
+
+    /**
+       Puts st into streaming mode, in which input is pushed to the
+       parser in chunks with pegc_feed() and parsed as a sequence of
+       items, each of which must match the given rule. item must
+       outlive the stream. This replaces st's current input, as for
+       pegc_set_input().
+
+       Items are parsed as soon as enough input has arrived. If
+       parsing an item looks at the end of the input received so
+       far, the result might change once more input arrives. The
+       attempt is then undone and retried on the next pegc_feed().
+       This holds even if the attempt succeeded, e.g. because a
+       star rule might be able to consume more.
+
+       Once an item matches, its delayed actions are triggered and
+       cleared, and the bytes it matched are discarded. Nothing can
+       refer to them after that: there are no choice points between
+       items, the memoization table is cleared, and there are no
+       queued actions left. This bounds the memory used to roughly
+       the size of the largest item (see pegc_stream_retained()).
+
+       Caveats:
+
+       - Immediate actions run during an attempt which is later
+       retried run again on the retry, so prefer delayed actions.
+
+       - Match cursors, and input positions in general, are only
+       valid until the next pegc_feed() call.
+
+       - PegcRule_eof only matches after pegc_stream_end() has been
+       called, and an item which might continue at the end of the
+       input received so far (e.g. one ending with a star rule or a
+       number) is only finished by more input or by
+       pegc_stream_end().
+
+       - pegc_line_col() is relative to the retained input.
+
+       Returns false if st or item are null or item is invalid.
+       Calling pegc_set_input() ends streaming mode.
+    */
+    bool pegc_stream_begin( pegc_parser * st, PegcRule const * item );
+
+    /**
+       Appends n bytes to st's stream (see pegc_stream_begin()) and
+       parses as many complete items as possible. If n is less than
+       0 then pegc_strlen(bytes) is used.
+
+       Returns false if st is not in streaming mode, if an item fails
+       to parse (or matches no input), if an action fails, or on
+       allocation error. Except in the first case, the error
+       state of st is then set (see pegc_get_error()) and further
+       feeding fails.
+    */
+    bool pegc_feed( pegc_parser * st, char const * bytes, long n );
+
+    /**
+       Tells st that its stream has ended, parses any remaining
+       items, and ends streaming mode. Returns false if any of the
+       input could not be parsed as items, in which case the error
+       state of st is set as for pegc_feed().
+    */
+    bool pegc_stream_end( pegc_parser * st );
+
+    /**
+       Returns the number of bytes of stream input st currently keeps
+       in memory: the input not yet parsed as complete items, plus
+       one byte of look-behind.
+    */
+    size_t pegc_stream_retained( pegc_parser const * st );
+
+    /**
+       Memoization modes for use with pegc_set_memo_mode().
+
+       PEGC_MEMO_OFF: no memoization is done (the default).
+
+       PEGC_MEMO_SELECTED: only rules which have been marked using
+       pegc_memoize_rule() are memoized.
+
+       PEGC_MEMO_ALL: every rule invoked by the core rules (and by
+       pegc_parse()) is memoized.
+    */
+    enum pegc_memo_mode { PEGC_MEMO_OFF = 0,
+			  PEGC_MEMO_SELECTED = 1,
+			  PEGC_MEMO_ALL = 2
+    };
+    typedef enum pegc_memo_mode pegc_memo_mode;
+
+    /**
+       Sets st's "packrat" memoization mode (see pegc_memo_mode).
+
+       When memoization is on, the result (success/failure, the end
+       position, and the match range) of running a given rule at a
+       given input offset is recorded the first time the rule runs
+       there. Subsequent attempts to run the same rule at the same
+       offset (which happen a lot in grammars which backtrack heavily
+       through OR and AND lists) re-use that result instead of
+       re-running the rule. This bounds the parse time of such
+       grammars to roughly linear time, at the cost of memory
+       proportional to (number of rules * input length).
+
+       Memo entries are keyed by the contents of a rule (its rule
+       function, data, and proxy), not its address. Because rules
+       have no per-instance state, all copies of a rule (e.g. those
+       made by pegc_r_list_vv()) share the same memoized results. The
+       data and proxy pointers must stay valid for as long as the memo
+       table refers to them, so call pegc_clear_memo() when switching
+       to a different grammar with the same input.
+
+       Caveats:
+
+       - On a memo hit the rule is not run, so match listeners are
+       not notified. Matches which queue delayed actions are not
+       recorded, as a hit could not re-queue them.
+
+       - Results are not recorded if the rule sets the parser's error
+       state.
+
+       The memo table is cleared by pegc_set_input() and
+       pegc_clear_memo(), updated for an edited input by
+       pegc_edit_input(), and freed by pegc_destroy_parser().
+
+       Returns false if st is null or mode is not a valid value.
+    */
+    bool pegc_set_memo_mode( pegc_parser * st, pegc_memo_mode mode );
+
+    /**
+       Returns st's current memoization mode.
+    */
+    pegc_memo_mode pegc_get_memo_mode( pegc_parser const * st );
+
+    /**
+       Marks r (and all copies of it) as a candidate for memoization
+       when st is in PEGC_MEMO_SELECTED mode. This is normally used to memoize only
+       the "expensive" rules of a grammar (e.g. those which are used
+       as the first elements of several alternatives), which costs
+       far less memory than memoizing everything.
+
+       Returns false if !st, !r, or on allocation error.
+    */
+    bool pegc_memoize_rule( pegc_parser * st, PegcRule const * r );
+
+    /**
+       Discards all memoized results for st but keeps the memo
+       table's memory for re-use.
+    */
+    void pegc_clear_memo( pegc_parser * st );
+
+    /**
+       Tells st that its input was edited and points it at the edited
+       copy, keeping the memoized results which the edit cannot have
+       changed. This is intended for re-parsing a document after a
+       small, localized change (e.g. in an editor): the next
+       pegc_parse() only re-runs the rules which looked at the edited
+       range, taking the rest from the memo table.
+
+       The edit replaced the removed bytes at the given offset of st's
+       current input with inserted new bytes. begin and length
+       describe the whole edited input, as for pegc_set_input(), and
+       the new length must be the old one minus removed plus
+       inserted. The old input need not be valid any more.
+
+       Each memo entry records the farthest byte its rule looked at
+       (via pegc_eof(), pegc_isgood(), the pegc_matches_xxx()
+       functions, or by consuming it). Entries which looked at the
+       edited range (or which start right after it, because rules like
+       PegcRule_bol look one byte behind) are dropped, entries after it
+       are moved by the change in length, and entries before it are
+       kept as-is. This requires that client-defined rules look at the
+       input only via those functions, or consume whatever they look
+       at.
+
+       Like pegc_set_input(), this clears the error state and moves
+       the cursor to the start of the input, and ends streaming mode.
+
+       Caveats:
+
+       - This is only useful if memoization is on (see
+       pegc_set_memo_mode()), and only for the rules being memoized.
+
+       - Because reused results do not re-run their rules, actions
+       attached to rules in the unchanged parts of the input are not
+       triggered again (see pegc_set_memo_mode()). Clients who need
+       the actions should keep the values they produced from the
+       previous parse.
+
+       - The memo table must hold results for the same grammar as the
+       next parse.
+
+       Returns false, without changing st, if st or begin are null,
+       st has no input, the edit does not fit in the old input, or the
+       lengths do not add up. If the memo table cannot be rebuilt due
+       to an allocation error it is cleared instead, so the next parse
+       is a full one.
+    */
+    bool pegc_edit_input( pegc_parser * st, pegc_const_iterator begin, long length,
+			  size_t offset, size_t removed, size_t inserted );
+
+    /**
+       @typedef struct pegc_program
+
+       A pegc_program is a rule graph compiled into a flat array of
+       instructions by pegc_compile(). Running a program with
+       pegc_parse_program() is equivalent to running the rule it was
+       compiled from with pegc_parse(), but avoids the overhead of
+       calling through each rule's function pointer: backtracking,
+       loops, and the character-level rules are handled by a single
+       dispatch loop.
+    */
+    struct pegc_program;
+    typedef struct pegc_program pegc_program;
+
+    /**
+       Compiles r, and all rules reachable from it, into a program
+       for use with pegc_parse_program().
+
+       The following core rules are compiled into instructions: the
+       OR and AND lists, star, plus, opt, at, notat, until, repeat,
+       the immediate and delayed actions, the single-character rules
+       (char, notchar, oneof, char_range, the isXXX()-style rules,
+       etc.), string, eof, success, and failure. Any other rule (e.g.
+       client-defined rules, or rules created by pegc_r_int_dec())
+       is called via its function pointer, so any rule graph can be
+       compiled. Rules which are used from more than one place, and
+       recursive rules, are compiled only once, as subroutines.
+
+       The program refers to r and the rules it contains, so they
+       must outlive the program. The program is owned by st and will
+       be destroyed when st is destroyed. A program may be run with
+       any parser for which its rules are valid (e.g. the parsers of
+       the grammar which owns them).
+
+       Differences from running r directly:
+
+       - Match listeners are only notified at the end of the
+       compiled composite rules, not for each compiled character-level
+       rule.
+
+       - If memoization is enabled (see pegc_set_memo_mode()), it
+       only applies to the rules which are called via their function
+       pointers.
+
+       Returns 0 if !st, if r is not valid, or on allocation error.
+    */
+    pegc_program * pegc_compile( pegc_parser * st, PegcRule const * r );
+
+    /**
+       Runs prog against st's current position. On success, st's
+       position is moved past the matched input and its match is set
+       to the matched range. On failure the position is restored to
+       where it was when this function was called.
+
+       Returns false if !st, !prog, or if the program does not match.
+    */
+    bool pegc_parse_program( pegc_parser * st, pegc_program const * prog );
+
+    /**
+       Returns a rule which runs prog via pegc_parse_program(). This
+       allows compiled programs to be used as parts of other
+       grammars. prog must outlive the returned rule.
+    */
+    PegcRule pegc_r_program( pegc_program const * prog );
+
+    /**
+       Returns the number of instructions in prog, or 0 if !prog.
+    */
+    size_t pegc_program_size( pegc_program const * prog );
+
+    /**
+       Rewrites the rule graph reachable from r into an equivalent
+       one which needs fewer rule invocations to parse, and replaces
+       *r with the optimized rule. The following rewrites are done:
+
+       - Nested OR lists are flattened into their parent OR list, and
+       nested AND lists into their parent AND list.
+
+       - Lists with only one element are replaced by that element.
+
+       - Nested opt/star/plus wrappers are collapsed into one, e.g.
+       (X*)? becomes X* and (X+)+ becomes X+. Likewise for nested
+       at/notat rules.
+
+       - Adjacent case-sensitive char and string rules in an AND list
+       are merged into one string rule.
+
+       - Adjacent single-character alternatives (char, oneof,
+       char_range, the isXXX()-style rules, etc.) in an OR list are
+       merged into one pegc_r_charclass()-style rule.
+
+       - oneof, char_range, notchar, and case-insensitive char rules
+       are replaced by equivalent pegc_r_charclass()-style rules.
+
+       - OR lists with three or more alternatives are converted to
+       pegc_r_or_dispatch() rules.
+
+       The original rules are not modified (rules are often shared,
+       e.g. PegcRule_alpha), so the optimized graph is a copy, and the
+       memory for it is owned by st. Rules which are reachable only
+       through proxies or data of rules other than the core rules are
+       not optimized.
+
+       Returns the number of rules which were removed from the
+       graph, or 0 if !st, r is not valid, or on allocation error (in
+       which case *r is not modified).
+    */
+    size_t pegc_optimize( pegc_parser * st, PegcRule * r );
+
     /**
        Registers an arbitrary key and value with the garbage
        collector, such that pegc_destroy_parser(st) will clean up the
@@ -959,6 +1618,9 @@ extern "C" {
        fast. It is sometimes convenient to stick a gc'd value into a
        PegcRule's 'data' member, rather than to waste time on a
        lookup.
+
+       If st was created by pegc_create_grammar_parser() and the key
+       is not in st's own pool, the grammar's pool is searched.
     */
     void * pegc_gc_search( pegc_parser const * st, void const * key );
 
@@ -969,10 +1631,29 @@ extern "C" {
     PegcRule pegc_r( PegcRule_mf func, void const * data );
 
     /**
-       Identical to pegc_r() but allocates a new object on the heap.
-       If st is not NULL then the new object is owned by st and will
-       be destroyed when pegc_destroy_parser(st) is called, otherwise
-       the caller owns it.
+       Allocates n bytes of zero-initialized memory, suitably aligned
+       for any type, which is owned by st and freed when st is
+       destroyed. It cannot be freed individually.
+
+       This is a "bump" allocator: memory is taken in order from
+       blocks of several kilobytes, so it is much cheaper than
+       malloc() plus pegc_gc_add(), objects allocated one after the
+       other are adjacent in memory, and pegc_destroy_parser() frees
+       all of them with one free() per block. The core uses it for
+       rules, rule data, lists, and names, and it is intended for the
+       same purposes in client code: memory which lives as long as the
+       grammar does and needs no destructor.
+
+       Returns 0 if st is null or on allocation error.
+    */
+    void * pegc_alloc( pegc_parser * st, size_t n );
+
+    /**
+       Identical to pegc_r() but allocates a new object. If st is not
+       NULL then the new object is allocated via pegc_alloc(st,...),
+       so it is owned by st and will be destroyed when
+       pegc_destroy_parser(st) is called, otherwise it is allocated
+       using malloc() and the caller owns it.
 
        Returns 0 if it cannot allocate a new object.
     */
@@ -1129,14 +1810,39 @@ extern "C" {
     */
     PegcRule pegc_r_char_range( pegc_char_t start, pegc_char_t end );
     /**
-       Matches a single char in a set defined by the spec parameter.
-       spec must be in the format "[a-z]", where "abc" is a range
-       specified such as "a-z", "A-Z", or "a-zA-Z". It uses sscanf()
-       to do the parsing, so it supports any definition supported by
-       the '%[' specifier.
-       
-       If st or spec are null, or the first character of spec
-       is not a '[' then an invalid rule is returned.
+       Creates a rule which matches a single character from the
+       character class defined by spec, which uses the familiar
+       regex/PEG syntax:
+
+       - It must start with '[' and end with ']'.
+
+       - If the first character after the '[' is '^', the class is
+       negated (it matches any character not listed).
+
+       - Ranges are written as "a-z". A '-' at the start or end of
+       the class is a literal '-', as is a ']' at the start of the
+       class.
+
+       - Backslash escapes are supported: \\n, \\r, \\t, \\f, \\v,
+       \\xHH, and a backslash followed by any other character stands
+       for that character (e.g. "\\]" or "\\\\").
+
+       Examples: "[a-zA-Z_]", "[^\"\\\\]", "[-+0-9]".
+
+       The spec is parsed once, into a 256-bit table, so matching
+       is a single table lookup. The NUL character may be included,
+       e.g. "[^\\x00]".
+
+       Returns an invalid rule if st or spec are null, spec is
+       malformed, or on allocation error.
+    */
+    PegcRule pegc_r_charclass( pegc_parser * st, char const * spec );
+
+    /**
+       Like pegc_r_charclass(st,spec), but a backslash is an ordinary
+       character rather than an escape, as it was when this rule was
+       implemented using sscanf()'s '%[' specifier. e.g. "[^\\]"
+       matches any character except a backslash.
     */
     PegcRule pegc_r_char_spec( pegc_parser * st, char const * spec );
 
@@ -1184,6 +1890,121 @@ extern "C" {
      */
     PegcRule pegc_r_until_v( pegc_parser * st, PegcRule const proxy );
 
+    /**
+       Creates a rule which may be left-recursive, either directly or
+       indirectly via other rules. The returned rule matches exactly
+       what body matches, but calls to the returned rule from
+       within body at the same input position do not recurse
+       endlessly. For example:
+
+       @code
+       PegcRule expr;
+       PegcRule const Expr = pegc_r_leftrec( &expr );
+       // Expr <- Expr '+' Term / Term
+       expr = pegc_r_or_ev( P,
+                            pegc_r_and_ev( P, Expr, plus, Term, end ),
+                            Term,
+                            end );
+       @endcode
+
+       Note that body is referenced by pointer and may therefore be
+       assigned after the returned rule is created (which is the only
+       way to make it self-referencing). Each cycle of left recursion
+       must pass through a rule created by this function.
+
+       This uses "seed growing": the first time the rule is run at a
+       given position, the body is run with recursive calls to the
+       rule (at that position) failing. Then the body is re-run,
+       with recursive calls returning the result of the previous run,
+       for as long as that consumes more input. The result is the
+       longest match, with left-associative structure. Delayed actions
+       queued by the final (unsuccessful) growth attempt are
+       discarded, so the queued actions reflect the left-associative
+       parse.
+
+       The intermediate and final results are stored in st's memo
+       table (see pegc_set_memo_mode()), regardless of the memo
+       mode. While a seed is growing, no other results are memoized.
+
+       Returns an invalid rule if !body.
+    */
+    PegcRule pegc_r_leftrec( PegcRule const * body );
+
+    /**
+       Creates a forward reference: a rule which runs whatever rule
+       is later bound to it with pegc_ref_bind(). This is how
+       recursive grammars are built, without looking the rules up
+       while parsing:
+
+       @code
+       PegcRule const Expr = pegc_r_ref( P, "Expr" );
+       PegcRule const Group = pegc_r_and_ev( P, open, Expr, close, end );
+       // Expr <- Group / Number
+       pegc_ref_bind( &Expr, pegc_r_or_ev( P, Group, Number, end ) );
+       @endcode
+
+       All copies of the returned rule share one slot, which is
+       allocated in st's arena (see pegc_alloc()), so binding any of
+       them binds them all. Running the rule costs one pointer load
+       plus the call to the bound rule, which it runs as if it were
+       used in place of the reference (e.g. for memoization and
+       pegc_compile()).
+
+       name is used as the rule's name and must outlive it (e.g. a
+       string literal). It may be 0.
+
+       Running a reference which has not been bound sets st's error
+       state and fails.
+
+       Returns an invalid rule if !st or on allocation error.
+    */
+    PegcRule pegc_r_ref( pegc_parser * st, char const * name );
+
+    /**
+       Binds the reference ref, which must have been created by
+       pegc_r_ref(), to a copy of target. A reference may be re-bound,
+       but not while a parser is running it, and the references of a
+       grammar must be bound before pegc_grammar_freeze() is called.
+       target's data and proxy must outlive the reference.
+
+       Returns false if ref is not a reference or target is not a
+       valid rule.
+    */
+    bool pegc_ref_bind( PegcRule const * ref, PegcRule const target );
+
+    /**
+       Creates an OR rule which works like pegc_r_list_a(true,li),
+       but which only tries those alternatives which can possibly
+       match the current input byte, in their original order.
+
+       When the rule is first run, it computes the FIRST set of each
+       alternative (the bytes it can start with, and whether it can
+       match without consuming input) and builds a 256-entry table
+       mapping each byte value to the list of candidate
+       alternatives. Alternatives which can match without consuming
+       input, and alternatives which contain rules other than the
+       core rules (whose FIRST sets are unknown), are candidates for
+       every byte. Thus for grammars in which most alternatives start
+       with a distinct character (e.g. keywords), choosing an
+       alternative takes constant time instead of time proportional
+       to the number of alternatives.
+
+       Because the table is built lazily, the alternatives (and any
+       rules they refer to) may be completed after this function is
+       called, but they must not be changed after the rule is first
+       run. Since building the table modifies the rule's data, the
+       first use of the rule must not happen concurrently in
+       multiple threads.
+
+       li must be terminated by an invalid rule and must outlive the
+       returned rule. pegc_optimize() converts OR lists with 3 or
+       more alternatives to this type of rule.
+
+       Returns an invalid rule if !st, li is empty, or on allocation
+       error.
+    */
+    PegcRule pegc_r_or_dispatch( pegc_parser * st, PegcRule const * li );
+
     /**
        Creates a rule which performs either an OR operation (if orOp
        is true) or an AND operation (if orOp is false) on the given
@@ -1298,8 +2119,7 @@ extern "C" {
        current match whereas for delayed actions this parameter points
        to the match made by the triggering rule. Note that the match
        range is a substring pointing back at st's original input
-       source, so it is probably not null-terminated (only matches at
-       EOF will be null terminated). A match cursor can be converted
+       source, so it is probably not null-terminated. A match cursor can be converted
        to a c-style string with pegc_cursor_tostring().
 
        - clientData: arbitrary client-side data, as passed to
@@ -1380,6 +2200,12 @@ extern "C" {
 
        Use pegc_trigger_actions() to trigger all queued actions. )Normally
        it should be called only after a successful parse.)
+
+       Actions queued while matching a rule which then fails (e.g. an
+       alternative of an OR list which matched partway) are dropped
+       when the parser backtracks, as are those queued inside
+       lookahead rules (pegc_r_at_p()), so the queue only holds the
+       actions for the input which the parse actually consumed.
     */
 
     PegcRule pegc_r_action_d_p( pegc_parser * st,
@@ -1412,7 +2238,9 @@ extern "C" {
     bool pegc_trigger_actions( pegc_parser * st );
 
     /**
-       Deallocates all queued actions.
+       Empties the queue of delayed actions. The queue's memory is kept
+       for re-use by later parses, so this is O(1) and the queue only
+       allocates when it grows past its largest size so far.
     */
     void pegc_clear_actions( pegc_parser * st );
 
@@ -1622,18 +2450,15 @@ extern "C" {
        Any other trailing characters (including EOF) are considered
        legal.
 
-       This rule requires a "relatively" large amount of dynamic
-       resources (for several sub-rules), but they are not allocated
-       until the parsing starts, and it caches the rules on a
-       per-parser basis. Thus subsequent calls with the same parser
-       argument re-use the same object.
+       It uses the same scanner as PegcRule_int_dec and, like that
+       rule, stores the converted value for pegc_get_number_long().
     */
     bool PegcRule_mf_int_dec_strict( PegcRule const * self, pegc_parser * st );
 
     /**
        A rule object wrapping PegcRule_mf_int_dec_strict.
     */
-    const PegcRule PegcRule_int_dec_strict;
+    extern const PegcRule PegcRule_int_dec_strict;
 
     /**
        Similar to pegc_r_int_dec_strict(), but does not
@@ -1646,16 +2471,40 @@ extern "C" {
        will parse up to the 'd' and then stop, and match
        "12345".
 
-       Limitation: this type cannot parse numbers larger
-       than can be represented in a long int.
+       Leading whitespace is not skipped, and the scan never reads
+       past pegc_end(). The converted value is available via
+       pegc_get_number_long().
+
+       Limitation: values which do not fit in a long int are
+       saturated at LONG_MIN/LONG_MAX, like strtol() does.
 
        FIXME: use (long long) if C99 mode is enabled.
     */
     extern const PegcRule PegcRule_int_dec;
 
     /**
-       Matches a double-precision floating point number (or optinally
-       signed decimal integer), in all formats supported by sscanf().
+       Like PegcRule_int_dec, but matches an (optionally signed)
+       hexadecimal integer with a "0x" or "0X" prefix, e.g. "0x1F".
+    */
+    extern const PegcRule PegcRule_int_hex;
+
+    /**
+       Like PegcRule_int_dec, but matches an (optionally signed) octal
+       integer with a leading '0', e.g. "0755". A lone "0" matches.
+       Matching stops at the first non-octal digit.
+    */
+    extern const PegcRule PegcRule_int_oct;
+
+    /**
+       Matches a double-precision floating point number (or optionally
+       signed decimal integer): digits with an optional '.' and
+       fraction part (at least one digit overall), optionally followed
+       by an exponent part ("e10", "E-3"). A '.' is always the
+       decimal point, regardless of the current locale. Hex floats,
+       "inf", and "nan" are not matched.
+
+       The converted value is available via
+       pegc_get_number_double().
 
        See PegcRule_int_dec for notes about the lack of
        "tail checking".
@@ -1665,6 +2514,27 @@ extern "C" {
     */
     extern const PegcRule PegcRule_double;
 
+    /**
+       If m (or st's current match, if m is 0) is exactly the range
+       matched by the most recent run of one of the integer rules
+       (PegcRule_int_dec, PegcRule_int_hex, PegcRule_int_oct, or
+       PegcRule_int_dec_strict), this assigns the value of that
+       integer to *v (if v is not null) and returns true. Otherwise it
+       returns false.
+
+       This lets actions use the converted value without converting
+       the matched text again. Delayed actions see the value as it was
+       when the action was queued, so the match argument passed to an
+       action can be passed on as m in either case.
+    */
+    bool pegc_get_number_long( pegc_parser const * st, pegc_cursor const * m, long * v );
+
+    /**
+       Like pegc_get_number_long(), but also accepts the range matched
+       by PegcRule_double. Integer values are converted to double.
+    */
+    bool pegc_get_number_double( pegc_parser const * st, pegc_cursor const * m, double * v );
+
     /**
        A rule which matches only at EOF and never consumes.
     */
@@ -1767,8 +2637,9 @@ extern "C" {
 
     /**
        Allocates a new printf-style string on the heap. If st is not
-       null then the string is owned by st, otherwise the caller owns
-       it and must free it using free(). Returns 0 if fmt is 0 or the
+       null then the string is owned by st (it is stored via
+       pegc_alloc()), otherwise the caller owns it and must free it
+       using free(). Returns 0 if fmt is 0 or the
        result string is 0 bytes.
     */
     char * pegc_vmprintf( pegc_parser * st, char const * fmt, va_list args );
@@ -1807,6 +2678,16 @@ extern "C" {
 	   GC hashtable(s). See alloced for caveats.
 	*/
 	size_t gc_internals_alloced;
+	/**
+	   The number of times a memoized result was re-used instead
+	   of running a rule. See pegc_set_memo_mode().
+	*/
+	size_t memo_hits;
+	/**
+	   The number of times a rule eligible for memoization had to
+	   be run because no memoized result was available.
+	*/
+	size_t memo_misses;
     };
     typedef struct pegc_stats pegc_stats;
 
@@ -1819,8 +2700,9 @@ extern "C" {
        Unescapes an input string using a simple set of rules. Those
        rules are...
 
-       inp must be a 0-terminated string at least inlen bytes long.
-       If (inlen<0) then pegc_strlen() is used instead. inp must begin
+       inp must be at least inlen bytes long. It need not be
+       null-terminated unless (inlen<0), in which case pegc_strlen()
+       is used instead. inp must begin
        and end with the given quote character. Any such characters within
        the quoted string must be escaped by escChar, otherwise they will
        be interpretted as the end of the string.
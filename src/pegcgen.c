@@ -11,39 +11,26 @@
 #define MARKER printf("******** MARKER: %s:%d:\n",__FILE__,__LINE__);
 #endif
 
-PegcRule pg_r_literal( pegc_parser * p );
-PegcRule pg_r_larrow( pegc_parser * p );
 PegcRule pg_r_skipws( pegc_parser * p, PegcRule const R );
 
-static bool PG_mf_suffix( PegcRule const * self, pegc_parser * p );
-static const PegcRule PG_r_suffix = PEGCRULE_INIT1(PG_mf_suffix);
-//PegcRule pg_r_suffix() { return PG_r_suffix; }
-
-static bool PG_mf_primary( PegcRule const * self, pegc_parser * p );
-static const PegcRule PG_r_primary = PEGCRULE_INIT1(PG_mf_primary);
-//PegcRule pg_r_primary() { return PG_r_primary; }
-
-
-static bool PG_mf_semantic_action( PegcRule const * self, pegc_parser * p );
-static const PegcRule PG_r_semantic_action = PEGCRULE_INIT1(PG_mf_semantic_action);
-PegcRule pg_r_semantic_action( pegc_parser * p );
-
-bool PG_mf_char_class( PegcRule const * self, pegc_parser * p );
-static const PegcRule PG_r_char_class = PEGCRULE_INIT1(PG_mf_char_class);
-PegcRule pg_r_char_class();
-
-PegcRule pg_r_prefix();
-PegcRule pg_r_sequence();
-PegcRule pg_r_expr();
-bool PG_mf_expr( PegcRule const * self, pegc_parser * p );
-const PegcRule PG_r_expr = PEGCRULE_INIT1(PG_mf_expr);
-
-bool PG_mf_identifier( PegcRule const * self, pegc_parser * p );
-const PegcRule PG_r_identifier = PEGCRULE_INIT1(PG_mf_identifier);
-PegcRule pg_r_identifier();
-
-bool PG_mf_comment_cpp( PegcRule const * self, pegc_parser * p );
-const PegcRule PG_r_comment_cpp = PEGCRULE_INIT3(PG_mf_comment_cpp,0,"CommentCPP");
+/**
+   The grammar's non-trivial rules. They are forward references
+   (see pegc_r_ref()) so that they can refer to each other before
+   they are defined. pg_init_rules() creates and binds them.
+*/
+static struct PGRules
+{
+    PegcRule identifier;
+    PegcRule larrow;
+    PegcRule char_class;
+    PegcRule literal;
+    PegcRule primary;
+    PegcRule suffix;
+    PegcRule semantic_action;
+    PegcRule prefix;
+    PegcRule expr;
+    PegcRule comment_cpp;
+} PGRules;
 
 static struct PGApp
 {
@@ -170,7 +157,7 @@ static bool PG_ws( PegcRule const * self, pegc_parser * p )
     PegcRule const spaces = pegc_r_star_p(&PegcRule_space);
     spaces.rule(&spaces,p);
     pegc_const_iterator p1 = pegc_pos(p);
-    if( ! self->proxy->rule( self->proxy, p ) )
+    if( ! pegc_parse( p, self->proxy ) )
     {
 	/*
 	  We're gonna break a pegc prime rule here and possibly
@@ -204,70 +191,28 @@ PegcRule pg_r_skipws_p( pegc_parser * p, PegcRule const * R )
     return r;
 }
 
-bool PG_mf_identifier( PegcRule const * self, pegc_parser * p )
+/**
+   Identifier      <- < IdentStart IdentCont* > Spacing
+   IdentStart      <- [a-zA-Z_]
+   IdentCont       <- IdentStart / [0-9]
+*/
+static PegcRule pg_build_identifier( pegc_parser * p )
 {
-    //MARKER;
-    /*
-      Identifier      <- < IdentStart IdentCont* > Spacing
-      IdentStart      <- [a-zA-Z_]
-      IdentCont       <- IdentStart / [0-9]
-    */
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_identifier );
-    if( v )
-    {
-	r = (PegcRule *)v;
-    }
-    else
-    {
-#if 0
-#define cp pegc_copy_r_v
-	PegcRule const * idstart = &PG_alpha_uscor;
-	PegcRule const * subsequent = cp(p,pegc_r_or_ep(p,idstart,&PegcRule_digit,PG_endp));
-	PegcRule const * idcont = cp(p,pegc_r_star_p(subsequent));
-	PegcRule const * id = cp(p,pegc_r_and_ep(p, idstart, idcont, PG_endp));
-	PegcRule const * pad = cp(p,pg_r_skipws_p( p, id ));
-	//PegcRule const id = pegc_r_and_ev(p, idstart, idcont, PG_spacing, PG_end);
-	PegcRule * act = cp(p,pegc_r_action_i_p( p, pad, pg_test_action, "PG_mf_identifier()"));
-	r = act;
-	pegc_gc_register(p , (void *)PG_mf_identifier, 0, r, 0 );
-#undef cp
-#else
-	PegcRule const idstart = PG_alpha_uscor;
-	PegcRule const subsequent = pegc_r_or_ev(p,idstart,PegcRule_digit,PG_end);
-	PegcRule const idcont = pegc_r_star_v(p,subsequent);
-	PegcRule const id = pegc_r_and_ev(p, idstart, idcont, PG_end);
-	PegcRule const pad = pg_r_skipws( p, id );
-	//PegcRule const id = pegc_r_and_ev(p, idstart, idcont, PG_spacing, PG_end);
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "PG_mf_identifier()");
-	r = pegc_copy_r_v(p, act );
-	pegc_gc_register( p, (void *)PG_mf_identifier, 0, r, 0 );
-#endif
-	MARKER;printf("Created IDENTIFIER rule @%p w/ rule @%p()\n",r,r->rule);
-    }
-    if( r && r->rule ) return r->rule(r,p);
-    else return false;
+    PegcRule const idstart = PG_alpha_uscor;
+    PegcRule const subsequent = pegc_r_or_ev(p,idstart,PegcRule_digit,PG_end);
+    PegcRule const idcont = pegc_r_star_v(p,subsequent);
+    PegcRule const id = pegc_r_and_ev(p, idstart, idcont, PG_end);
+    PegcRule const pad = pg_r_skipws( p, id );
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_identifier()");
 }
 PegcRule pg_r_identifier()
 {
-    return PG_r_identifier;
+    return PGRules.identifier;
 }
 
 PegcRule pg_r_larrow( pegc_parser * p )
 {
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)pg_r_larrow );
-    if( v )
-    {
-	r = (PegcRule *)v;
-    }
-    else
-    {
-	r = pegc_copy_r_v( p, pg_r_skipws( p, PG_op_larrow ) );
-	pegc_gc_register( p, (void *)pg_r_larrow, 0, r, 0 );
-    }
-    if( r ) return *r;
-    else return PegcRule_invalid;
+    return PGRules.larrow;
 }
 
 /**
@@ -285,362 +230,276 @@ PegcRule pg_r_larrow( pegc_parser * p )
    Either way, it's likely to really play hacking with syntax
    highlighters.
 */
-bool PG_mf_char_class( PegcRule const * self, pegc_parser * p )
+static PegcRule pg_build_char_class( pegc_parser * p )
 {
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_char_class );
-    if( v )
-    {
-	r = (PegcRule*)v;
-    }
-    else
-    {
-	//const PegcRule empty = pegc_r_string("[]",true);
-	const PegcRule open1 = pegc_r_char( '[', true );
-	const PegcRule close = pegc_r_char( ']', true );
-	const PegcRule open2 = pegc_r_string( "^]", true );
-	const PegcRule notclose = pegc_r_notchar(']',true);
-	const PegcRule plus = pegc_r_plus_v( p, notclose );
-	const PegcRule star = pegc_r_star_v( p, notclose );
-	const PegcRule R =
-		 pegc_r_and_ev( p,
-			//pegc_r_notat_v(p,empty),
-			open1,
-			pegc_r_if_then_else_v(p,
-			      /* special cases: []...] and [^]...] */
-			      pegc_r_or_ev(p,
-					   open2,
-					   close,
-					   PG_end),
-			      pegc_r_opt_v(p,star),
-			      plus),
-			close,
-			PG_end );
-	PegcRule const pad = pg_r_skipws( p, R );
-#if 0
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "PG_mf_char_class()");
-	r = pegc_copy_r_v(p, act);
-#else
-	r = pegc_copy_r_v(p, pad);
-#endif
-	pegc_gc_register(p, (void*)PG_mf_char_class, 0, r, 0 );
-    }
-    if( r && r->rule ) return r->rule(r,p);
-    else return false;
-
+    //const PegcRule empty = pegc_r_string("[]",true);
+    const PegcRule open1 = pegc_r_char( '[', true );
+    const PegcRule close = pegc_r_char( ']', true );
+    const PegcRule open2 = pegc_r_string( "^]", true );
+    const PegcRule notclose = pegc_r_notchar(']',true);
+    const PegcRule plus = pegc_r_plus_v( p, notclose );
+    const PegcRule star = pegc_r_star_v( p, notclose );
+    const PegcRule R =
+	pegc_r_and_ev( p,
+		       //pegc_r_notat_v(p,empty),
+		       open1,
+		       pegc_r_if_then_else_v(p,
+			     /* special cases: []...] and [^]...] */
+			     pegc_r_or_ev(p,
+					  open2,
+					  close,
+					  PG_end),
+			     pegc_r_opt_v(p,star),
+			     plus),
+		       close,
+		       PG_end );
+    return pg_r_skipws( p, R );
 }
 /**
-   Returns PG_r_char_class.
+   Returns the character class rule.
 */
 PegcRule pg_r_char_class()
 {
-    return PG_r_char_class;
+    return PGRules.char_class;
+}
+
+/**
+   Single- and double-quoted strings.
+ */
+static PegcRule pg_build_literal( pegc_parser * p )
+{
+    PegcRule const pad =
+	pg_r_skipws( p,
+		     pegc_r_or_ev( p,
+				   pegc_r_string_quoted( p, '\'', '\\', 0 ),
+				   pegc_r_string_quoted( p, '"', '\\', 0 ),
+				   PG_end
+				   )
+		     );
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_literal()");
 }
 /**
    Parses single- and double-quoted strings.
  */
 PegcRule pg_r_literal( pegc_parser * p )
 {
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)pg_r_literal );
-    if( v )
-    {
-	r = (PegcRule*)v;
-    }
-    else
-    {
-	PegcRule const pad =
-	    pg_r_skipws( p,
-		 pegc_r_or_ev( p,
-		       pegc_r_string_quoted( p, '\'', '\\', 0 ),
-		       pegc_r_string_quoted( p, '"', '\\', 0 ),
-		       PG_end
-		   )
-	     );
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_literal()");
-	r = pegc_copy_r_v(p, act);
-	pegc_gc_register(p, (void*)pg_r_literal, 0, r, 0 );
-    }
-    if( r ) return *r;
-    else return PegcRule_invalid;
+    return PGRules.literal;
 }
-bool PG_mf_primary( PegcRule const * self, pegc_parser * p )
+
+/**
+   Primary         <- Identifier !LEFTARROW
+                    / OPEN Expression CLOSE
+                    / Literal
+                    / Class
+                    / DOT
+                    / Action
+                    / BEGIN
+                    / END
+*/
+static PegcRule pg_build_primary( pegc_parser * p )
 {
-    /**
-           Primary         <- Identifier !LEFTARROW
-                            / OPEN Expression CLOSE
-                            / Literal
-                            / Class
-                            / DOT
-                            / Action
-                            / BEGIN
-                            / END
-    */
-    //MARKER;
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_primary );
-    if( v )
-    {
-	r = (PegcRule*)v;
-	//MARKER;printf("CACHED OBJECT\n");
-    }
-    else
-    {
-	/**
-	   Because of the recursiveness of this rule, we have to
-	   allocate and register the new object before any of the sub rule
-	   are created. If we don't get get in an endless loop.
-	*/
-	r = pegc_alloc_r(p,0,0);
-	//MARKER;printf("REGISTERING r: @%p = @%p\n",PG_mf_primary,r);
-	pegc_gc_register(p, (void*)PG_mf_primary, 0, r, 0 );
-	
-	//MARKER;printf("NEW OBJECT\n");
-	PegcRule const iden =
-	    pegc_r_and_ev(p,
-			  pg_r_identifier(p),
-			  pegc_r_notat_v(p, pg_r_larrow(p)),
-			  PG_end );
-	PegcRule const expr =
-	    pg_r_skipws(p,
-	    pegc_r_and_ev(p,
-			  PG_op_popen,
-			  PG_spacing,
-			  PG_r_expr,
-			  PG_spacing,
-			  PG_op_pclose,
-			  PG_end
-			  ) );
-	PegcRule const R = pegc_r_or_ev( p,
-					 iden,
-					 expr,
-					 pg_r_literal(p),
-					 pg_r_char_class(p),
-					 PG_op_dot,
-					 PG_r_semantic_action,
-					 PG_end );
-	PegcRule const pad = pg_r_skipws(p, R);
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "PG_mf_primary()");
-	*r = act;
-    }
-    if( r && r->rule ) return r->rule(r,p);
-    else return false;
+    PegcRule const iden =
+	pegc_r_and_ev(p,
+		      pg_r_identifier(),
+		      pegc_r_notat_v(p, pg_r_larrow(p)),
+		      PG_end );
+    PegcRule const expr =
+	pg_r_skipws(p,
+	pegc_r_and_ev(p,
+		      PG_op_popen,
+		      PG_spacing,
+		      PGRules.expr,
+		      PG_spacing,
+		      PG_op_pclose,
+		      PG_end
+		      ) );
+    PegcRule const R = pegc_r_or_ev( p,
+				     iden,
+				     expr,
+				     pg_r_literal(p),
+				     pg_r_char_class(),
+				     PG_op_dot,
+				     PGRules.semantic_action,
+				     PG_end );
+    PegcRule const pad = pg_r_skipws(p, R);
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_primary()");
 }
 
-static bool PG_mf_suffix( PegcRule const * self, pegc_parser * p )
+/**
+   Suffix          <- Primary ( QUERY / STAR / PLUS )?
+*/
+static PegcRule pg_build_suffix( pegc_parser * p )
 {
-    /**
-       Suffix          <- Primary ( QUERY / STAR / PLUS )?
-    */
-    //MARKER;
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_suffix );
-    if( v )
-    {
-	r = (PegcRule*)v;
-    }
-    else
-    {
-	r = pegc_alloc_r(p,0,0);
-	pegc_gc_register(p, (void*)PG_mf_suffix, 0, r, 0 );
-
-	PegcRule const opt =
-	    pegc_r_opt_v( p,
-			  pegc_r_or_ev( p,
-					PG_op_opt,
-					PG_op_star,
-					PG_op_plus,
-					PG_end )
-			  );
-	PegcRule const R =
-	    pegc_r_and_ev(p,
-			  PG_r_primary,
-			  PG_spacing,
-			  opt,
-			  PG_end );
-	PegcRule const pad = pg_r_skipws(p, R);
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "PG_mf_suffix()");
-	*r = act;
-    }
-    if( r && r->rule ) return r->rule(r,p);
-    else return false;
+    PegcRule const opt =
+	pegc_r_opt_v( p,
+		      pegc_r_or_ev( p,
+				    PG_op_opt,
+				    PG_op_star,
+				    PG_op_plus,
+				    PG_end )
+		      );
+    PegcRule const R =
+	pegc_r_and_ev(p,
+		      PGRules.primary,
+		      PG_spacing,
+		      opt,
+		      PG_end );
+    PegcRule const pad = pg_r_skipws(p, R);
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_suffix()");
 }
 
-bool PG_mf_semantic_action( PegcRule const * self, pegc_parser * p )
+static PegcRule pg_build_semantic_action( pegc_parser * p )
 {
-    //MARKER;
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_semantic_action );
-    if( v )
-    {
-	r = (PegcRule*)v;
-    }
-    else
-    {
-	r = pegc_alloc_r(p,0,0);
-	pegc_gc_register(p, (void*)PG_mf_semantic_action, 0, r, 0 );
-	PegcRule const R =
-	    pegc_r_and_ev(p,
-			  PG_op_actopen,
-			  pegc_r_until_p(&PG_op_actclose),
-			  PG_end );
-	PegcRule const pad = pg_r_skipws( p, R );
-	PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_semantic_action()");
-	*r = act;
-    }
-    if( r && r->rule ) return r->rule(r,p);
-    else return false;
+    PegcRule const R =
+	pegc_r_and_ev(p,
+		      PG_op_actopen,
+		      pegc_r_until_p(&PG_op_actclose),
+		      PG_end );
+    PegcRule const pad = pg_r_skipws( p, R );
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_semantic_action()");
+}
+PegcRule pg_r_semantic_action( pegc_parser * p )
+{
+    return PGRules.semantic_action;
 }
 
-static bool PG_mf_prefix( PegcRule const * self, pegc_parser * p )
+static PegcRule pg_build_prefix( pegc_parser * p )
 {
-    //MARKER;
-    PegcRule * r = 0;
-    void * v = pegc_gc_search( p, (void const *)PG_mf_prefix );
-    if( v )
-    {
-	r = (PegcRule*)v;
-    }
-    else
-    {
-	r = pegc_alloc_r(p,0,0);
-	pegc_gc_register(p, (void*)PG_mf_prefix, 0, r, 0 );
-	PegcRule const at = PG_op_at;
-	PegcRule const not = PG_op_notat;
-	PegcRule const atact =
-	    pegc_r_and_ev( p,
-			   at,
-			   PG_spacing,
-			   PG_r_semantic_action,
-			   PG_end
-			   );
-	PegcRule const andornot =
-	    pegc_r_opt_v( p,
-			  pegc_r_or_ev( p,
-					at, not,
-					PG_end
-					)
-			  );
-	PegcRule const tail =
-	    pegc_r_and_ev(p,
-			  andornot,
-			  PG_spacing,
-			  PG_r_suffix,
-			  PG_end
-			  );
-	PegcRule const Prefix =
-	    pg_r_skipws(p,
-	    pegc_r_or_ev(p,
-			 atact,
-			 PG_spacing,
-			 tail,
-			 PG_end
-			 ));
-	PegcRule const act = pegc_r_action_i_v( p, Prefix, pg_test_action, "pg_r_prefix()");
-	*r = act;
-    }
-    if( r && r->rule ) return r->rule( r, p );
-    else return false;
+    PegcRule const at = PG_op_at;
+    PegcRule const not = PG_op_notat;
+    PegcRule const atact =
+	pegc_r_and_ev( p,
+		       at,
+		       PG_spacing,
+		       PGRules.semantic_action,
+		       PG_end
+		       );
+    PegcRule const andornot =
+	pegc_r_opt_v( p,
+		      pegc_r_or_ev( p,
+				    at, not,
+				    PG_end
+				    )
+		      );
+    PegcRule const tail =
+	pegc_r_and_ev(p,
+		      andornot,
+		      PG_spacing,
+		      PGRules.suffix,
+		      PG_end
+		      );
+    PegcRule const Prefix =
+	pg_r_skipws(p,
+	pegc_r_or_ev(p,
+		     atact,
+		     PG_spacing,
+		     tail,
+		     PG_end
+		     ));
+    return pegc_r_action_i_v( p, Prefix, pg_test_action, "pg_r_prefix()");
+}
+PegcRule pg_r_prefix()
+{
+    return PGRules.prefix;
 }
-static const PegcRule PG_r_prefix = PEGCRULE_INIT1(PG_mf_prefix);
 
 PegcRule pg_r_sequence()
 {
     //MARKER;
-    return pegc_r_star_p(&PG_r_prefix);
+    return pegc_r_star_p(&PGRules.prefix);
 }
 
-bool PG_mf_expr( PegcRule const * self, pegc_parser * p )
+static PegcRule pg_build_expr( pegc_parser * p )
 {
-   PegcRule * r = 0;
-   void * v = pegc_gc_search( p, (void const *)PG_mf_expr );
-   if( v )
-   {
-       r = (PegcRule*)v;
-   }
-   else
-   {
-       r = pegc_alloc_r(p,0,0);
-       pegc_gc_register(p, (void*)PG_mf_expr, 0, r, 0 );
-       PegcRule const seq = pg_r_sequence();
-       PegcRule const tail = 
-	   pegc_r_opt_v(p,
-			pegc_r_and_ev(p,
-				      pg_r_skipws(p,PG_op_or),
-				      seq,
-				      PG_end)
-			);
-       PegcRule const Expr =
-	   pegc_r_and_ev(p,
-			 seq,
-			 tail,
-			 PG_end);
-       PegcRule const pad = pg_r_skipws( p, Expr );
-       PegcRule const act = pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_expr()");
-       *r = act;
-   }
-   if( r && r->rule ) return r->rule(r,p);
-   else return false;
+    PegcRule const seq = pg_r_sequence();
+    PegcRule const tail =
+	pegc_r_opt_v(p,
+		     pegc_r_and_ev(p,
+				   pg_r_skipws(p,PG_op_or),
+				   seq,
+				   PG_end)
+		     );
+    PegcRule const Expr =
+	pegc_r_and_ev(p,
+		      seq,
+		      tail,
+		      PG_end);
+    PegcRule const pad = pg_r_skipws( p, Expr );
+    return pegc_r_action_i_v( p, pad, pg_test_action, "pg_r_expr()");
 }
 PegcRule pg_r_expr()
 {
-    return PG_r_expr;
-    //MARKER;
+    return PGRules.expr;
 }
 
-bool PG_mf_comment_cpp( PegcRule const * self, pegc_parser * p )
+static PegcRule pg_build_comment_cpp( pegc_parser * p )
 {
-   PegcRule * r = 0;
-   void * v = pegc_gc_search( p, (void const *)PG_mf_comment_cpp );
-   if( v )
-   {
-       r = (PegcRule*)v;
-   }
-   else
-   {
-       r = pegc_alloc_r(p,0,0);
-       pegc_gc_register(p, (void*)PG_mf_comment_cpp, 0, r, 0 );
-       PegcRule const open = pegc_r_string("/*",true);
-       PegcRule const atopen = pegc_r_at_v(p,open);
-       PegcRule const close = pegc_r_string("*/",true);
-       PegcRule const atclose = pegc_r_at_v(p,close);
-       PegcRule const err_opener = pegc_r_error_e(p,"Comment opener '/*' found inside a comment.");
-       PegcRule const err_eof = pegc_r_error_e(p,"EOF reached inside a comment block.");
-       // ^^^ i can't get err_eof to trigger... my rule's broke, apparently.
-
-       PegcRule const opencheck= 
-	   pegc_r_if_then_else_v(p,
-				 atopen,
-				 err_opener,
-				 PegcRule_success);
-       PegcRule const eofcheck = 
-	   pegc_r_if_then_else_v(p,
-				 PegcRule_eof,
-				 err_eof,
-				 PegcRule_success);
-       PegcRule const content =
-	   pegc_r_plus_v(p,
-           pegc_r_and_ev(p,
-			opencheck,
-			pegc_r_or_ev(p,
-				     atclose,
-				     pegc_r_and_ev(p,eofcheck,PegcRule_noteof,PG_end),
-				     PG_end ),
-			PG_end
-			)
-			 );
-       PegcRule const R =
-	   pg_r_skipws(p,
-	   pegc_r_and_ev(p,
-			 open,
-			 content,
-			 close,
-			 PG_end)
+    PegcRule const open = pegc_r_string("/*",true);
+    PegcRule const atopen = pegc_r_at_v(p,open);
+    PegcRule const close = pegc_r_string("*/",true);
+    PegcRule const atclose = pegc_r_at_v(p,close);
+    PegcRule const err_opener = pegc_r_error_e(p,"Comment opener '/*' found inside a comment.");
+    PegcRule const err_eof = pegc_r_error_e(p,"EOF reached inside a comment block.");
+    // ^^^ i can't get err_eof to trigger... my rule's broke, apparently.
+
+    PegcRule const opencheck=
+	pegc_r_if_then_else_v(p,
+			      atopen,
+			      err_opener,
+			      PegcRule_success);
+    PegcRule const eofcheck =
+	pegc_r_if_then_else_v(p,
+			      PegcRule_eof,
+			      err_eof,
+			      PegcRule_success);
+    PegcRule const content =
+	pegc_r_plus_v(p,
+	pegc_r_and_ev(p,
+		      opencheck,
+		      pegc_r_or_ev(p,
+				   atclose,
+				   pegc_r_and_ev(p,eofcheck,PegcRule_noteof,PG_end),
+				   PG_end ),
+		      PG_end
+		      )
+		      );
+    return pg_r_skipws(p,
+		       pegc_r_and_ev(p,
+				     open,
+				     content,
+				     close,
+				     PG_end)
 		       );
-       *r = R;
-   }
-   if( r && r->rule ) return r->rule(r,p);
-   else return false;
+}
+
+/**
+   Creates the forward references in PGRules, then binds each one to
+   its definition. Returns false on error.
+*/
+static bool pg_init_rules( pegc_parser * p )
+{
+#define REF(M,N) PGRules.M = pegc_r_ref( p, N ); if( ! PGRules.M.rule ) return false
+    REF(identifier,"PG_identifier");
+    REF(larrow,"PG_larrow");
+    REF(char_class,"PG_char_class");
+    REF(literal,"PG_literal");
+    REF(primary,"PG_primary");
+    REF(suffix,"PG_suffix");
+    REF(semantic_action,"PG_semantic_action");
+    REF(prefix,"PG_prefix");
+    REF(expr,"PG_expr");
+    REF(comment_cpp,"CommentCPP");
+#undef REF
+    return pegc_ref_bind( &PGRules.identifier, pg_build_identifier(p) )
+	&& pegc_ref_bind( &PGRules.larrow, pg_r_skipws( p, PG_op_larrow ) )
+	&& pegc_ref_bind( &PGRules.char_class, pg_build_char_class(p) )
+	&& pegc_ref_bind( &PGRules.literal, pg_build_literal(p) )
+	&& pegc_ref_bind( &PGRules.primary, pg_build_primary(p) )
+	&& pegc_ref_bind( &PGRules.suffix, pg_build_suffix(p) )
+	&& pegc_ref_bind( &PGRules.semantic_action, pg_build_semantic_action(p) )
+	&& pegc_ref_bind( &PGRules.prefix, pg_build_prefix(p) )
+	&& pegc_ref_bind( &PGRules.expr, pg_build_expr(p) )
+	&& pegc_ref_bind( &PGRules.comment_cpp, pg_build_comment_cpp(p) );
 }
 
 int a_test()
@@ -664,20 +523,20 @@ int a_test()
     pegc_set_input( P, src, -1 );
     
     PegcRule const Comment = pegc_r_action_i_p(P,
-					       &PG_r_comment_cpp, pg_test_action,
+					       &PGRules.comment_cpp, pg_test_action,
 					       "CPP-style comment");
 
 #if 0
     PegcRule const R = pegc_r_or_ep(P,
 				    &PG_spacing,
 				    &Comment,
-				    &PG_r_primary,
+				    &PGRules.primary,
 				    0);
 #else
     PegcRule const R = pegc_r_or_ev(P,
 				    Comment,
 				    PG_spacing,
-				    PG_r_primary,
+				    PGRules.primary,
 				    PG_end);
 #endif
     int rc = 0;
@@ -730,6 +589,11 @@ int main( int argc, char ** argv )
 	MARKER;printf("%s: ERROR: could not allocate parser and/or GC context!\n",argv[0]);
 	return 1;
     }
+    if( ! pg_init_rules( PGApp.P ) )
+    {
+	MARKER;printf("%s: ERROR: could not create the grammar rules!\n",argv[0]);
+	return 1;
+    }
     int i = 0;
     PGApp.argv0 = argv[0];
     if(0) for( i = 0; i < argc; ++i )
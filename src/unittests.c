@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #ifdef NDEBUG
 #undef NDEBUG
 #endif
@@ -12,7 +13,7 @@
 #include "whgc.h"
 #include "whclob.h"
 
-#define MARKER if(1) printf("MARKER: %s:%d:%s() ",__FILE__,__LINE__,__func__);if(1)printf
+#define MARKER printf("MARKER: %s:%d:%s() ",__FILE__,__LINE__,__func__),printf
 
 
 static struct ThisApp
@@ -147,7 +148,8 @@ int a_test()
     RULE at_a =
 	pegc_r_and_ev(P,
 		      space,
-		      pegc_r_at_p(&alpha));
+		      pegc_r_at_p(&alpha),
+		      end);
     RULE not_a = pegc_r_notat_p(&at_a);
     TEST1(not_a," *789*","");
     TEST1(at_a,"  a*789*","  ");
@@ -176,6 +178,1279 @@ int a_test()
     return 0;
 }
 
+int memo_test()
+{
+    MARKER("Testing memoization...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const word = pegc_r_plus_p(&PegcRule_alpha);
+    /* Both branches start with word, so the second branch re-runs it
+       at the same offset unless it is memoized. */
+    PegcRule const R = pegc_r_or_ev(P,
+				    pegc_r_and_ev(P, word, pegc_r_char(';',true), end),
+				    pegc_r_and_ev(P, word, pegc_r_char('!',true), end),
+				    end);
+    int rc = 0;
+    if( ! pegc_set_memo_mode(P, PEGC_MEMO_ALL) ) rc = 1;
+    if(!rc && !run_test(P,R,"memo_all","hello!","hello!",false)) rc = 2;
+    pegc_stats st = pegc_get_stats(P);
+    if( !rc && (1 > st.memo_hits) )
+    {
+	MARKER("Expected at least one memo hit!\n");
+	rc = 3;
+    }
+    if(!rc && !run_test(P,R,"memo_fail","hello?",0,true)) rc = 4;
+
+    pegc_set_memo_mode(P, PEGC_MEMO_SELECTED);
+    pegc_memoize_rule(P, &word);
+    size_t const hits = pegc_get_stats(P).memo_hits;
+    if(!rc && !run_test(P,R,"memo_selected","abc!","abc!",false)) rc = 5;
+    if( !rc && (hits + 1 != pegc_get_stats(P).memo_hits) )
+    {
+	MARKER("Expected exactly one memo hit for the selected rule!\n");
+	rc = 6;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+static bool count_action( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    ++*((int*)data);
+    return true;
+}
+
+int vm_test()
+{
+    MARKER("Testing compiled programs...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    int words = 0;
+    PegcRule const word = pegc_r_action_d_v(P, pegc_r_plus_p(&PegcRule_alpha), count_action, &words);
+    PegcRule const ws = pegc_r_star_p(&PegcRule_space);
+    /* group := word / '(' (ws group)* ws ')' */
+    PegcRule wsgroup = PegcRule_invalid;
+    PegcRule const items = pegc_r_star_p(&wsgroup);
+    PegcRule const group = pegc_r_or_ev(P,
+					word,
+					pegc_r_and_ev(P, pegc_r_char('(',true), items, ws, pegc_r_char(')',true), end),
+					end);
+    wsgroup = pegc_r_and_ev(P, ws, group, end);
+    PegcRule const num = pegc_r_repeat(P, &PegcRule_digit, 2, 3);
+    PegcRule const R = pegc_r_or_ev(P,
+				    pegc_r_and_ev(P, pegc_r_string("num:",false), num, PegcRule_eof, end),
+				    pegc_r_and_ev(P, pegc_r_notat_v(P, pegc_r_char('#',true)), group, end),
+				    pegc_r_and_ev(P, pegc_r_until_v(P, pegc_r_char(';',true)), PegcRule_eof, end),
+				    end);
+    pegc_program const * prog = pegc_compile(P, &R);
+    if( ! prog ) return 1;
+    MARKER("Compiled program has %u instructions.\n",(unsigned int)pegc_program_size(prog));
+    char const * inputs[] = {
+    "num:12", "NUM:1234", "NUM:123", "(ab (cd e) (f))", "(ab (cd e (f))",
+    "#comment;", "#comment", "()x", 0
+    };
+    int rc = 0;
+    int i = 0;
+    for( ; !rc && inputs[i]; ++i )
+    {
+	pegc_set_input(P, inputs[i], -1);
+	words = 0;
+	bool const native = pegc_parse(P, &R);
+	pegc_const_iterator const npos = pegc_pos(P);
+	int const nwords = (pegc_trigger_actions(P), words);
+	pegc_clear_actions(P);
+
+	pegc_set_input(P, inputs[i], -1);
+	words = 0;
+	bool const vm = pegc_parse_program(P, prog);
+	pegc_trigger_actions(P);
+	pegc_clear_actions(P);
+	if( (native != vm) || (npos != pegc_pos(P)) || (nwords != words) )
+	{
+	    MARKER("Program result differs from native rule for input [%s]: "
+		   "native=%d/%u/%d, program=%d/%u/%d\n",
+		   inputs[i],
+		   native, (unsigned int)(npos - inputs[i]), nwords,
+		   vm, (unsigned int)(pegc_pos(P) - inputs[i]), words );
+	    rc = 2;
+	}
+    }
+    PegcRule const PR = pegc_r_program(prog);
+    if(!rc && !run_test(P,PR,"program","(a (b))","(a (b))",false)) rc = 3;
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Returns a malloc()'d string of n '(' chars, followed by "a",
+   followed by n ')' chars.
+*/
+static char * nested_parens( size_t n )
+{
+    char * s = (char *)malloc( n * 2 + 2 );
+    if( ! s ) return 0;
+    memset( s, '(', n );
+    s[n] = 'a';
+    memset( s + n + 1, ')', n );
+    s[n * 2 + 1] = 0;
+    return s;
+}
+
+int depth_test()
+{
+    MARKER("Testing the depth limit...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    /* group := 'a' / '(' group ')' */
+    PegcRule group = PegcRule_invalid;
+    PegcRule const inner = pegc_r_plus_p(&group);
+    group = pegc_r_or_ev(P,
+			 pegc_r_char('a',true),
+			 pegc_r_and_ev(P, pegc_r_char('(',true), inner, pegc_r_char(')',true), end),
+			 end);
+    pegc_program const * prog = pegc_compile(P, &group);
+    int rc = 0;
+    char * deep = nested_parens( 100000 );
+    if( ! deep || ! prog ) rc = 1;
+
+    /* Native rules must fail cleanly instead of overflowing the C stack. */
+    if( !rc ) pegc_set_input(P, deep, -1);
+    if( !rc && (pegc_parse(P, &group) || !pegc_has_error(P)) )
+    {
+	MARKER("Expected the depth limit to be hit!\n");
+	rc = 2;
+    }
+    if( !rc )
+    {
+	MARKER("Parser says: %s\n", pegc_get_error(P,0,0));
+    }
+
+    /* The program's stack lives on the heap, so it can go deeper. */
+    pegc_set_depth_limit(P, 0);
+    if( !rc ) pegc_set_input(P, deep, -1);
+    if( !rc && (!pegc_parse_program(P, prog) || !pegc_eof(P)) )
+    {
+	MARKER("Compiled program failed on deeply nested input: %s\n", pegc_get_error(P,0,0));
+	rc = 3;
+    }
+    /* ...and its stack is re-used across parses. */
+    size_t const alloced = pegc_get_stats(P).alloced;
+    if( !rc ) pegc_set_input(P, deep, -1);
+    if( !rc && (!pegc_parse_program(P, prog) || (alloced != pegc_get_stats(P).alloced)) )
+    {
+	MARKER("Expected the program stack to be re-used!\n");
+	rc = 4;
+    }
+    pegc_set_depth_limit(P, 1000);
+    if( !rc ) pegc_set_input(P, deep, -1);
+    if( !rc && (pegc_parse_program(P, prog) || !pegc_has_error(P)) )
+    {
+	MARKER("Expected the depth limit to be hit by the program!\n");
+	rc = 5;
+    }
+    free( deep );
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+struct calc_stack
+{
+    long v[32];
+    int n;
+};
+
+static bool calc_push( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    struct calc_stack * c = (struct calc_stack *)data;
+    if( c->n >= 32 ) return false;
+    c->v[c->n++] = strtol( m->begin, 0, 10 );
+    return true;
+}
+
+static bool calc_sub( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    struct calc_stack * c = (struct calc_stack *)data;
+    if( c->n < 2 ) return false;
+    --c->n;
+    c->v[c->n-1] -= c->v[c->n];
+    return true;
+}
+
+int leftrec_test()
+{
+    MARKER("Testing left recursion...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    struct calc_stack calc;
+    /* Expr <- Expr '-' Num / Num */
+    PegcRule const num = pegc_r_action_d_v(P, PegcRule_digits, calc_push, &calc);
+    PegcRule expr;
+    PegcRule const Expr = pegc_r_leftrec(&expr);
+    expr = pegc_r_or_ev(P,
+			pegc_r_action_d_v(P,
+					  pegc_r_and_ev(P, Expr, pegc_r_char('-',true), num, end),
+					  calc_sub, &calc),
+			num,
+			end);
+    pegc_program const * prog = pegc_compile(P, &Expr);
+    int rc = 0;
+    int i = 0;
+    for( ; !rc && (i < 3); ++i )
+    {
+	pegc_set_memo_mode(P, (1 == i) ? PEGC_MEMO_ALL : PEGC_MEMO_OFF);
+	pegc_set_input(P, "10-3-2", -1);
+	calc.n = 0;
+	bool const ok = (2 == i) ? pegc_parse_program(P, prog) : pegc_parse(P, &Expr);
+	if( !ok || !pegc_eof(P) )
+	{
+	    MARKER("Left-recursive rule did not match all input (pass #%d).\n", i);
+	    rc = 1;
+	}
+	else if( !pegc_trigger_actions(P) || (1 != calc.n) || (5 != calc.v[0]) )
+	{
+	    MARKER("Expected (10-3)-2 == 5 but got %ld (pass #%d).\n", calc.n ? calc.v[0] : -1L, i);
+	    rc = 2;
+	}
+	pegc_clear_actions(P);
+    }
+
+    /* Indirect: A <- B 'x' / 'y', B <- A */
+    PegcRule a;
+    PegcRule const A = pegc_r_leftrec(&a);
+    PegcRule const B = pegc_r_and_ev(P, A, end);
+    a = pegc_r_or_ev(P,
+		     pegc_r_and_ev(P, B, pegc_r_char('x',true), end),
+		     pegc_r_char('y',true),
+		     end);
+    pegc_set_memo_mode(P, PEGC_MEMO_OFF);
+    if(!rc && !run_test(P,A,"indirect_leftrec","yxxx","yxxx",false)) rc = 3;
+    if(!rc && !run_test(P,A,"indirect_leftrec_fail","xy",0,true)) rc = 4;
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int optimize_test()
+{
+    MARKER("Testing the optimizer...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const R = pegc_r_and_ev(P,
+				     pegc_r_opt_v(P, pegc_r_and_ev(P, pegc_r_char('a',true), pegc_r_char('b',true), end)),
+				     pegc_r_or_ev(P,
+						  pegc_r_char('x',true),
+						  pegc_r_or_ev(P, pegc_r_char('y',true), pegc_r_oneof("z",true), end),
+						  pegc_r_char_range('0','3'),
+						  end),
+				     pegc_r_char('-',true),
+				     pegc_r_string("cd",true),
+				     pegc_r_star_v(P, pegc_r_star_p(&PegcRule_alpha)),
+				     end);
+    PegcRule O = R;
+    size_t const removed = pegc_optimize(P, &O);
+    int rc = 0;
+    if( 9 != removed )
+    {
+	MARKER("Expected the optimizer to remove 9 rules, not %u.\n", (unsigned int)removed);
+	rc = 1;
+    }
+    char const * inputs[] = {
+    "ab1-cdxyz", "x-cd", "ab5-cd", "z-cdq", "aby-c", "3-cd9", 0
+    };
+    int i = 0;
+    for( ; !rc && inputs[i]; ++i )
+    {
+	pegc_set_input(P, inputs[i], -1);
+	bool const before = pegc_parse(P, &R);
+	pegc_const_iterator const pos = pegc_pos(P);
+	pegc_set_input(P, inputs[i], -1);
+	if( (before != pegc_parse(P, &O)) || (pos != pegc_pos(P)) )
+	{
+	    MARKER("Optimized rule behaves differently for input [%s].\n", inputs[i]);
+	    rc = 2;
+	}
+    }
+    if(!rc && !run_test(P,O,"optimized","ab1-cdxyz","ab1-cdxyz",false)) rc = 3;
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int dispatch_test()
+{
+    MARKER("Testing OR dispatch tables...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const alts[] = {
+    pegc_r_string("if",true),
+    pegc_r_string("else",true),
+    pegc_r_string("WHILE",false),
+    /* nullable first element: FIRST is {'_', 'e'} */
+    pegc_r_and_ev(P, pegc_r_opt_v(P, pegc_r_char('_',true)), pegc_r_char('e',true), end),
+    pegc_r_plus_p(&PegcRule_digit),
+    /* unknown FIRST set: candidate for every byte */
+    PegcRule_int_dec,
+    pegc_r_star_p(&PegcRule_alpha),
+    end
+    };
+    PegcRule const plain = pegc_r_list_a(true, alts);
+    PegcRule const disp = pegc_r_or_dispatch(P, alts);
+    char const * inputs[] = {
+    "if", "else", "eat", "_e", "_x", "while", "WhIlE", "123", "-12", "+", "xyz", "!", 0
+    };
+    int rc = 0;
+    int i = 0;
+    for( ; !rc && inputs[i]; ++i )
+    {
+	pegc_set_input(P, inputs[i], -1);
+	bool const a = pegc_parse(P, &plain);
+	pegc_const_iterator const pos = pegc_pos(P);
+	pegc_set_input(P, inputs[i], -1);
+	if( (a != pegc_parse(P, &disp)) || (pos != pegc_pos(P)) )
+	{
+	    MARKER("Dispatching OR behaves differently for input [%s].\n", inputs[i]);
+	    rc = 1;
+	}
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int charclass_test()
+{
+    MARKER("Testing character classes...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    int rc = 0;
+    PegcRule const ident = pegc_r_plus_v(P, pegc_r_charclass(P, "[a-zA-Z_]"));
+    PegcRule const unquoted = pegc_r_plus_v(P, pegc_r_charclass(P, "[^\"\\\\]"));
+    PegcRule const sign = pegc_r_charclass(P, "[-+\\x30]");
+    PegcRule const bracket = pegc_r_charclass(P, "[]\\n]");
+    if(!rc && !run_test(P,ident,"ident","foo_Bar9","foo_Bar",false)) rc = 1;
+    if(!rc && !run_test(P,unquoted,"unquoted","ab c\"d","ab c",false)) rc = 2;
+    if(!rc && !run_test(P,sign,"sign","-1","-",false)) rc = 3;
+    if(!rc && !run_test(P,sign,"sign_zero","0","0",false)) rc = 4;
+    if(!rc && !run_test(P,sign,"sign_fail","1",0,true)) rc = 5;
+    if(!rc && !run_test(P,bracket,"bracket","]","]",false)) rc = 6;
+    if(!rc && !run_test(P,bracket,"bracket_nl","\n","\n",false)) rc = 7;
+    if( !rc )
+    { /* bytes >= 0x80 must match the same way natively and compiled. */
+	PegcRule const hi = pegc_r_or_ev(P,
+					 pegc_r_char_range((pegc_char_t)0xc0, (pegc_char_t)0x80),
+					 pegc_r_oneof("\xe4\xf6", false),
+					 pegc_r_notchar((pegc_char_t)0xff, false),
+					 PegcRule_invalid);
+	pegc_program const * prog = pegc_compile(P, &hi);
+	char const * inputs[] = { "\x80", "\xc0", "\xc1", "\xe4", "\xff", 0 };
+	bool const expect[] = { true, true, true, true, false };
+	int i = 0;
+	for( ; !rc && inputs[i]; ++i )
+	{
+	    pegc_set_input(P, inputs[i], -1);
+	    bool const native = pegc_parse(P, &hi);
+	    pegc_set_input(P, inputs[i], -1);
+	    bool const vm = prog ? pegc_parse_program(P, prog) : !native;
+	    if( (native != expect[i]) || (vm != expect[i]) )
+	    {
+		MARKER("High byte #%d: native=%d, program=%d, expecting %d.\n",
+		       i, native, vm, expect[i]);
+		rc = 9;
+	    }
+	}
+    }
+    if( !rc )
+    { /* char_spec keeps the old sscanf() syntax: no escapes. */
+	PegcRule const nobs = pegc_r_char_spec(P, "[^\\]");
+	PegcRule const bs = pegc_r_char_spec(P, "[\\n]");
+	if( ! nobs.rule || ! bs.rule ) rc = 10;
+	else if( !run_test(P,nobs,"spec_nobs","x","x",false)
+		 || !run_test(P,nobs,"spec_nobs_fail","\\",0,true)
+		 || !run_test(P,bs,"spec_bs","\\n","\\",false)
+		 || !run_test(P,bs,"spec_bs_nl","\n",0,true) ) rc = 11;
+    }
+    if( !rc && (pegc_r_charclass(P, "[a-").rule
+		|| pegc_r_charclass(P, "[z-a]").rule
+		|| pegc_r_charclass(P, "abc").rule) )
+    {
+	MARKER("Malformed class specs should be rejected!\n");
+	rc = 8;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Runs R against input and checks that it consumes exactly n bytes.
+*/
+static bool span_check( pegc_parser * P, PegcRule const * R, char const * input, size_t n )
+{
+    pegc_set_input(P, input, -1);
+    bool const rc = pegc_parse(P, R);
+    size_t const got = pegc_pos(P) - input;
+    if( (rc != (n > 0)) || (got != n) )
+    {
+	MARKER("Expected a %u-byte run but got %u.\n", (unsigned int)n, (unsigned int)got);
+	return false;
+    }
+    return true;
+}
+
+int span_test()
+{
+    MARKER("Testing runs of single-byte rules...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    enum { Len = 200 };
+    char buf[Len + 2];
+    PegcRule const spaces = pegc_r_plus_p(&PegcRule_space);
+    PegcRule const notq = pegc_r_plus_v(P, pegc_r_notchar('"',true));
+    /* too many ranges for the SIMD kernels */
+    PegcRule const odd = pegc_r_plus_v(P, pegc_r_oneof("acegikmoqsuwy",true));
+    PegcRule const rep = pegc_r_repeat(P, &PegcRule_digit, 3, 50);
+    int rc = 0;
+    size_t n = 0;
+    for( ; !rc && (n < Len); n += 7 )
+    {
+	memset( buf, ' ', n );
+	buf[n] = 'x';
+	buf[n+1] = 0;
+	if( ! span_check(P, &spaces, buf, n) ) rc = 1;
+	memset( buf, 'q', n );
+	buf[n] = '"';
+	if( !rc && ! span_check(P, &notq, buf, n) ) rc = 2;
+	memset( buf, 'm', n );
+	buf[n] = 'b';
+	if( !rc && ! span_check(P, &odd, buf, n) ) rc = 3;
+	memset( buf, '7', n );
+	buf[n] = 'x';
+	if( !rc && ! span_check(P, &rep, buf, (n < 3) ? 0 : ((n > 50) ? 50 : n)) ) rc = 4;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int until_test()
+{
+    MARKER("Testing until() rules...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const endc = pegc_r_until_v(P, pegc_r_string("*/",true));
+    PegcRule const eol = pegc_r_until_v(P, pegc_r_oneof("\r\n",true));
+    /* Only skips to digits. */
+    PegcRule const seq = pegc_r_until_v(P, pegc_r_and_ev(P, PegcRule_digit, PegcRule_alpha, PegcRule_invalid));
+    int rc = 0;
+    if( ! span_check(P, &endc, "a * b ** c */ d", 13) ) rc = 1;
+    if( !rc && ! span_check(P, &endc, "a * b ** c * / d", 0) ) rc = 2;
+    if( !rc && ! span_check(P, &endc, "*/", 2) ) rc = 3;
+    if( !rc && ! span_check(P, &eol, "hello, world\nbye", 13) ) rc = 4;
+    if( !rc && ! span_check(P, &seq, "abc 12 3x yz", 9) ) rc = 5;
+    if( !rc )
+    { /* NUL bytes are ordinary input */
+	char const in[] = "ab\0*/";
+	pegc_set_input(P, in, sizeof(in) - 1);
+	if( ! pegc_parse(P, &endc) ) rc = 6;
+	else if( pegc_pos(P) != (in + 5) ) rc = 7;
+    }
+    if( !rc )
+    {
+	enum { Len = 100000 };
+	char * buf = (char *)malloc( Len + 3 );
+	memset( buf, '*', Len );
+	memcpy( buf + Len, "*/", 3 );
+	if( ! span_check(P, &endc, buf, Len + 2) ) rc = 8;
+	memset( buf, 'x', Len );
+	if( !rc && ! span_check(P, &endc, buf, Len + 2) ) rc = 9;
+	free( buf );
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Checks that R matches exactly the first n bytes of input and that
+   the converted value is v.
+*/
+static bool number_check( pegc_parser * P, PegcRule const * R, char const * input,
+			  size_t n, double v )
+{
+    if( ! span_check(P, R, input, n) ) return false;
+    double got = 0.0;
+    if( n && ! (pegc_get_number_double(P, 0, &got) && (got == v)) )
+    {
+	MARKER("Expected %g from [%s] but got %g.\n", v, input, got);
+	return false;
+    }
+    return true;
+}
+
+static bool sum_action( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    long v = 0;
+    if( ! pegc_get_number_long(st, m, &v) ) return false;
+    *((long*)data) += v;
+    return true;
+}
+
+int number_test()
+{
+    MARKER("Testing number rules...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    int rc = 0;
+    if( ! number_check(P, &PegcRule_int_dec, "-1234x", 5, -1234) ) rc = 1;
+    if( !rc && ! number_check(P, &PegcRule_int_dec, " 12", 0, 0) ) rc = 2;
+    if( !rc && ! number_check(P, &PegcRule_int_dec, "99999999999999999999999", 23, (double)LONG_MAX) ) rc = 3;
+    if( !rc && ! number_check(P, &PegcRule_int_hex, "0x1fG", 4, 31) ) rc = 4;
+    if( !rc && ! number_check(P, &PegcRule_int_hex, "0x", 0, 0) ) rc = 5;
+    if( !rc && ! number_check(P, &PegcRule_int_oct, "0758", 3, 61) ) rc = 6;
+    if( !rc && ! number_check(P, &PegcRule_int_oct, "75", 0, 0) ) rc = 7;
+    if( !rc && ! number_check(P, &PegcRule_int_dec_strict, "42;", 2, 42) ) rc = 8;
+    if( !rc && ! number_check(P, &PegcRule_int_dec_strict, "42.", 0, 0) ) rc = 9;
+    if( !rc && ! number_check(P, &PegcRule_double, "3.25e2x", 6, 325.0) ) rc = 10;
+    if( !rc && ! number_check(P, &PegcRule_double, "-.5e", 3, -0.5) ) rc = 11;
+    if( !rc && ! number_check(P, &PegcRule_double, "0.1", 3, 0.1) ) rc = 12;
+    if( !rc && ! number_check(P, &PegcRule_double, "1.7976931348623157e308", 22, 1.7976931348623157e308) ) rc = 13;
+    if( !rc && ! number_check(P, &PegcRule_double, "123456789012345678901234567890", 30, 123456789012345678901234567890.0) ) rc = 14;
+    if( !rc && ! number_check(P, &PegcRule_double, ".", 0, 0) ) rc = 15;
+    if( !rc )
+    { /* the scan must stop at the end of the input range */
+	pegc_set_input(P, "12345", 3);
+	long v = 0;
+	if( ! pegc_parse(P, &PegcRule_int_dec) || ! pegc_get_number_long(P, 0, &v) || (123 != v) ) rc = 16;
+    }
+    if( !rc )
+    { /* delayed actions see the value from when they were queued */
+	long sum = 0;
+	PegcRule const num = pegc_r_action_d_v(P, PegcRule_int_dec, sum_action, &sum);
+	PegcRule const R = pegc_r_and_ev(P, num, pegc_r_plus_v(P, pegc_r_and_ev(P, pegc_r_char(',',true), num, end)),
+					 PegcRule_eof, end);
+	pegc_set_input(P, "1,20,-300", -1);
+	if( ! pegc_parse(P, &R) || ! pegc_trigger_actions(P) || (-279 != sum) ) rc = 17;
+	pegc_clear_actions(P);
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int slice_test()
+{
+    MARKER("Testing non-terminated input with embedded NULs...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    /* A slice whose following bytes must never be read. */
+    char const in[] = { 'a', '\0', 'b', '\xe9', '"', 'x', '\0', '"', 'Z', 'Z' };
+    long const len = 8;
+    char * qs = 0;
+    PegcRule const R = pegc_r_and_ev(P,
+				     pegc_r_string("a",true),
+				     pegc_r_char('\0',true),
+				     pegc_r_notchar('"',true),
+				     pegc_r_char('\xe9',true),
+				     pegc_r_string_quoted(P,'"','\\',&qs),
+				     PegcRule_eof,
+				     end);
+    PegcRule const cc = pegc_r_plus_v(P, pegc_r_charclass(P, "[^\"]"));
+    int rc = 0;
+    pegc_set_input(P, in, len);
+    if( ! pegc_parse(P, &R) || (pegc_pos(P) != in + len) ) rc = 1;
+    else if( ! qs || ('x' != qs[0]) || ('\0' != qs[1]) ) rc = 2;
+    if( !rc && ! pegc_parse(P, &PegcRule_eof) ) rc = 3;
+    if( !rc )
+    {
+	pegc_set_input(P, in, len);
+	if( ! pegc_parse(P, &cc) || (pegc_pos(P) != in + 4) ) rc = 4;
+    }
+    if( !rc )
+    { /* a string which would match past the end must not */
+	pegc_set_input(P, in + 7, 2);
+	PegcRule const s = pegc_r_string("\"ZZ",true);
+	if( pegc_parse(P, &s) ) rc = 5;
+	else if( ! pegc_matches_string(P, "\"Z", 2, true) ) rc = 6;
+	pegc_set_input(P, in + 6, 3);
+	if( !rc && ! pegc_matches_string(P, "\0\"Z", 3, true) ) rc = 6;
+    }
+    if( !rc )
+    {
+	pegc_set_input(P, in, 2);
+	pegc_iterator str = 0;
+	PegcRule const any = pegc_r_plus_p(&PegcRule_noteof);
+	if( ! pegc_parse(P, &any) ) rc = 7;
+	else if( ! (str = pegc_get_match_string(P)) || ('a' != str[0]) || ('\0' != str[1]) ) rc = 8;
+	free( str );
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int file_test()
+{
+    MARKER("Testing file input...\n");
+    char const * fn = "unittests.tmp";
+    char const content[] = "abc\0def";
+    FILE * fp = fopen( fn, "wb" );
+    if( ! fp ) return 1;
+    fwrite( content, 1, sizeof(content) - 1, fp );
+    fclose( fp );
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser_from_file( fn );
+    PegcRule const R = pegc_r_and_ev(P, pegc_r_string("abc",true),
+				     pegc_r_char('\0',true),
+				     pegc_r_string("def",true),
+				     PegcRule_eof,
+				     PegcRule_invalid);
+    if( ! P ) rc = 2;
+    else if( (pegc_end(P) - pegc_begin(P)) != (long)(sizeof(content) - 1) ) rc = 3;
+    else if( ! pegc_parse(P, &R) ) rc = 4;
+    pegc_destroy_parser(P);
+    remove( fn );
+    if( !rc && pegc_create_parser_from_file( fn ) ) rc = 5;
+    if( !rc )
+    { /* not a regular file: uses the read loop */
+	P = pegc_create_parser_from_file( "/dev/null" );
+	if( P && ! pegc_eof(P) ) rc = 6;
+	pegc_destroy_parser(P);
+    }
+    return rc;
+}
+
+int stream_test()
+{
+    MARKER("Testing streamed input...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    long sum = 0;
+    PegcRule const num = pegc_r_action_d_v(P, PegcRule_int_dec, sum_action, &sum);
+    /* line := [a-z]+ '=' int '\n' */
+    PegcRule const line = pegc_r_and_ev(P,
+					pegc_r_plus_v(P, pegc_r_charclass(P, "[a-z]")),
+					pegc_r_char('=',true),
+					num,
+					pegc_r_char('\n',true),
+					end);
+    enum { Lines = 1000 };
+    char text[32];
+    char const * all = 0;
+    size_t maxRetained = 0;
+    int rc = 0;
+    int i = 0;
+    if( ! pegc_stream_begin(P, &line) ) rc = 1;
+    for( ; !rc && (i < Lines); ++i )
+    {
+	sprintf( text, "%s=%d\n", (i & 1) ? "abc" : "x", i );
+	/* feed it in uneven pieces which split tokens */
+	all = text;
+	while( !rc && *all )
+	{
+	    size_t const left = strlen(all);
+	    size_t const n = (size_t)(i % 4) + 1;
+	    size_t const chunk = (n < left) ? n : left;
+	    if( ! pegc_feed(P, all, (long)chunk) ) rc = 2;
+	    all += chunk;
+	    if( pegc_stream_retained(P) > maxRetained ) maxRetained = pegc_stream_retained(P);
+	}
+    }
+    if( !rc && (sum != (long)(Lines * (Lines - 1) / 2)) ) rc = 3;
+    if( !rc && (pegc_stream_retained(P) > 1) ) rc = 4;
+    if( !rc && ! pegc_stream_end(P) ) rc = 5;
+    if( !rc && (maxRetained > 2 * sizeof(text)) )
+    {
+	MARKER("Stream retained up to %u bytes.\n", (unsigned int)maxRetained);
+	rc = 6;
+    }
+    if( !rc )
+    { /* a bad item is an error, reported with its stream offset */
+	char const * msg = 0;
+	pegc_stream_begin(P, &line);
+	if( ! pegc_feed(P, "a=1\nbb=2\n", -1) ) rc = 7;
+	else if( pegc_feed(P, "c=x\n", -1) ) rc = 8;
+	else if( ! (msg = pegc_get_error(P, 0, 0)) || ! strstr(msg, "offset 9") ) rc = 9;
+	else if( pegc_feed(P, "d=4\n", -1) ) rc = 10;
+    }
+    if( !rc )
+    { /* a partial item at the end of the stream is an error */
+	pegc_stream_begin(P, &line);
+	if( ! pegc_feed(P, "a=1\nb=", -1) ) rc = 11;
+	else if( pegc_stream_end(P) ) rc = 12;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Parses input with P (whose memo table is left over from an earlier
+   parse, if any) and checks that it gives the same result as a
+   fresh parser would. Returns the number of memo misses it took, or
+   -1 on a mismatch.
+*/
+static long edit_check( pegc_parser * P, PegcRule const * r, char const * input )
+{
+    pegc_parser * F = pegc_create_parser( input, -1 );
+    pegc_set_memo_mode(F, PEGC_MEMO_ALL);
+    size_t const misses = pegc_get_stats(P).memo_misses;
+    bool const rc = pegc_parse(P, r);
+    bool const frc = pegc_parse(F, r);
+    long ret = (long)(pegc_get_stats(P).memo_misses - misses);
+    if( (rc != frc) || ((pegc_pos(P) - input) != (pegc_pos(F) - input)) )
+    {
+	MARKER("Incremental parse differs from a full one for [%s]!\n", input);
+	ret = -1;
+    }
+    else if( (long)pegc_get_stats(F).memo_misses < ret )
+    {
+	MARKER("Incremental parse took more misses than a full one!\n");
+	ret = -1;
+    }
+    pegc_destroy_parser(F);
+    return ret;
+}
+
+int edit_test()
+{
+    MARKER("Testing incremental re-parsing...\n");
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const word = pegc_r_plus_p(&PegcRule_alpha);
+    /* item := word '=' (word ';' / word '!') */
+    PegcRule const item = pegc_r_and_ev(P,
+					word,
+					pegc_r_char('=',true),
+					pegc_r_or_ev(P,
+						     pegc_r_and_ev(P, word, pegc_r_char(';',true), end),
+						     pegc_r_and_ev(P, word, pegc_r_char('!',true), end),
+						     end),
+					end);
+    PegcRule const R = pegc_r_and_ev(P, pegc_r_plus_p(&item), PegcRule_eof, end);
+    enum { Items = 200 };
+    char a[Items * 8 + 16];
+    char b[sizeof(a)];
+    char * p = a;
+    int rc = 0;
+    int i = 0;
+    for( ; i < Items; ++i )
+    {
+	p += sprintf( p, "k%c=v%c%c", 'a' + (i % 26), 'a' + (i % 7), (i & 1) ? ';' : '!' );
+    }
+    size_t const len = p - a;
+    size_t const mid = len / 2;
+    long full = 0;
+    long n = 0;
+    pegc_set_memo_mode(P, PEGC_MEMO_ALL);
+    pegc_set_input(P, a, -1);
+    if( (full = edit_check(P, &R, a)) <= 0 ) rc = 1;
+    /* grow a value in the middle: "v" => "vxyz" */
+    p = strchr( a + mid, 'v' );
+    size_t const off = p - a + 1;
+    memcpy( b, a, off );
+    memcpy( b + off, "xyz", 3 );
+    strcpy( b + off + 3, a + off );
+    if( !rc && ! pegc_edit_input(P, b, -1, off, 0, 3) ) rc = 2;
+    if( !rc && ((n = edit_check(P, &R, b)) < 0) ) rc = 3;
+    if( !rc && (n * 4 > full) )
+    {
+	MARKER("Re-parse took %ld memo misses, the full parse %ld.\n", n, full);
+	rc = 4;
+    }
+    /* break it: "vxyz" => "vx?z", then change it back to "vxyz" */
+    strcpy( a, b );
+    a[off + 1] = '?';
+    if( !rc && ! pegc_edit_input(P, a, -1, off + 1, 1, 1) ) rc = 5;
+    if( !rc && (edit_check(P, &R, a) < 0) ) rc = 6;
+    if( !rc && pegc_parse(P, &R) ) rc = 7;
+    if( !rc && ! pegc_edit_input(P, b, -1, off + 1, 1, 1) ) rc = 8;
+    if( !rc && (edit_check(P, &R, b) < 0) ) rc = 9;
+    /* remove the first item and append one */
+    strcpy( a, b + 6 );
+    if( !rc && ! pegc_edit_input(P, a, -1, 0, 6, 0) ) rc = 10;
+    strcpy( b, a );
+    strcat( b, "kz=vz;" );
+    if( !rc && ! pegc_edit_input(P, b, -1, strlen(b) - 6, 0, 6) ) rc = 11;
+    if( !rc && ((n = edit_check(P, &R, b)) < 0) ) rc = 12;
+    if( !rc && (n * 4 > full) ) rc = 13;
+    /* the lengths must add up */
+    if( !rc && pegc_edit_input(P, b, -1, 0, 1, 0) ) rc = 14;
+    if( !rc && pegc_edit_input(P, b, -1, strlen(b) + 1, 0, 0) ) rc = 15;
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Like sum_action(), but adds to the parser's client data, so that
+   parsers sharing the action's rule have their own sums.
+*/
+static bool client_sum_action( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    return sum_action( st, m, pegc_get_client_data(st) );
+}
+
+int grammar_test()
+{
+    MARKER("Testing shared grammars...\n");
+    int rc = 0;
+    pegc_grammar * G = pegc_create_grammar();
+    pegc_parser * B = pegc_grammar_builder(G);
+    if( ! B ) rc = 1;
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const num = pegc_r_action_d_v(B, PegcRule_int_dec, client_sum_action, 0);
+    /* item := (num / quoted / word / '-') ';' */
+    PegcRule const alt = pegc_r_or_ev(B,
+				      num,
+				      pegc_r_string_quoted(B, '"', '\\', 0),
+				      pegc_r_plus_p(&PegcRule_alpha),
+				      pegc_r_char('-',true),
+				      end);
+    PegcRule R = pegc_r_and_ev(B,
+			       pegc_r_plus_v(B, pegc_r_and_ev(B, alt, pegc_r_char(';',true), end)),
+			       PegcRule_eof,
+			       end);
+    pegc_optimize(B, &R); /* for the dispatch tables */
+    if( !rc && pegc_create_grammar_parser(G, "1;", -1) ) rc = 3; /* not frozen */
+    if( !rc && ! pegc_grammar_freeze(G) ) rc = 4;
+    if( !rc && pegc_grammar_builder(G) ) rc = 5;
+    char const * in[2] = { "1;abc;\"x;y\";20;-;", "300;-;4;\"\\\"\";" };
+    long const expect[2] = { 21, 304 };
+    pegc_parser * P[2] = { 0, 0 };
+    long sums[2] = { 0, 0 };
+    int i = 0;
+    for( ; !rc && (i < 2); ++i )
+    {
+	P[i] = pegc_create_grammar_parser(G, in[i], -1);
+	if( ! P[i] || (G != pegc_get_grammar(P[i])) ) rc = 6;
+	else pegc_set_client_data(P[i], &sums[i]);
+    }
+    /* interleave the parses and their actions */
+    for( i = 0; !rc && (i < 2); ++i )
+    {
+	if( ! pegc_parse(P[i], &R) ) rc = 7;
+    }
+    for( i = 0; !rc && (i < 2); ++i )
+    {
+	if( ! pegc_trigger_actions(P[i]) ) rc = 8;
+	else if( sums[i] != expect[i] )
+	{
+	    MARKER("Expected sum %ld, got %ld.\n", expect[i], sums[i]);
+	    rc = 9;
+	}
+    }
+    for( i = 0; i < 2; ++i ) pegc_destroy_parser(P[i]);
+    pegc_destroy_grammar(G);
+    return rc;
+}
+
+/**
+   Client data for order_action().
+*/
+struct order_check
+{
+    long count;
+    long last;
+    bool ordered;
+};
+
+/**
+   Checks that the numbers it gets (via the parser's client data)
+   arrive in increasing order.
+*/
+static bool order_action( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    struct order_check * oc = (struct order_check *)pegc_get_client_data(st);
+    long v = 0;
+    if( ! oc || ! pegc_get_number_long(st, m, &v) ) return false;
+    if( oc->count && (v <= oc->last) ) oc->ordered = false;
+    oc->last = v;
+    ++oc->count;
+    return true;
+}
+
+int parallel_test()
+{
+    MARKER("Testing parallel parsing...\n");
+    int rc = 0;
+    pegc_grammar * G = pegc_create_grammar();
+    pegc_parser * B = pegc_grammar_builder(G);
+    PegcRule const end = PegcRule_invalid;
+    /* line := [a-z]+ '=' int '\n' */
+    PegcRule const line = pegc_r_and_ev(B,
+					pegc_r_plus_v(B, pegc_r_charclass(B, "[a-z]")),
+					pegc_r_char('=',true),
+					pegc_r_action_d_v(B, PegcRule_int_dec, order_action, 0),
+					pegc_r_char('\n',true),
+					end);
+    PegcRule const nl = pegc_r_char('\n',true);
+    pegc_grammar_freeze(G);
+    enum { Lines = 60000 };
+    char * text = (char *)malloc( Lines * 16 );
+    char * p = text;
+    int i = 0;
+    for( ; i < Lines; ++i ) p += sprintf( p, "%s=%d\n", (i & 1) ? "abc" : "x", i );
+    struct order_check oc;
+    pegc_parser * P = pegc_create_grammar_parser(G, text, p - text);
+    pegc_set_client_data(P, &oc);
+    for( i = 0; !rc && (i < 3); ++i )
+    {
+	unsigned int const threads[3] = { 1, 4, 3 };
+	memset( &oc, 0, sizeof(oc) );
+	oc.ordered = true;
+	pegc_set_input(P, text, p - text);
+	if( ! pegc_parse_parallel(P, &line, '\n', (2 == i) ? &nl : 0, threads[i]) ) rc = 1;
+	else if( (oc.count != Lines) || ! oc.ordered || ! pegc_eof(P) )
+	{
+	    MARKER("Got %ld of %d records, ordered=%d.\n", oc.count, (int)Lines, (int)oc.ordered);
+	    rc = 2;
+	}
+    }
+    if( !rc )
+    { /* a bad record late in the input */
+	char const * msg = 0;
+	size_t el = 0, ec = 0;
+	char * bad = strstr( text + (p - text) * 3 / 4, "abc=" );
+	*bad = '?';
+	memset( &oc, 0, sizeof(oc) );
+	oc.ordered = true;
+	pegc_set_input(P, text, p - text);
+	if( pegc_parse_parallel(P, &line, '\n', 0, 4) ) rc = 3;
+	else if( ! (msg = pegc_get_error(P, &el, &ec)) || ! strstr(msg, "offset") ) rc = 4;
+	else if( ! oc.count || (oc.count >= Lines) || ! oc.ordered ) rc = 5;
+	else
+	{ /* positions are in P's input, not the failing chunk's */
+	    size_t badLine = 1;
+	    char const * x = text;
+	    for( ; x < bad; ++x ) if( '\n' == *x ) ++badLine;
+	    pegc_failure_info info;
+	    char const * hdr = strstr(msg, "near line");
+	    if( (el != badLine) || (ec != 0) || ! hdr || strstr(hdr + 1, "near line") ) rc = 6;
+	    else if( ! pegc_get_failure_info(P, &info) || (info.pos != bad)
+		     || (info.line != badLine) || (info.col != 0) ) rc = 7;
+	    if( rc )
+	    {
+		MARKER("Error at %u:%u, expecting %u:0: %s\n",
+		       (unsigned int)el, (unsigned int)ec, (unsigned int)badLine, msg);
+	    }
+	}
+    }
+    pegc_destroy_parser(P);
+    if( !rc )
+    { /* requires a grammar parser */
+	P = pegc_create_parser( "a=1\n", -1 );
+	if( pegc_parse_parallel(P, &line, '\n', 0, 2) || ! pegc_has_error(P) ) rc = 6;
+	pegc_destroy_parser(P);
+    }
+    free(text);
+    pegc_destroy_grammar(G);
+    return rc;
+}
+
+int reset_test()
+{
+    MARKER("Testing parser reuse...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    long sum = 0;
+    PegcRule const R = pegc_r_and_ev(P,
+				     pegc_r_plus_p(&PegcRule_alpha),
+				     pegc_r_char('=',true),
+				     pegc_r_action_d_v(P, PegcRule_int_dec, sum_action, &sum),
+				     PegcRule_eof,
+				     end);
+    pegc_set_memo_mode(P, PEGC_MEMO_ALL);
+    /* reset drops queued actions */
+    pegc_set_input(P, "a=5", -1);
+    if( ! pegc_parse(P, &R) ) rc = 1;
+    if( !rc && (! pegc_reset(P, "b=7", -1) || ! pegc_trigger_actions(P) || sum) ) rc = 2;
+    pegc_const_iterator const in[] = { "x=1", "y=20", "bad", "z=300xyz", "z=300" };
+    long const len[] = { -1, -1, -1, 5, -1 };
+    bool const expect[] = { true, true, false, true, true };
+    bool res[5];
+    size_t alloced = 0;
+    int i = 0;
+    for( ; !rc && (i < 3); ++i )
+    {
+	sum = 0;
+	memset( res, 0, sizeof(res) );
+	if( 4 != pegc_parse_many(P, &R, in, len, 5, res) ) rc = 3;
+	else if( memcmp(res, expect, sizeof(res)) ) rc = 4;
+	else if( 621 != sum ) rc = 5;
+	else if( i && (alloced != pegc_get_stats(P).alloced) )
+	{
+	    MARKER("Repeated batch changed alloced from %u to %u.\n",
+		   (unsigned int)alloced, (unsigned int)pegc_get_stats(P).alloced);
+	    rc = 6;
+	}
+	alloced = pegc_get_stats(P).alloced;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int alloc_test()
+{
+    MARKER("Testing the rule arena...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule * r1 = pegc_alloc_r(P, 0, 0);
+    PegcRule * r2 = pegc_alloc_r(P, 0, 0);
+    char * big = (char *)pegc_alloc(P, 64 * 1024);
+    PegcRule * r3 = pegc_alloc_r(P, 0, 0);
+    long double * ld = (long double *)pegc_alloc(P, 1);
+    if( ! r1 || ! r2 || ! big || ! r3 || ! ld ) rc = 1;
+    /* consecutive small objects are adjacent, even around big ones */
+    else if( ((char *)r2 <= (char *)r1) || ((char *)r2 - (char *)r1) > (long)(2 * sizeof(PegcRule)) ) rc = 2;
+    else if( ((char *)r3 <= (char *)r2) || ((char *)r3 - (char *)r2) > (long)(2 * sizeof(PegcRule)) ) rc = 3;
+    else if( big[0] || big[64 * 1024 - 1] || *ld ) rc = 4;
+    else if( 0 != ((size_t)ld % sizeof(long double)) ) rc = 5;
+    if( !rc )
+    { /* list rules and names live in the arena, too */
+	PegcRule const end = PegcRule_invalid;
+	PegcRule const R = pegc_r_or_ev(P, pegc_r_char('a',true), pegc_r_string("bc",true), end);
+	if( ! run_test(P, R, "arena_list", "bc", "bc", false) ) rc = 6;
+	else if( ! R.name || ! *R.name ) rc = 7;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Checks that queued actions are each run with the number converted
+   when they were queued, in queue order.
+*/
+static bool seq_action( pegc_parser * st, pegc_cursor const * m, void * data )
+{
+    long v = 0;
+    long * next = (long *)data;
+    if( ! pegc_get_number_long(st, m, &v) || (v != *next) ) return false;
+    ++*next;
+    return true;
+}
+
+int queue_test()
+{
+    MARKER("Testing the delayed action queue...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    long next = 0;
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const num = pegc_r_action_d_v(P, PegcRule_int_dec, seq_action, &next);
+    PegcRule const R = pegc_r_and_ev(P, num, pegc_r_star_v(P, pegc_r_and_ev(P, pegc_r_char(',',true), num, end)),
+				     PegcRule_eof, end);
+    static char in[8 * 1000];
+    int len = 0;
+    int i = 0;
+    for( ; i < 1000; ++i ) len += sprintf( in + len, "%s%d", i ? "," : "", i );
+    size_t alloced = 0;
+    for( i = 0; !rc && (i < 3); ++i )
+    {
+	next = 0;
+	pegc_set_input(P, in, len);
+	if( ! pegc_parse(P, &R) ) rc = 1;
+	else if( ! pegc_trigger_actions(P) || (1000 != next) ) rc = 2;
+	else if( i && (alloced != pegc_get_stats(P).alloced) ) rc = 3;
+	alloced = pegc_get_stats(P).alloced;
+	pegc_clear_actions(P);
+	if( !rc && (! pegc_trigger_actions(P) || (1000 != next)) ) rc = 4;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int backtrack_test()
+{
+    MARKER("Testing that backtracking drops queued actions...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    long sum = 0;
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const num = pegc_r_action_d_v(P, PegcRule_int_dec, sum_action, &sum);
+    /* The first alternative matches the number before failing, and
+       the lookahead matches it again without consuming it. */
+    PegcRule const R = pegc_r_and_ev(P,
+				     pegc_r_or_ev(P,
+						  pegc_r_and_ev(P, num, pegc_r_char('x',true), end),
+						  pegc_r_and_ev(P, pegc_r_at_v(P, num), num, pegc_r_char('y',true), end),
+						  end),
+				     pegc_r_opt_v(P, pegc_r_and_ev(P, pegc_r_char(',',true), num, pegc_r_char('!',true), end)),
+				     end);
+    pegc_program const * prog = pegc_compile(P, &R);
+    if( ! prog ) rc = 1;
+    int i = 0;
+    for( ; !rc && (i < 3); ++i )
+    {
+	if( 2 == i ) pegc_set_memo_mode(P, PEGC_MEMO_ALL);
+	sum = 0;
+	pegc_set_input(P, "5y,7", -1);
+	bool const ok = (1 == i) ? pegc_parse_program(P, prog) : pegc_parse(P, &R);
+	if( ! ok || (2 != (pegc_pos(P) - pegc_begin(P))) ) rc = 2;
+	else if( ! pegc_trigger_actions(P) || (5 != sum) )
+	{
+	    MARKER("Pass #%d: sum=%ld, expecting 5.\n", i, sum);
+	    rc = 3;
+	}
+	pegc_clear_actions(P);
+	pegc_set_input(P, "8z", -1);
+	if( !rc && pegc_parse(P, &R) ) rc = 4;
+	else if( !rc && (! pegc_trigger_actions(P) || (5 != sum)) ) rc = 5;
+	pegc_clear_actions(P);
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int ref_test()
+{
+    MARKER("Testing forward references...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    /* Expr <- Group / [a-z]+ ; Group <- '(' Expr* ')' */
+    PegcRule const Expr = pegc_r_ref( P, "Expr" );
+    PegcRule const Group = pegc_r_and_ev(P, pegc_r_char('(',true), pegc_r_star_v(P, Expr),
+					 pegc_r_char(')',true), end);
+    if( ! Expr.rule || ! pegc_ref_bind( &Expr, pegc_r_or_ev(P, Group, pegc_r_plus_p(&PegcRule_lower), end) ) ) rc = 1;
+    else if( pegc_ref_bind( &Group, Expr ) || pegc_ref_bind( &Expr, PegcRule_invalid ) ) rc = 2;
+    pegc_program const * prog = rc ? 0 : pegc_compile(P, &Expr);
+    if( !rc && ! prog ) rc = 3;
+    int i = 0;
+    for( ; !rc && (i < 3); ++i )
+    {
+	if( 2 == i ) pegc_set_memo_mode(P, PEGC_MEMO_ALL);
+	pegc_set_input(P, "(ab(c()(de)))x", -1);
+	bool const ok = (1 == i) ? pegc_parse_program(P, prog) : pegc_parse(P, &Expr);
+	if( ! ok || (13 != (pegc_pos(P) - pegc_begin(P))) ) rc = 4;
+	pegc_set_input(P, "(ab(c)", -1);
+	if( !rc && ((1 == i) ? pegc_parse_program(P, prog) : pegc_parse(P, &Expr)) ) rc = 5;
+    }
+    if( !rc )
+    { /* an unbound reference fails with an error */
+	PegcRule const U = pegc_r_ref( P, "Unbound" );
+	pegc_set_input(P, "x", -1);
+	if( pegc_parse(P, &U) || ! pegc_has_error(P) ) rc = 6;
+	else if( ! strstr( pegc_get_error(P, 0, 0), "Unbound" ) ) rc = 7;
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+/**
+   Compares pegc_line_col_at() with a plain count of the newlines at
+   each position of P's input, visiting the positions backwards so
+   that most lookups hit the part of the index which is already
+   built. Returns false on a mismatch.
+*/
+static bool line_col_check( pegc_parser * P )
+{
+    pegc_const_iterator const beg = pegc_begin(P);
+    long const len = pegc_end(P) - beg;
+    long i = len;
+    for( ; i >= 0; --i )
+    {
+	size_t line = 1, col = 0, l = 0, c = 0;
+	long k = 0;
+	for( ; k < i; ++k )
+	{
+	    if( '\n' == beg[k] ) { ++line; col = 0; }
+	    else ++col;
+	}
+	if( ! pegc_line_col_at(P, beg + i, &l, &c) || (l != line) || (c != col) )
+	{
+	    MARKER("Offset %ld: got %u:%u, expecting %u:%u.\n", i,
+		   (unsigned int)l, (unsigned int)c, (unsigned int)line, (unsigned int)col);
+	    return false;
+	}
+    }
+    return true;
+}
+
+int lines_test()
+{
+    MARKER("Testing the newline index...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    static char in[2048];
+    int i = 0;
+    for( ; i < (int)sizeof(in) - 1; ++i ) in[i] = (0 == (i % 7)) || (0 == (i % 13)) ? '\n' : 'x';
+    size_t line = 0, col = 0;
+    pegc_set_input(P, "ab\ncd", -1);
+    pegc_advance(P, 4);
+    if( ! pegc_line_col(P, &line, &col) || (2 != line) || (1 != col) ) rc = 1;
+    else if( pegc_line_col_at(P, pegc_end(P) + 1, &line, &col) ) rc = 2;
+    pegc_set_input(P, in, -1);
+    if( !rc && ! line_col_check(P) ) rc = 3;
+    /* an edit keeps the index up to the edit offset */
+    in[1000] = 'x';
+    in[1001] = '\n';
+    if( !rc && (! pegc_edit_input(P, in, -1, 1000, 2, 2) || ! line_col_check(P)) ) rc = 4;
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int failure_test()
+{
+    MARKER("Testing farthest-failure tracking...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const end = PegcRule_invalid;
+    PegcRule const comma = pegc_r_char(',',true);
+    PegcRule const close = pegc_r_char(')',true);
+    PegcRule const R = pegc_r_and_ev(P, pegc_r_char('(',true), PegcRule_digits,
+				     pegc_r_star_v(P, pegc_r_and_ev(P, comma, PegcRule_digits, end)),
+				     close, end);
+    pegc_program const * prog = pegc_compile(P, &R);
+    pegc_failure_info info;
+    int i = 0;
+    for( ; !rc && (i < 2); ++i )
+    {
+	pegc_set_input(P, "(12,34;", -1);
+	if( ! pegc_get_failure_info(P, &info) || info.failed ) rc = 1;
+	else if( (i ? pegc_parse_program(P, prog) : pegc_parse(P, &R))
+		 || (pegc_pos(P) != pegc_begin(P)) ) rc = 2;
+	else if( ! pegc_get_failure_info(P, &info) || ! info.failed ) rc = 3;
+	else if( (6 != (info.pos - pegc_begin(P))) || (1 != info.line) || (6 != info.col) ) rc = 4;
+	/* another digit, a comma, or the closing paren */
+	else if( (3 != info.count) || info.truncated ) rc = 5;
+	else if( (info.expected[0].rule != PegcRule_digit.rule)
+		 || (info.expected[1].rule != comma.rule) || (',' != *(char const *)info.expected[1].data)
+		 || (info.expected[2].rule != close.rule) || (')' != *(char const *)info.expected[2].data) ) rc = 6;
+	if( rc )
+	{
+	    MARKER("Pass #%d failed: rc=%d, pos=%d count=%u\n", i, rc,
+			(int)(info.pos - pegc_begin(P)), (unsigned int)info.count);
+	}
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
+int error_test()
+{
+    MARKER("Testing deferred error messages...\n");
+    int rc = 0;
+    pegc_parser * P = pegc_create_parser( 0, 0 );
+    PegcRule const Q = pegc_r_string_quoted(P, '"', '\\', 0);
+    char const * msg = 0;
+    size_t line = 0, col = 0;
+    pegc_set_input(P, "\"ab\ncd", -1);
+    if( pegc_parse(P, &Q) || ! pegc_has_error(P) ) rc = 1;
+    else if( ! (msg = pegc_get_error(P, &line, &col)) ) rc = 2;
+    else if( (2 != line) || (2 != col)
+	     || ! strstr(msg, "hit EOF") || ! strstr(msg, "started near line 1, col 0") ) rc = 3;
+    /* The rendered message is cached until the error changes. */
+    else if( msg != pegc_get_error(P, 0, 0) ) rc = 4;
+    else if( ! pegc_set_error_e(P, "%s #%d", "custom", 7) || ! pegc_has_error(P) ) rc = 5;
+    else if( ! (msg = pegc_get_error(P, 0, 0)) || ! strstr(msg, "custom #7") ) rc = 6;
+    else if( pegc_set_match(P, pegc_begin(P), pegc_end(P) + 1, false) ) rc = 7;
+    else if( ! (msg = pegc_get_error(P, 0, 0)) || ! strstr(msg, "out of bounds") ) rc = 8;
+    else if( ! pegc_set_error_e(P, 0, 0) || pegc_has_error(P) || pegc_get_error(P, 0, 0) ) rc = 9;
+    if( ! rc )
+    {
+	/* Over-long messages are truncated rather than allocated. */
+	static char big[2000];
+	memset( big, 'x', sizeof(big) - 1 );
+	if( ! pegc_set_error_e(P, "%s!", big) || ! (msg = pegc_get_error(P, 0, 0)) ) rc = 10;
+	else if( (strlen(msg) >= sizeof(big)) || strchr(msg, '!') ) rc = 11;
+    }
+    if( rc )
+    {
+	MARKER("rc=%d, line=%u col=%u msg=[%s]\n", rc, (unsigned int)line, (unsigned int)col,
+	       msg ? msg : "");
+    }
+    pegc_destroy_parser(P);
+    return rc;
+}
+
 #include "whrc.h"
 #include "whclob.h"
 static void free_string(void*p)
@@ -225,6 +1500,30 @@ int main( int argc, char ** argv )
     int rc = 0;
     if(!rc) rc = rc_test();
     if(!rc) rc = a_test();
+    if(!rc) rc = memo_test();
+    if(!rc) rc = vm_test();
+    if(!rc) rc = depth_test();
+    if(!rc) rc = leftrec_test();
+    if(!rc) rc = optimize_test();
+    if(!rc) rc = dispatch_test();
+    if(!rc) rc = charclass_test();
+    if(!rc) rc = span_test();
+    if(!rc) rc = until_test();
+    if(!rc) rc = number_test();
+    if(!rc) rc = slice_test();
+    if(!rc) rc = file_test();
+    if(!rc) rc = stream_test();
+    if(!rc) rc = edit_test();
+    if(!rc) rc = grammar_test();
+    if(!rc) rc = parallel_test();
+    if(!rc) rc = reset_test();
+    if(!rc) rc = alloc_test();
+    if(!rc) rc = queue_test();
+    if(!rc) rc = backtrack_test();
+    if(!rc) rc = ref_test();
+    if(!rc) rc = lines_test();
+    if(!rc) rc = failure_test();
+    if(!rc) rc = error_test();
     //if(!rc) rc = test_actions();
     if( 1 )
     {
@@ -342,7 +342,7 @@ void * whgc_unregister( whgc_context * cx, void * key )
 void * whgc_search( whgc_context const * cx, void const * key )
 {
     if( ! cx || !key || !cx->ht ) return 0;
-    whgc_gc_entry * e = (whgc_gc_entry*)whhash_search( cx->ht, key );
+    whgc_gc_entry * e = (whgc_gc_entry*)whhash_search_shared( cx->ht, key );
     return e ? e->value : 0;
 }
 
@@ -256,6 +256,9 @@ extern "C" {
     /**
        Searches the given context for the given key. Returns 0 if the
        key is not found. Ownership of the returned objet is not changed.
+
+       This does not modify cx, so several threads may search a
+       context at once as long as none of them modifies it.
     */
     void * whgc_search( whgc_context const * cx, void const * key );
 
@@ -410,6 +410,22 @@ static whhash_entry * whhash_search_entry(whhash_table *h,
     return NULL;
 }
 
+void *
+whhash_search_shared(whhash_table const *h, void const *k)
+{
+    if( !h || !k || !h->tablelength ) return 0;
+    whhash_val_t const hashvalue = whhash_hash((whhash_table *)h,k);
+    whhash_entry const * e = h->table[whhash_index(h->tablelength,hashvalue)];
+    for( ; e; e = e->next )
+    {
+        if ((k == e->k) || ((hashvalue == e->h) && (h->eqfn(k, e->k))))
+	{
+	    return e->v;
+	}
+    }
+    return 0;
+}
+
 short whhash_contains(whhash_table *h, void const *k)
 {
     whhash_entry * e = whhash_search_entry(h,k);
@@ -357,6 +357,15 @@ int fnname (whhash_table *h, keytype *k, valuetype *v) \
 void *
 whhash_search(whhash_table *h, void const * k);
 
+/**
+   Works like whhash_search() but does not update h's statistics, and
+   therefore does not modify h at all. Any number of threads may call
+   this concurrently on the same table as long as no thread modifies
+   the table at the same time.
+*/
+void *
+whhash_search_shared(whhash_table const *h, void const * k);
+
 /**
    Works like whhash_search() but can differentiate between a found
    value of 0 and no-such-element.